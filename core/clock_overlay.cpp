@@ -0,0 +1,174 @@
+/*
+ * clock_overlay.cpp
+ *
+ * This file is part of openreplay. See the README file for the license
+ * terms governing its use.
+ */
+
+#include "clock_overlay.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdexcept>
+
+#include <cairo.h>
+#include <pango/pangocairo.h>
+
+ClockOverlay::ClockOverlay(Picture *bg_, const char *font_family,
+        int font_height, int text_x_, int text_y_) {
+    if (bg_->pix_fmt != BGRA8) {
+        throw std::runtime_error("clock background must be BGRA8");
+    }
+
+    bg = bg_;
+    text_x = text_x_;
+    text_y = text_y_;
+    cached = NULL;
+    cached_value = 0;
+    cached_fmt = BGRA8;
+
+    render_atlas(font_family, font_height);
+}
+
+ClockOverlay::~ClockOverlay( ) {
+    if (cached) {
+        Picture::free(cached);
+    }
+    Picture::free(atlas);
+    Picture::free(bg);
+}
+
+/* lay out every glyph side by side, one Pango call each */
+void ClockOverlay::render_atlas(const char *font_family, int font_height) {
+    PangoFontDescription *font = pango_font_description_new( );
+    PangoRectangle logical;
+    char glyph[2] = { 0, 0 };
+    int i, x, h;
+
+    pango_font_description_set_family(font, font_family);
+    pango_font_description_set_weight(font, PANGO_WEIGHT_BOLD);
+    pango_font_description_set_absolute_size(font, font_height * PANGO_SCALE);
+
+    /* measure first, using a throwaway surface */
+    cairo_surface_t *surf = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 1, 1);
+    cairo_t *cr = cairo_create(surf);
+    PangoLayout *layout = pango_cairo_create_layout(cr);
+    pango_layout_set_font_description(layout, font);
+
+    x = 0;
+    h = 1;
+    for (i = 0; i < N_CLOCK_GLYPHS; i++) {
+        glyph[0] = CLOCK_GLYPHS[i];
+        pango_layout_set_text(layout, glyph, -1);
+        pango_layout_get_pixel_extents(layout, NULL, &logical);
+
+        glyph_x[i] = x;
+        glyph_w[i] = logical.width;
+        x += logical.width;
+        if (logical.height > h) {
+            h = logical.height;
+        }
+    }
+
+    g_object_unref(layout);
+    cairo_destroy(cr);
+    cairo_surface_destroy(surf);
+
+    /* now draw them all into the atlas */
+    atlas = Picture::alloc(x, h, 4 * x, BGRA8);
+    memset(atlas->data, 0, atlas->line_pitch * atlas->h);
+
+    surf = atlas->get_cairo( );
+    cr = cairo_create(surf);
+    layout = pango_cairo_create_layout(cr);
+    pango_layout_set_font_description(layout, font);
+    cairo_set_source_rgb(cr, 1.0, 1.0, 1.0);
+
+    for (i = 0; i < N_CLOCK_GLYPHS; i++) {
+        glyph[0] = CLOCK_GLYPHS[i];
+        pango_layout_set_text(layout, glyph, -1);
+        cairo_move_to(cr, glyph_x[i], 0);
+        pango_cairo_show_layout(cr, layout);
+    }
+
+    g_object_unref(layout);
+    cairo_destroy(cr);
+    cairo_surface_flush(surf);
+    cairo_surface_destroy(surf);
+    pango_font_description_free(font);
+}
+
+/*
+ * Stamp the glyphs for value onto a copy of the background with cairo's
+ * OVER (both sides premultiplied), then premultiply the result for
+ * dst_fmt.
+ */
+void ClockOverlay::compose(uint32_t value, enum pixel_format dst_fmt) {
+    char text[16];
+    const char *glyph;
+    Picture *image;
+    uint8_t *src_ptr, *dst_ptr;
+    int i, gx, gy, pen_x, c, g;
+    int blit_w, blit_h;
+
+    if (value >= 600) {
+        snprintf(text, sizeof(text), "%d:%02d", value / 600, (value / 10) % 60);
+    } else {
+        snprintf(text, sizeof(text), ":%02d.%d", value / 10, value % 10);
+    }
+
+    image = Picture::copy(bg);
+
+    blit_h = atlas->h;
+    if (text_y + blit_h > image->h) {
+        blit_h = image->h - text_y;
+    }
+
+    pen_x = text_x;
+    for (i = 0; text[i] != '\0'; i++) {
+        glyph = strchr(CLOCK_GLYPHS, text[i]);
+        if (glyph == NULL) {
+            continue;
+        }
+        g = glyph - CLOCK_GLYPHS;
+
+        blit_w = glyph_w[g];
+        if (pen_x + blit_w > image->w) {
+            blit_w = image->w - pen_x;
+        }
+
+        for (gy = 0; gy < blit_h; gy++) {
+            src_ptr = atlas->scanline(gy) + 4 * glyph_x[g];
+            dst_ptr = image->scanline(text_y + gy) + 4 * pen_x;
+            for (gx = 0; gx < blit_w; gx++) {
+                for (c = 0; c < 4; c++) {
+                    dst_ptr[c] = src_ptr[c] + dst_ptr[c] * (255 - src_ptr[3]) / 255;
+                }
+                src_ptr += 4;
+                dst_ptr += 4;
+            }
+        }
+
+        pen_x += glyph_w[g];
+    }
+
+    if (cached) {
+        Picture::free(cached);
+    }
+
+    image->unpremultiply( );
+    cached = image->premultiply(dst_fmt);
+    cached_value = value;
+    cached_fmt = dst_fmt;
+    Picture::free(image);
+}
+
+void ClockOverlay::draw(Picture *dst, uint32_t value, int x, int y) {
+    MutexLock lock(mut);
+
+    if (cached == NULL || value != cached_value || dst->pix_fmt != cached_fmt) {
+        compose(value, dst->pix_fmt);
+    }
+
+    dst->draw(cached, x, y, 0, 0, 0);
+}
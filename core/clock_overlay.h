@@ -0,0 +1,46 @@
+#ifndef _CLOCK_OVERLAY_H
+#define _CLOCK_OVERLAY_H
+
+#include "picture.h"
+#include "mutex.h"
+
+#include <stdint.h>
+
+/* characters the scoreboard clock can show */
+#define CLOCK_GLYPHS "0123456789:."
+#define N_CLOCK_GLYPHS 12
+
+/*
+ * The scoreboard clock graphic for playout. The digits are rendered
+ * through Pango once, into an atlas; after that a new clock value just
+ * stamps glyphs from the atlas onto a copy of the background. The result
+ * is kept premultiplied for the output format until the value changes,
+ * so most frames only pay for the blend. Safe to share between render
+ * threads.
+ */
+class ClockOverlay {
+    public:
+        /* takes ownership of bg, which must be BGRA8 */
+        ClockOverlay(Picture *bg, const char *font_family, int font_height,
+            int text_x, int text_y);
+        ~ClockOverlay( );
+
+        /* draw the clock for value (in tenths of a second) onto dst at x, y */
+        void draw(Picture *dst, uint32_t value, int x, int y);
+
+    protected:
+        void render_atlas(const char *font_family, int font_height);
+        void compose(uint32_t value, enum pixel_format dst_fmt);
+
+        Picture *bg;
+        Picture *atlas; /* BGRA8, white text premultiplied as cairo draws it */
+        int glyph_x[N_CLOCK_GLYPHS], glyph_w[N_CLOCK_GLYPHS];
+        int text_x, text_y;
+
+        Picture *cached;
+        uint32_t cached_value;
+        enum pixel_format cached_fmt;
+        Mutex mut;
+};
+
+#endif
@@ -0,0 +1,243 @@
+/*
+ * convert_bench.cpp
+ *
+ * This file is part of openreplay. See the README file for the license
+ * terms governing its use.
+ *
+ * Throughput benchmark for the Picture colorspace conversions: runs every
+ * conversion with every kernel set this CPU supports over a frame of
+ * noise, reports Mpixel/s, and checks each set's output against the
+ * scalar code. Overlay blending is timed the same way, as a full frame of
+ * premultiplied UYVY8 overlay, and so are the frame interpolation mix and
+ * SAD kernels on UYVY8 frames.
+ */
+
+#include "picture_convert.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+struct conversion {
+    const char *name;
+    int in_bpp, out_bpp;
+    size_t offset; /* of the kernel in struct convert_kernels */
+};
+
+static const struct conversion conversions[] = {
+    { "rgb8_to_uyvy8", 3, 2, offsetof(struct convert_kernels, rgb8_to_uyvy8) },
+    { "uyvy8_to_rgb8", 2, 3, offsetof(struct convert_kernels, uyvy8_to_rgb8) },
+    { "uyvy8_to_yuv8", 2, 3, offsetof(struct convert_kernels, uyvy8_to_yuv8) },
+    { "yuv8_to_uyvy8", 3, 2, offsetof(struct convert_kernels, yuv8_to_uyvy8) },
+    { "bgra8_to_yuva8", 4, 4, offsetof(struct convert_kernels, bgra8_to_yuva8) },
+};
+
+#define N_CONVERSIONS (sizeof(conversions) / sizeof(conversions[0]))
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static convert_line_fn kernel(const struct convert_kernels *k,
+        const struct conversion *c) {
+    return *(const convert_line_fn *)((const char *)k + c->offset);
+}
+
+static void convert_frame(convert_line_fn fn, const uint8_t *in, uint8_t *out,
+        int w, int h, int in_bpp, int out_bpp) {
+    int i;
+
+    for (i = 0; i < h; i++) {
+        fn(in + i * w * in_bpp, out + i * w * out_bpp, w);
+    }
+}
+
+void usage(const char *name) {
+    fprintf(stderr, "usage: %s [options]\n", name);
+    fprintf(stderr, "-w, --width <n>: frame width in pixels (default 1920)\n");
+    fprintf(stderr, "-h, --height <n>: frame height in lines (default 1080)\n");
+    fprintf(stderr, "-n, --frames <n>: frames to convert per test (default 100)\n");
+}
+
+int main(int argc, char **argv) {
+    int w = 1920, h = 1080, frames = 100;
+    int opt, i, f;
+    size_t j, max_size;
+    uint8_t *in, *ref, *out;
+    uint64_t start, elapsed;
+    const struct convert_kernels **sets, **k;
+    int failed = 0;
+
+    const struct option options[] = {
+        { "width", 1, NULL, 'w' },
+        { "height", 1, NULL, 'h' },
+        { "frames", 1, NULL, 'n' },
+        { 0, 0, 0, 0 }
+    };
+
+    while ((opt = getopt_long(argc, argv, "w:h:n:", options, NULL)) != EOF) {
+        switch (opt) {
+            case 'w':
+                w = atoi(optarg);
+                break;
+            case 'h':
+                h = atoi(optarg);
+                break;
+            case 'n':
+                frames = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (w <= 0 || w % 2 != 0 || h <= 0 || frames <= 0) {
+        fprintf(stderr, "width must be even, and everything positive\n");
+        return 1;
+    }
+
+    max_size = (size_t) w * h * 4;
+    in = (uint8_t *) malloc(max_size);
+    ref = (uint8_t *) malloc(max_size);
+    out = (uint8_t *) malloc(max_size);
+
+    if (!in || !ref || !out) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    srand(1);
+    for (j = 0; j < max_size; j++) {
+        in[j] = rand( );
+    }
+
+    sets = convert_kernels_available( );
+    fprintf(stderr, "%dx%d, %d frames per test, best kernels: %s\n",
+        w, h, frames, convert_kernels_best( )->name);
+
+    for (i = 0; i < (int) N_CONVERSIONS; i++) {
+        const struct conversion *c = &conversions[i];
+        size_t out_size = (size_t) w * h * c->out_bpp;
+
+        convert_frame(kernel(sets[0], c), in, ref, w, h, c->in_bpp, c->out_bpp);
+
+        for (k = sets; *k != NULL; k++) {
+            convert_line_fn fn = kernel(*k, c);
+
+            memset(out, 0, out_size);
+            convert_frame(fn, in, out, w, h, c->in_bpp, c->out_bpp);
+            bool match = (memcmp(out, ref, out_size) == 0);
+            if (!match) {
+                failed = 1;
+            }
+
+            start = now_ns( );
+            for (f = 0; f < frames; f++) {
+                convert_frame(fn, in, out, w, h, c->in_bpp, c->out_bpp);
+            }
+            elapsed = now_ns( ) - start;
+
+            printf("%-16s %-8s %10.1f Mpixel/s  %s\n", c->name, (*k)->name,
+                (double) w * h * frames * 1000.0 / elapsed,
+                match ? "ok" : "MISMATCH");
+        }
+    }
+
+    /* in holds the overlay colors; use the alpha from the far end */
+    size_t blend_size = (size_t) w * h * 2;
+    const uint8_t *alpha = in + max_size - blend_size;
+
+    for (k = sets; *k != NULL; k++) {
+        blend_line_fn blend = (*k)->blend_premultiplied;
+
+        memset(ref, 0x80, blend_size);
+        sets[0]->blend_premultiplied(ref, in, alpha, blend_size);
+        memset(out, 0x80, blend_size);
+        blend(out, in, alpha, blend_size);
+        bool match = (memcmp(out, ref, blend_size) == 0);
+        if (!match) {
+            failed = 1;
+        }
+
+        start = now_ns( );
+        for (f = 0; f < frames; f++) {
+            for (i = 0; i < h; i++) {
+                blend(out + i * w * 2, in + i * w * 2, alpha + i * w * 2, w * 2);
+            }
+        }
+        elapsed = now_ns( ) - start;
+
+        printf("%-16s %-8s %10.1f Mpixel/s  %s\n", "blend_uyvy8p", (*k)->name,
+            (double) w * h * frames * 1000.0 / elapsed,
+            match ? "ok" : "MISMATCH");
+    }
+
+    /* mix the frame with the far end of the noise at a 3/8 weight */
+    for (k = sets; *k != NULL; k++) {
+        mix_line_fn mix = (*k)->mix;
+
+        sets[0]->mix(in, alpha, ref, blend_size, 96);
+        mix(in, alpha, out, blend_size, 96);
+        bool match = (memcmp(out, ref, blend_size) == 0);
+        if (!match) {
+            failed = 1;
+        }
+
+        start = now_ns( );
+        for (f = 0; f < frames; f++) {
+            for (i = 0; i < h; i++) {
+                mix(in + i * w * 2, alpha + i * w * 2, out + i * w * 2, w * 2, 96);
+            }
+        }
+        elapsed = now_ns( ) - start;
+
+        printf("%-16s %-8s %10.1f Mpixel/s  %s\n", "mix_uyvy8", (*k)->name,
+            (double) w * h * frames * 1000.0 / elapsed,
+            match ? "ok" : "MISMATCH");
+    }
+
+    /* SAD over 16x16 pixel blocks, as the motion search does it */
+    for (k = sets; *k != NULL; k++) {
+        sad_block_fn sad = (*k)->sad;
+        unsigned int total = 0;
+        int x;
+
+        bool match = (sad(in, w * 2, alpha, w * 2, w * 2, h) 
+            == sets[0]->sad(in, w * 2, alpha, w * 2, w * 2, h));
+        if (!match) {
+            failed = 1;
+        }
+
+        start = now_ns( );
+        for (f = 0; f < frames; f++) {
+            for (i = 0; i + 16 <= h; i += 16) {
+                for (x = 0; x + 16 <= w; x += 16) {
+                    total += sad(in + (i * w + x) * 2, w * 2, 
+                        alpha + (i * w + x) * 2, w * 2, 32, 16);
+                }
+            }
+        }
+        elapsed = now_ns( ) - start;
+
+        printf("%-16s %-8s %10.1f Mpixel/s  %s\n", "sad_uyvy8", (*k)->name,
+            (double) w * h * frames * 1000.0 / elapsed,
+            match ? "ok" : "MISMATCH");
+
+        /* keep the loop from being optimized away */
+        if (total == 1) {
+            fprintf(stderr, " ");
+        }
+    }
+
+    free(in);
+    free(ref);
+    free(out);
+
+    return failed;
+}
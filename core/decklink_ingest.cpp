@@ -11,11 +11,14 @@
 #include "mmap_state.h"
 #include "mjpeg_config.h"
 #include "mjpeg_frame.h"
+#include "ingest_pipeline.h"
 #include "stats.h"
+#include "video_mode.h"
 
 MmapBuffer *buffer;
+const struct video_mode *mode;
 MmapState *clock_ipc;
-MJPEGEncoder enc;
+IngestPipeline *pipeline;
 EncodeStats stats(29.97);
 
 #define FRAMES_PER_SEC 30
@@ -27,7 +30,6 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived(IDeckLinkVideoInputFrame
     
     BMDTimeValue time, duration;
     int frameCount, frames, sec, min, hr;
-    int size;
     void *data;
     Picture *p;
 
@@ -40,24 +42,30 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived(IDeckLinkVideoInputFrame
         }
         else
         {
-            size = videoFrame->GetRowBytes( ) * videoFrame->GetHeight( );
+            int row_bytes = videoFrame->GetRowBytes( );
+            int height = videoFrame->GetHeight( );
+            int skip = 0, lines = mode->h;
             videoFrame->GetBytes(&data);
 
-            // make a 720x480 frame
-            p = Picture::alloc(720, 480, 1440, UYVY8);
-            memcpy(p->data, ((uint8_t *) data) + 6*1440, 480*1440); 
-
-            // encode frame
-            mjpeg_frame *frm = enc.encode_full(p, true);
-            Picture::free(p);
-
-            clock_ipc->get(&frm->clock, sizeof(frm->clock));
-            frm->odd_dominant = true;
-            frm->interlaced = false;
-            buffer->put(frm, sizeof(struct mjpeg_frame) + frm->f1size);
-            
-            stats.output_bytes(frm->f1size);
-            stats.finish_frames(1);
+            /* 
+             * NTSC comes in as 720x486; drop the extra lines off the top
+             * so we store the same 480 lines everyone else does.
+             */
+            if (height > mode->h) {
+                skip = height - mode->h;
+            } else {
+                lines = height;
+            }
+
+            p = Picture::alloc(mode->w, mode->h, 2*mode->w, UYVY8);
+            for (int j = 0; j < lines; j++) {
+                memcpy(p->scanline(j), ((uint8_t *) data) + (skip + j) * row_bytes,
+                    (row_bytes < p->line_pitch) ? row_bytes : p->line_pitch);
+            }
+
+            // encoding happens off the driver's thread, so a slow frame
+            // doesn't make us miss the next one
+            pipeline->submit(p);
         }
 
     }
@@ -79,25 +87,36 @@ int main(int argc, char *argv[])
     DeckLinkCaptureDelegate *delegate = 0;
     IDeckLinkDisplayMode *displayMode = 0;
     IDeckLinkConfiguration *deckLinkConfig = 0;
-    BMDDisplayMode selectedDisplayMode = bmdModeNTSC;
+    BMDDisplayMode selectedDisplayMode;
     BMDVideoConnection input_source;
     int displayModeCount = 0;
     int exitStatus = 1;
     int ch;
     int cardIndex = 2;
+    struct ingest_options opts;
     HRESULT result;
     const char *string;
 
-    if (argc < 3) {
-        fprintf(stderr, "usage: %s card_index buffer\n", argv[0]);
+    if (!parse_ingest_options(argc, argv, &opts) || argc - optind < 2) {
+        fprintf(stderr, "usage: %s " INGEST_USAGE " card_index buffer\n", argv[0]);
         return 1;
     }
 
-    cardIndex = atoi(argv[1]);
+    mode = opts.mode;
 
-    buffer = new MmapBuffer(argv[2], MAX_FRAME_SIZE, true);
+    stats.autoprint(60);
+
+    cardIndex = atoi(argv[optind]);
+    selectedDisplayMode = (BMDDisplayMode) mode->decklink_mode;
+
+    buffer = open_ingest_buffer(argv[optind + 1], &opts);
     clock_ipc = new MmapState("clock_ipc");
 
+    pipeline = new IngestPipeline(buffer, mode, clock_ipc);
+    pipeline->set_options(&opts);
+    pipeline->set_stats(&stats);
+    pipeline->start( );
+
     if (!deckLinkIterator)
     {
         fprintf(stderr, "This application requires the DeckLink drivers installed.\n");
@@ -125,18 +144,21 @@ int main(int argc, char *argv[])
     if (deckLink->QueryInterface(IID_IDeckLinkConfiguration, (void**)&deckLinkConfig) != S_OK)
         goto bail;
 
-    /* set composite in */
-    if (deckLinkConfig->SetInt(bmdDeckLinkConfigVideoInputConnection, 
-            bmdVideoConnectionComposite) != S_OK) {
-        fprintf(stderr, "failed to set composite input\n");
-        goto bail;
-    }
+    /* NTSC comes in over composite; HD modes use whatever input is set */
+    if (strcmp(mode->name, "ntsc") == 0) {
+        /* set composite in */
+        if (deckLinkConfig->SetInt(bmdDeckLinkConfigVideoInputConnection, 
+                bmdVideoConnectionComposite) != S_OK) {
+            fprintf(stderr, "failed to set composite input\n");
+            goto bail;
+        }
 
-    /* set 7.5 IRE setup level*/
-    if (deckLinkConfig->SetInt(bmdDeckLinkConfigAnalogVideoInputFlags,
-            bmdAnalogVideoFlagCompositeSetup75) != S_OK) {
-        fprintf(stderr, "failed to set analog input flags\n");
-        goto bail;
+        /* set 7.5 IRE setup level*/
+        if (deckLinkConfig->SetInt(bmdDeckLinkConfigAnalogVideoInputFlags,
+                bmdAnalogVideoFlagCompositeSetup75) != S_OK) {
+            fprintf(stderr, "failed to set analog input flags\n");
+            goto bail;
+        }
     }
 
     delegate = new DeckLinkCaptureDelegate();
@@ -0,0 +1,168 @@
+/*
+ * decode_test.cpp
+ *
+ * This file is part of openreplay. See the README file for the license
+ * terms governing its use.
+ *
+ * Checks that MJPEGDecoder gets over a damaged frame: decodes a torn
+ * record (the front of one frame with a newer one written over the rest,
+ * as a reader can see in the ring buffer) and a truncated one, in each
+ * output format, and after each makes sure the same decoder still decodes
+ * a good frame to the same picture it did before. Also checks that once a
+ * borrowed frame's header has been copied out, scribbling on the original
+ * doesn't change what gets decoded.
+ */
+
+#include "mjpeg_frame.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdexcept>
+
+#define TEST_W 320
+#define TEST_H 240
+
+static const enum pixel_format formats[] = { UYVY8, RGB8, YUV8 };
+static const char *format_names[] = { "UYVY8", "RGB8", "YUV8" };
+#define N_FORMATS (sizeof(formats) / sizeof(formats[0]))
+
+static struct mjpeg_frame *copy_frame(struct mjpeg_frame *frame) {
+    size_t size = sizeof(struct mjpeg_frame) + frame->f1size;
+    struct mjpeg_frame *ret = (struct mjpeg_frame *) malloc(size);
+    memcpy(ret, frame, size);
+    return ret;
+}
+
+static bool same_picture(Picture *a, Picture *b) {
+    int i;
+
+    if (a->w != b->w || a->h != b->h || a->line_pitch != b->line_pitch) {
+        return false;
+    }
+    for (i = 0; i < a->h; i++) {
+        if (memcmp(a->scanline(i), b->scanline(i), a->line_pitch) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* decode a damaged frame (which may or may not throw), then a good one */
+static bool recovers(MJPEGDecoder *dec, struct mjpeg_frame *bad,
+        struct mjpeg_frame *good, Picture *ref, enum pixel_format fmt) {
+    Picture *out;
+    bool ok;
+
+    try {
+        out = dec->decode_full(bad, fmt);
+        Picture::free(out);
+    } catch (std::runtime_error &e) {
+        /* expected, the point is what happens next */
+    }
+
+    try {
+        out = dec->decode_full(good, fmt);
+    } catch (std::runtime_error &e) {
+        return false;
+    }
+
+    ok = same_picture(out, ref);
+    Picture::free(out);
+    return ok;
+}
+
+/* decode from a copy of the header, then wreck the one in the frame */
+static bool uses_copy(MJPEGDecoder *dec, struct mjpeg_frame *good,
+        Picture *ref, enum pixel_format fmt) {
+    struct mjpeg_frame *frame = copy_frame(good);
+    struct mjpeg_frame header;
+    Picture *out;
+    bool ok;
+
+    if (!mjpeg_frame_copy_header(frame, 
+            sizeof(struct mjpeg_frame) + good->f1size, &header)) {
+        free(frame);
+        return false;
+    }
+
+    /* what a new record landing on top of the header could leave */
+    frame->interlaced = true;
+    frame->f1size = (size_t) -1 / 2;
+    frame->f2size = (size_t) -1 / 2;
+
+    try {
+        out = dec->decode_full(&header, frame->data, fmt);
+    } catch (std::runtime_error &e) {
+        free(frame);
+        return false;
+    }
+
+    ok = same_picture(out, ref);
+    Picture::free(out);
+    free(frame);
+    return ok;
+}
+
+int main(void) {
+    MJPEGEncoder enc;
+    MJPEGDecoder dec;
+    struct mjpeg_frame *good, *torn, *truncated;
+    Picture *src, *ref;
+    unsigned int i;
+    int x, y, failed = 0;
+    bool ok;
+
+    /* something with detail in it, so the scan isn't trivially short */
+    src = Picture::alloc(TEST_W, TEST_H, 2 * TEST_W, UYVY8);
+    for (y = 0; y < TEST_H; y++) {
+        for (x = 0; x < 2 * TEST_W; x++) {
+            src->scanline(y)[x] = (x * 7 + y * 13 + (x ^ y)) & 0xff;
+        }
+    }
+
+    good = copy_frame(enc.encode_full(src, false));
+
+    /* the second half overwritten by the start of the next frame */
+    torn = copy_frame(good);
+    memcpy(torn->data + good->f1size / 2, good->data,
+        good->f1size - good->f1size / 2);
+
+    /* cut off half way, so the data runs out in the middle of the scan */
+    truncated = copy_frame(good);
+    truncated->f1size = good->f1size / 2;
+
+    for (i = 0; i < N_FORMATS; i++) {
+        try {
+            ref = dec.decode_full(good, formats[i]);
+        } catch (std::runtime_error &e) {
+            printf("%-6s can't decode the good frame\n", format_names[i]);
+            failed = 1;
+            continue;
+        }
+
+        ok = recovers(&dec, torn, good, ref, formats[i]);
+        printf("%-6s after a torn frame:        %s\n", format_names[i],
+            ok ? "ok" : "FAILED");
+        failed |= !ok;
+
+        ok = recovers(&dec, truncated, good, ref, formats[i]);
+        printf("%-6s after a truncated frame:   %s\n", format_names[i],
+            ok ? "ok" : "FAILED");
+        failed |= !ok;
+
+        ok = uses_copy(&dec, good, ref, formats[i]);
+        printf("%-6s with its header rewritten: %s\n", format_names[i],
+            ok ? "ok" : "FAILED");
+        failed |= !ok;
+
+        Picture::free(ref);
+    }
+
+    free(good);
+    free(torn);
+    free(truncated);
+    Picture::free(src);
+
+    return failed;
+}
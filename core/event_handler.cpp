@@ -1,36 +1,192 @@
 #include "event_handler.h"
 
+#include <stdexcept>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int hist_bucket(uint64_t value) {
+    int bucket = 0;
+
+    while (value != 0 && bucket < EVT_HIST_BUCKETS - 1) {
+        value >>= 1;
+        bucket++;
+    }
+
+    return bucket;
+}
+
 EventHandler::EventHandler( ) {
+    int i, j;
+
+    for (i = 0; i < EVT_PRIORITIES; i++) {
+        for (j = 0; j < EVT_QUEUE_SIZE; j++) {
+            lanes[i].slots[j].sequence = j;
+        }
+        lanes[i].enqueue_pos = 0;
+        lanes[i].dequeue_pos = 0;
+    }
+
+    sleeping = 0;
+    memset(&st, 0, sizeof(st));
 
+    wake_fd = eventfd(0, 0);
+    if (wake_fd == -1) {
+        throw std::runtime_error("EventHandler: eventfd failed");
+    }
 }
 
 EventHandler::~EventHandler( ) {
+    close(wake_fd);
+}
+
+bool EventHandler::post_event(uint32_t event, void *arg, uint32_t priority) {
+    struct lane *l;
+    struct slot *s;
+    uint32_t pos, seq;
+    int32_t diff;
+    uint64_t one = 1;
+
+    if (priority >= EVT_PRIORITIES) {
+        priority = EVT_PRIORITIES - 1;
+    }
+    l = &lanes[priority];
+
+    /* claim a slot: it's free when its sequence number equals pos */
+    pos = l->enqueue_pos;
+    for (;;) {
+        s = &l->slots[pos % EVT_QUEUE_SIZE];
+        seq = s->sequence;
+        __sync_synchronize( );
+        diff = (int32_t) (seq - pos);
 
+        if (diff == 0) {
+            if (__sync_bool_compare_and_swap(&l->enqueue_pos, pos, pos + 1)) {
+                break;
+            }
+            pos = l->enqueue_pos;
+        } else if (diff < 0) {
+            /* the waiter hasn't got round to this slot yet: full */
+            __sync_fetch_and_add(&st.dropped, 1);
+            return false;
+        } else {
+            /* someone else got it first */
+            pos = l->enqueue_pos;
+        }
+    }
+
+    s->event = event;
+    s->arg = arg;
+    s->posted_ns = now_ns( );
+    __sync_fetch_and_add(&st.depth[hist_bucket(pos - l->dequeue_pos)], 1);
+    __sync_fetch_and_add(&st.posted, 1);
+
+    /* publish it, then wake the waiter if (and only if) it's asleep */
+    __sync_synchronize( );
+    s->sequence = pos + 1;
+    __sync_synchronize( );
+
+    if (sleeping) {
+        if (write(wake_fd, &one, sizeof(one)) != sizeof(one)) {
+            perror("EventHandler: eventfd write");
+        }
+    }
+
+    return true;
 }
 
-void EventHandler::post_event(uint32_t event, void *arg, uint32_t priority) {
-    struct event_data evt;
-    evt.event = event;
-    evt.arg = arg;
+/* highest priority first; only ever called from the waiting thread */
+bool EventHandler::try_dequeue(uint32_t &event, void *&arg) {
+    struct lane *l;
+    struct slot *s;
+    int i;
+
+    for (i = EVT_PRIORITIES - 1; i >= 0; i--) {
+        l = &lanes[i];
+        s = &l->slots[l->dequeue_pos % EVT_QUEUE_SIZE];
+
+        if (s->sequence != l->dequeue_pos + 1) {
+            continue;   /* nothing (finished) at this priority */
+        }
+        __sync_synchronize( );
+
+        event = s->event;
+        arg = s->arg;
+        st.wait_usec[hist_bucket((now_ns( ) - s->posted_ns) / 1000)]++;
 
-    { MutexLock lock(mut);        
-        queued_events.push_back(evt);
-        event_ready.signal( );
+        /* hand the slot back to the posters for the next lap */
+        __sync_synchronize( );
+        s->sequence = l->dequeue_pos + EVT_QUEUE_SIZE;
+        l->dequeue_pos++;
+        return true;
     }
+
+    return false;
 }
 
 uint32_t EventHandler::wait_event(void *&arg) {
-    struct event_data ret;
+    uint32_t event;
+    uint64_t count;
+
+    for (;;) {
+        if (try_dequeue(event, arg)) {
+            return event;
+        }
+
+        /* 
+         * Say we're going to sleep, then look again: a post that missed
+         * the first look is either seen now or sees sleeping and wakes us.
+         */
+        sleeping = 1;
+        __sync_synchronize( );
+
+        if (try_dequeue(event, arg)) {
+            sleeping = 0;
+            return event;
+        }
 
-    { MutexLock lock(mut);
-        if (queued_events.empty( )) {
-            /* wait until something is ready */
-            event_ready.wait(mut); 
+        if (read(wake_fd, &count, sizeof(count)) != sizeof(count) && errno != EINTR) {
+            perror("EventHandler: eventfd read");
         }
 
-        ret = queued_events.front( );
-        queued_events.pop_front( );
-        arg = ret.arg;
-        return ret.event;
+        sleeping = 0;
+        __sync_synchronize( );
+    }
+}
+
+void EventHandler::stats(struct event_stats *out) {
+    /* counters only go up; a torn snapshot is good enough for reporting */
+    memcpy(out, &st, sizeof(*out));
+}
+
+void EventHandler::print_stats(const char *name) {
+    struct event_stats s;
+    int i;
+
+    stats(&s);
+    fprintf(stderr, "%s: %llu events, %llu dropped\n", name, 
+        (unsigned long long) s.posted, (unsigned long long) s.dropped);
+
+    fprintf(stderr, "  queue depth:");
+    for (i = 0; i < EVT_HIST_BUCKETS; i++) {
+        if (s.depth[i] != 0) {
+            fprintf(stderr, " <%d:%llu", 1 << i, (unsigned long long) s.depth[i]);
+        }
+    }
+
+    fprintf(stderr, "\n  wait usec:");
+    for (i = 0; i < EVT_HIST_BUCKETS; i++) {
+        if (s.wait_usec[i] != 0) {
+            fprintf(stderr, " <%d:%llu", 1 << i, (unsigned long long) s.wait_usec[i]);
+        }
     }
+    fprintf(stderr, "\n");
 }
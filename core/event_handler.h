@@ -1,26 +1,73 @@
 #ifndef _EVENT_HANDLER_H
 #define _EVENT_HANDLER_H
 
-#include "mutex.h"
-#include "condition.h"
-#include <list>
 #include <stdint.h>
+#include <stdio.h>
 
+/*
+ * Events with a higher priority are handled before any lower priority
+ * ones that are waiting; within a priority they come out in order.
+ * Anything past EVT_PRIORITIES - 1 counts as the top priority.
+ */
+#define EVT_PRIORITIES 4
+#define EVT_PRIORITY_NORMAL 0   /* commands, UI */
+#define EVT_PRIORITY_OUTPUT 3   /* output hardware deadlines */
+
+/* events each priority can hold before post_event starts refusing them */
+#define EVT_QUEUE_SIZE 256     /* power of 2 */
+
+/* histogram bucket n counts values from 2^(n-1) up to 2^n - 1 */
+#define EVT_HIST_BUCKETS 16
+
+struct event_stats {
+    uint64_t posted;
+    uint64_t dropped;                       /* queue was full */
+    uint64_t depth[EVT_HIST_BUCKETS];       /* events ahead of each new one */
+    uint64_t wait_usec[EVT_HIST_BUCKETS];   /* post to wait_event return */
+};
+
+/*
+ * Many threads post, one thread waits. post_event never blocks or
+ * allocates, so it's fine to call from the output card's callback thread:
+ * each priority is a fixed ring, claimed slot by slot with compare and
+ * swap. The waiting thread sleeps on an eventfd, which a poster only
+ * writes to when it's actually asleep.
+ */
 class EventHandler {
     public:
         EventHandler( );
         ~EventHandler( );
-        void post_event(uint32_t event, void *arg, uint32_t priority = 0);
+
+        /* false if the queue for that priority was full; arg is not freed */
+        bool post_event(uint32_t event, void *arg, uint32_t priority = 0);
         uint32_t wait_event(void *&arg);
 
+        void stats(struct event_stats *out);
+        void print_stats(const char *name);
+
     private:
-        struct event_data {
+        struct slot {
+            volatile uint32_t sequence;
             uint32_t event;
             void *arg;
+            uint64_t posted_ns;
+        };
+
+        struct lane {
+            struct slot slots[EVT_QUEUE_SIZE];
+            volatile uint32_t enqueue_pos;
+            /* keep the posters' and the waiter's counters off one line */
+            char pad[64 - sizeof(uint32_t)];
+            volatile uint32_t dequeue_pos;
         };
-        std::list<struct event_data> queued_events;
-        Condition event_ready;
-        Mutex mut;
+
+        bool try_dequeue(uint32_t &event, void *&arg);
+
+        struct lane lanes[EVT_PRIORITIES];
+        int wake_fd;
+        volatile int sleeping;
+
+        struct event_stats st;
 };
 
 #endif
@@ -0,0 +1,106 @@
+/*
+ * frame_cache.cpp
+ *
+ * This file is part of openreplay. See the README file for the license
+ * terms governing its use.
+ */
+
+#include "frame_cache.h"
+
+bool frame_cache_key::operator<(const struct frame_cache_key &k) const {
+    if (buffer != k.buffer) {
+        return buffer < k.buffer;
+    } else if (epoch != k.epoch) {
+        return epoch < k.epoch;
+    } else if (timecode != k.timecode) {
+        return timecode < k.timecode;
+    } else if (field != k.field) {
+        return field < k.field;
+    } else if (scale != k.scale) {
+        return scale < k.scale;
+    } else {
+        return pix_fmt < k.pix_fmt;
+    }
+}
+
+FrameCache::FrameCache(size_t budget_mb) {
+    budget = budget_mb << 20;
+    used = 0;
+    hits = 0;
+    misses = 0;
+    evictions = 0;
+}
+
+FrameCache::~FrameCache( ) {
+    evict_to(0);
+}
+
+Picture *FrameCache::get(const struct frame_cache_key &key, uint32_t *clock) {
+    MutexLock lock(mut);
+    index_t::iterator i = index.find(key);
+
+    if (i == index.end( )) {
+        misses++;
+        return NULL;
+    }
+
+    /* move it to the front; the iterator stays good */
+    lru.splice(lru.begin( ), lru, i->second);
+    hits++;
+
+    if (clock != NULL) {
+        *clock = i->second->clock;
+    }
+    i->second->pic->addref( );
+    return i->second->pic;
+}
+
+void FrameCache::put(const struct frame_cache_key &key, Picture *pic, 
+        uint32_t clock) {
+    struct entry e;
+    
+    e.key = key;
+    e.pic = pic;
+    e.clock = clock;
+    e.size = pic->line_pitch * pic->h;
+
+    if (e.size > budget) {
+        return;
+    }
+
+    MutexLock lock(mut);
+
+    /* two threads can decode the same frame at once; keep the first */
+    if (index.find(key) != index.end( )) {
+        return;
+    }
+
+    evict_to(budget - e.size);
+
+    pic->addref( );
+    lru.push_front(e);
+    index[key] = lru.begin( );
+    used += e.size;
+}
+
+/* drop least recently used pictures until we're down to target bytes */
+void FrameCache::evict_to(size_t target) {
+    while (used > target && !lru.empty( )) {
+        struct entry &e = lru.back( );
+        used -= e.size;
+        index.erase(e.key);
+        Picture::free(e.pic);
+        lru.pop_back( );
+        evictions++;
+    }
+}
+
+void FrameCache::stats(struct frame_cache_stats *out) {
+    MutexLock lock(mut);
+
+    out->hits = hits;
+    out->misses = misses;
+    out->evictions = evictions;
+    out->frames = lru.size( );
+    out->bytes = used;
+}
@@ -0,0 +1,89 @@
+#ifndef _FRAME_CACHE_H
+#define _FRAME_CACHE_H
+
+#include "picture.h"
+#include "mmap_buffer.h"
+#include "mutex.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <list>
+#include <map>
+
+/* which part of the frame a cached picture holds */
+enum cached_field {
+    CACHED_FULL_FRAME,
+    CACHED_FIRST_FIELD,     /* line doubled */
+    CACHED_SECOND_FIELD     /* line doubled */
+};
+
+struct frame_cache_key {
+    const MmapBuffer *buffer;
+    uint16_t epoch;             /* buffer->get_epoch( ), read before borrowing */
+    timecode_t timecode;
+    enum cached_field field;
+    int scale;                  /* DCT scale denominator it was decoded at */
+    enum pixel_format pix_fmt;
+
+    bool operator<(const struct frame_cache_key &k) const;
+};
+
+struct frame_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint32_t frames;    /* pictures held right now */
+    size_t bytes;       /* and their total size */
+};
+
+/*
+ * Decoded frames, kept in least recently used order up to a budget in
+ * megabytes, so scrubbing back and forth over recent material doesn't
+ * decode the same JPEGs over and over. Within one epoch of a buffer a
+ * timecode never changes what's stored under it (it can only drop out of
+ * the buffer), but resetting the buffer starts the timecodes over, which
+ * is why the epoch is part of the key. Entries from before a reset are
+ * never asked for again and just age out.
+ *
+ * Pictures handed out are shared with the cache and every other user:
+ * treat them as read-only, copy before drawing on them, and Picture::free
+ * them when done. Safe to use from several threads.
+ */
+class FrameCache {
+    public:
+        FrameCache(size_t budget_mb);
+        ~FrameCache( );
+
+        /* 
+         * A new reference to the picture for key (and the scoreboard
+         * clock of its frame), or NULL if it isn't cached.
+         */
+        Picture *get(const struct frame_cache_key &key, uint32_t *clock = NULL);
+
+        /* remember pic for key; the cache takes a reference of its own */
+        void put(const struct frame_cache_key &key, Picture *pic, 
+            uint32_t clock = 0);
+
+        void stats(struct frame_cache_stats *out);
+
+    protected:
+        struct entry {
+            struct frame_cache_key key;
+            Picture *pic;
+            uint32_t clock;
+            size_t size;
+        };
+
+        typedef std::list<struct entry> lru_list_t; /* most recent first */
+        typedef std::map<struct frame_cache_key, lru_list_t::iterator> index_t;
+
+        void evict_to(size_t target);
+
+        lru_list_t lru;
+        index_t index;
+        size_t budget, used;
+        uint64_t hits, misses, evictions;
+        Mutex mut;
+};
+
+#endif
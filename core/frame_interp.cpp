@@ -0,0 +1,233 @@
+/*
+ * frame_interp.cpp
+ *
+ * This file is part of openreplay. See the README file for the license
+ * terms governing its use.
+ *
+ * In-between frames for slow motion playout. The per-byte work (the
+ * weighted average, and the sums of absolute differences for motion
+ * search) goes through the picture_convert kernels, so it gets the SIMD
+ * versions where the CPU has them.
+ */
+
+#include "frame_interp.h"
+#include "picture_convert.h"
+
+#include <stdlib.h>
+#include <stdexcept>
+#include <vector>
+
+#define MOTION_BLOCK 16     /* pixels square */
+#define MOTION_RANGE_X 16   /* pixels either way */
+#define MOTION_RANGE_Y 8    /* lines either way */
+#define MOTION_STEP_X 4     /* pattern search step; the last pass is */
+#define MOTION_STEP_Y 2     /* done at 2 pixels and 1 line */
+#define MOTION_MAX_STEPS 8  /* moves of the pattern before we give up */
+
+/* average difference per byte past which a block is treated as unmatched */
+#define MOTION_BAD_MATCH 24
+
+struct motion_vector {
+    int dx, dy;     /* b(x, y) looks like a(x + dx, y + dy); dx is even */
+};
+
+static void check_pair(Picture *a, Picture *b) {
+    if (a->pix_fmt != UYVY8 || b->pix_fmt != UYVY8) {
+        throw std::runtime_error("interpolation needs UYVY8 pictures");
+    }
+
+    if (a->w != b->w || a->h != b->h) {
+        throw std::runtime_error("interpolating pictures of different sizes");
+    }
+}
+
+Picture *interpolate_blend(Picture *a, Picture *b, int weight) {
+    const struct convert_kernels *k = convert_kernels_best( );
+    Picture *out;
+    int y;
+
+    check_pair(a, b);
+    out = Picture::alloc(a->w, a->h, 2 * a->w, UYVY8);
+
+    for (y = 0; y < out->h; y++) {
+        k->mix(a->scanline(y), b->scanline(y), out->scanline(y), 2 * out->w, weight);
+    }
+
+    return out;
+}
+
+/* 
+ * SAD between the bw x bh block of b at (x, y) and a at (x + dx, y + dy).
+ * Only every other line is compared: the pictures we interpolate are line
+ * doubled fields, so the odd lines add nothing.
+ */
+static unsigned int block_sad(const struct convert_kernels *k, Picture *a,
+        Picture *b, int x, int y, int bw, int bh, int dx, int dy) {
+    return k->sad(a->scanline(y + dy) + 2 * (x + dx), 2 * a->line_pitch,
+        b->scanline(y) + 2 * x, 2 * b->line_pitch, 2 * bw, (bh + 1) / 2);
+}
+
+/* is the block at (x, y) moved by (dx, dy) still inside the picture? */
+static bool block_fits(Picture *p, int x, int y, int bw, int bh, int dx, int dy) {
+    return x + dx >= 0 && x + dx + bw <= p->w 
+        && y + dy >= 0 && y + dy + bh <= p->h;
+}
+
+/* the search state for one block */
+struct block_search {
+    const struct convert_kernels *k;
+    Picture *a, *b;
+    int x, y, bw, bh;
+    struct motion_vector best;
+    unsigned int best_sad;
+};
+
+/* try a candidate vector; true if it's the new best */
+static bool try_vector(struct block_search *s, int dx, int dy) {
+    unsigned int sad;
+
+    if (dx < -MOTION_RANGE_X || dx > MOTION_RANGE_X 
+            || dy < -MOTION_RANGE_Y || dy > MOTION_RANGE_Y
+            || !block_fits(s->a, s->x, s->y, s->bw, s->bh, dx, dy)) {
+        return false;
+    }
+
+    sad = block_sad(s->k, s->a, s->b, s->x, s->y, s->bw, s->bh, dx, dy);
+    if (sad < s->best_sad) {
+        s->best_sad = sad;
+        s->best.dx = dx;
+        s->best.dy = dy;
+        return true;
+    }
+
+    return false;
+}
+
+/* move a square of 8 neighbours around until the center is best */
+static void pattern_search(struct block_search *s, int step_x, int step_y) {
+    static const int pattern[8][2] = {
+        { -1, -1 }, { 0, -1 }, { 1, -1 }, 
+        { -1, 0 }, { 1, 0 },
+        { -1, 1 }, { 0, 1 }, { 1, 1 }
+    };
+    struct motion_vector center;
+    bool moved = true;
+    int i, n;
+
+    for (n = 0; moved && n < MOTION_MAX_STEPS; n++) {
+        center = s->best;
+        moved = false;
+        for (i = 0; i < 8; i++) {
+            if (try_vector(s, center.dx + pattern[i][0] * step_x, 
+                    center.dy + pattern[i][1] * step_y)) {
+                moved = true;
+            }
+        }
+    }
+}
+
+/*
+ * Start from the best of no motion and the vectors already found for
+ * the blocks to the left and above (things tend to move together), then
+ * walk a search pattern downhill from there, coarse and then fine. Far
+ * cheaper than trying the whole range, and good enough for camera pans
+ * and people running.
+ */
+static struct motion_vector search_block(const struct convert_kernels *k,
+        Picture *a, Picture *b, int x, int y, int bw, int bh,
+        const struct motion_vector *left, const struct motion_vector *above) {
+    struct block_search s;
+
+    s.k = k;
+    s.a = a;
+    s.b = b;
+    s.x = x;
+    s.y = y;
+    s.bw = bw;
+    s.bh = bh;
+
+    /* ties go to the zero vector, which can't make things worse */
+    s.best.dx = 0;
+    s.best.dy = 0;
+    s.best_sad = block_sad(k, a, b, x, y, bw, bh, 0, 0);
+
+    if (left != NULL) {
+        try_vector(&s, left->dx, left->dy);
+    }
+    if (above != NULL) {
+        try_vector(&s, above->dx, above->dy);
+    }
+
+    pattern_search(&s, MOTION_STEP_X, MOTION_STEP_Y);
+    pattern_search(&s, 2, 1);
+
+    /* 
+     * Compared 2 * bw bytes on every other line. Motion of one pixel
+     * pair or line or less crossfades cleanly anyway, and can't be split
+     * into the half steps it would need.
+     */
+    if (s.best_sad > (unsigned int) (MOTION_BAD_MATCH * bw * bh)
+            || (abs(s.best.dx) <= 2 && abs(s.best.dy) <= 1)) {
+        s.best.dx = 0;
+        s.best.dy = 0;
+    }
+
+    return s.best;
+}
+
+/* d * weight / 256, rounded to nearest (away from zero on a tie) */
+static int scale_vector(int d, int weight) {
+    int n = d * weight;
+    return (n >= 0) ? (n + 128) / 256 : -((128 - n) / 256);
+}
+
+Picture *interpolate_motion(Picture *a, Picture *b, int weight) {
+    const struct convert_kernels *k = convert_kernels_best( );
+    struct motion_vector mv;
+    Picture *out;
+    int x, y, r, bw, bh, col;
+    int ax, ay, bx, by;
+
+    check_pair(a, b);
+    out = Picture::alloc(a->w, a->h, 2 * a->w, UYVY8);
+
+    /* vectors of the block row above, overwritten as we go along */
+    int cols = (out->w + MOTION_BLOCK - 1) / MOTION_BLOCK;
+    std::vector<struct motion_vector> row(cols);
+
+    for (y = 0; y < out->h; y += MOTION_BLOCK) {
+        bh = (y + MOTION_BLOCK <= out->h) ? MOTION_BLOCK : out->h - y;
+
+        for (x = 0, col = 0; x < out->w; x += MOTION_BLOCK, col++) {
+            bw = (x + MOTION_BLOCK <= out->w) ? MOTION_BLOCK : out->w - x;
+            mv = search_block(k, a, b, x, y, bw, bh,
+                (col > 0) ? &row[col - 1] : NULL,
+                (y > 0) ? &row[col] : NULL);
+            row[col] = mv;
+
+            /*
+             * Something at (x, y) in b was at (x + dx, y + dy) in a, so
+             * at weight it's at (x + dx * (1 - weight), ...). Pull the
+             * output block from that far along the path on both sides,
+             * keeping whole UYVY pixel pairs.
+             */
+            ax = 2 * scale_vector(mv.dx / 2, weight);
+            ay = scale_vector(mv.dy, weight);
+            bx = ax - mv.dx;
+            by = ay - mv.dy;
+
+            if (!block_fits(a, x, y, bw, bh, ax, ay) 
+                    || !block_fits(b, x, y, bw, bh, bx, by)) {
+                ax = ay = bx = by = 0;
+            }
+
+            for (r = 0; r < bh; r++) {
+                k->mix(a->scanline(y + ay + r) + 2 * (x + ax), 
+                    b->scanline(y + by + r) + 2 * (x + bx),
+                    out->scanline(y + r) + 2 * x, 2 * bw, weight);
+            }
+        }
+    }
+
+    return out;
+}
@@ -0,0 +1,23 @@
+#ifndef _FRAME_INTERP_H
+#define _FRAME_INTERP_H
+
+#include "picture.h"
+
+/*
+ * Synthesize an in-between picture for slow motion, weight/256 of the way
+ * from a to b. Both must be UYVY8 and the same size; the result is a new
+ * UYVY8 picture. Both only read their inputs and keep no state, so the
+ * playout render threads can each work on a different frame at once.
+ */
+
+/* plain crossfade */
+Picture *interpolate_blend(Picture *a, Picture *b, int weight);
+
+/*
+ * Block-matching motion compensation: each block of b is matched against
+ * a nearby area of a, and the two are blended along that motion vector.
+ * Blocks with no decent match fall back to the crossfade.
+ */
+Picture *interpolate_motion(Picture *a, Picture *b, int weight);
+
+#endif
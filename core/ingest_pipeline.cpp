@@ -0,0 +1,522 @@
+/*
+ * ingest_pipeline.cpp
+ *
+ * This file is part of openreplay. See the README file for the license
+ * terms governing its use.
+ */
+
+#include "ingest_pipeline.h"
+#include "mjpeg_config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <stdexcept>
+#include <string>
+
+bool find_overflow_policy(const char *name, enum overflow_policy *policy) {
+    if (strcmp(name, "drop-oldest") == 0) {
+        *policy = OVERFLOW_DROP_OLDEST;
+    } else if (strcmp(name, "drop-newest") == 0) {
+        *policy = OVERFLOW_DROP_NEWEST;
+    } else if (strcmp(name, "lower-quality") == 0) {
+        *policy = OVERFLOW_LOWER_QUALITY;
+    } else {
+        fprintf(stderr, "overflow policies: drop-oldest drop-newest lower-quality\n");
+        return false;
+    }
+
+    return true;
+}
+
+bool parse_ingest_options(int argc, char * const *argv,
+        struct ingest_options *opts, const char *extra_optstring,
+        const struct option *extra_options, ingest_option_fn extra,
+        void *extra_data) {
+    static const struct option ingest_options[] = {
+        { "mode", 1, NULL, 'm' },
+        { "threads", 1, NULL, 'j' },
+        { "encoders", 1, NULL, 'e' },
+        { "queue", 1, NULL, 'q' },
+        { "overflow", 1, NULL, 'o' },
+        { "target-size", 1, NULL, 't' },
+        { "keep-hot", 1, NULL, 'k' },
+        { "recover", 0, NULL, 'r' },
+        { 0, 0, 0, 0 }
+    };
+
+    std::string optstring = std::string("m:j:e:q:o:t:k:r") + extra_optstring;
+    std::vector<struct option> options;
+    const struct option *o;
+    int opt;
+
+    opts->mode = default_video_mode( );
+    opts->band_threads = 1;
+    opts->encoders = DEFAULT_INGEST_ENCODERS;
+    opts->queue = DEFAULT_INGEST_QUEUE;
+    opts->policy = OVERFLOW_DROP_OLDEST;
+    opts->target_size = 0;
+    opts->hot_seconds = 0;
+    opts->recover = false;
+
+    for (o = extra_options; o != NULL && o->name != NULL; o++) {
+        options.push_back(*o);
+    }
+    for (o = ingest_options; ; o++) {
+        options.push_back(*o);
+        if (o->name == NULL) {
+            break;
+        }
+    }
+
+    while ((opt = getopt_long(argc, argv, optstring.c_str( ), 
+            &options[0], NULL)) != EOF) {
+        switch (opt) {
+            case 'm':
+                opts->mode = find_video_mode(optarg);
+                if (opts->mode == NULL) {
+                    list_video_modes( );
+                    return false;
+                }
+                break;
+            case 'j':
+                /* encode each frame in this many slices at once */
+                opts->band_threads = atoi(optarg);
+                if (opts->band_threads < 1 
+                        || opts->band_threads > MAX_ENCODE_THREADS) {
+                    fprintf(stderr, "threads must be 1 to %d\n", 
+                        MAX_ENCODE_THREADS);
+                    return false;
+                }
+                break;
+            case 'e':
+                /* and this many frames at once */
+                opts->encoders = atoi(optarg);
+                if (opts->encoders < 1 
+                        || opts->encoders > MAX_INGEST_ENCODERS) {
+                    fprintf(stderr, "encoders must be 1 to %d\n", 
+                        MAX_INGEST_ENCODERS);
+                    return false;
+                }
+                break;
+            case 'q':
+                opts->queue = atoi(optarg);
+                if (opts->queue < 1) {
+                    fprintf(stderr, "queue must be at least 1 frame\n");
+                    return false;
+                }
+                break;
+            case 'o':
+                if (!find_overflow_policy(optarg, &opts->policy)) {
+                    return false;
+                }
+                break;
+            case 't':
+                /* rate control: aim for frames about this big */
+                if (atoi(optarg) < 0) {
+                    fprintf(stderr, "target size can't be negative\n");
+                    return false;
+                }
+                opts->target_size = atoi(optarg);
+                break;
+            case 'k':
+                /* keep this many seconds of the newest frames in memory */
+                if (atoi(optarg) < 0) {
+                    fprintf(stderr, "keep-hot seconds can't be negative\n");
+                    return false;
+                }
+                opts->hot_seconds = atoi(optarg);
+                break;
+            case 'r':
+                /* pick up where a crashed ingest left off */
+                opts->recover = true;
+                break;
+            default:
+                if (opt == '?' || extra == NULL 
+                        || !extra(opt, optarg, extra_data)) {
+                    return false;
+                }
+                break;
+        }
+    }
+
+    return true;
+}
+
+MmapBuffer *open_ingest_buffer(const char *file,
+        const struct ingest_options *opts) {
+    MmapBuffer *buf = new MmapBuffer(file, MAX_FRAME_SIZE, !opts->recover);
+
+    if (opts->recover) {
+        if (buf->recover( )) {
+            fprintf(stderr, "recovered buffer up to timecode %d\n",
+                buf->get_timecode( ) + 1);
+        } else {
+            fprintf(stderr, "nothing to recover, starting an empty buffer\n");
+        }
+    }
+
+    buf->set_format(opts->mode->name);
+    if (opts->hot_seconds > 0 && !buf->keep_hot(opts->hot_seconds)) {
+        fprintf(stderr, "warning: not keeping the newest frames in memory\n");
+    }
+
+    return buf;
+}
+
+/* one encode thread, with an encoder all its own */
+class IngestEncodeWorker : public Thread {
+    public:
+        IngestEncodeWorker(IngestPipeline *p_, int band_threads,
+                size_t target_size, EncodeStats *stats) : p(p_) {
+            enc.set_threads(band_threads);
+            enc.set_target_size(target_size);
+            enc.set_max_frame_size(p->buffer->max_size( ));
+            enc.set_stats(stats);
+        }
+
+        virtual ~IngestEncodeWorker( ) { }
+
+    protected:
+        void run(void) {
+            p->encode(&enc);
+        }
+
+        IngestPipeline *p;
+        MJPEGEncoder enc;
+};
+
+class IngestWriter : public Thread {
+    public:
+        IngestWriter(IngestPipeline *p_) : p(p_) { }
+        virtual ~IngestWriter( ) { }
+
+    protected:
+        void run(void) {
+            p->write( );
+        }
+
+        IngestPipeline *p;
+};
+
+IngestPipeline::IngestPipeline(MmapBuffer *buffer_,
+        const struct video_mode *mode_, MmapState *clock_ipc_) {
+    buffer = buffer_;
+    mode = mode_;
+    clock_ipc = clock_ipc_;
+    stats = NULL;
+
+    n_encoders = DEFAULT_INGEST_ENCODERS;
+    band_threads = 1;
+    depth = DEFAULT_INGEST_QUEUE;
+    policy = OVERFLOW_DROP_OLDEST;
+    base_quality = quality = DEFAULT_INGEST_QUALITY;
+    target_size = 0;
+
+    waiting = 0;
+    dropped = 0;
+    last_size = 0;
+    finishing = false;
+    writer = NULL;
+}
+
+IngestPipeline::~IngestPipeline( ) {
+    finish( );
+}
+
+void IngestPipeline::set_encoders(int n) {
+    if (n < 1 || n > MAX_INGEST_ENCODERS) {
+        throw std::runtime_error("Invalid number of encoders");
+    }
+    n_encoders = n;
+}
+
+void IngestPipeline::set_band_threads(int n) {
+    band_threads = n;
+}
+
+void IngestPipeline::set_queue_depth(int frames) {
+    if (frames < 1) {
+        throw std::runtime_error("Invalid ingest queue depth");
+    }
+    depth = frames;
+}
+
+void IngestPipeline::set_overflow_policy(enum overflow_policy policy_) {
+    policy = policy_;
+}
+
+void IngestPipeline::set_quality(int quality_) {
+    if (quality_ < 0 || quality_ > 100) {
+        throw std::runtime_error("Invalid quality value supplied");
+    }
+    base_quality = quality = quality_;
+}
+
+void IngestPipeline::set_target_size(size_t bytes) {
+    target_size = bytes;
+}
+
+void IngestPipeline::set_stats(EncodeStats *stats_) {
+    stats = stats_;
+}
+
+void IngestPipeline::set_options(const struct ingest_options *opts) {
+    set_encoders(opts->encoders);
+    set_band_threads(opts->band_threads);
+    set_queue_depth(opts->queue);
+    set_overflow_policy(opts->policy);
+    set_target_size(opts->target_size);
+}
+
+void IngestPipeline::start(void) {
+    int i;
+
+    for (i = 0; i < n_encoders; i++) {
+        IngestEncodeWorker *w = new IngestEncodeWorker(this, band_threads,
+            target_size, stats);
+        workers.push_back(w);
+        w->start( );
+    }
+
+    writer = new IngestWriter(this);
+    writer->start( );
+}
+
+void IngestPipeline::finish(void) {
+    unsigned int i;
+
+    {
+        MutexLock lock(mut);
+        finishing = true;
+        job_queued.broadcast( );
+        job_done.broadcast( );
+    }
+
+    for (i = 0; i < workers.size( ); i++) {
+        workers[i]->join( );
+        delete workers[i];
+    }
+    workers.clear( );
+
+    if (writer != NULL) {
+        writer->join( );
+        delete writer;
+        writer = NULL;
+    }
+}
+
+/* (call with mut held) */
+void IngestPipeline::drop(struct ingest_job *job) {
+    if (job->frame != NULL) {
+        Picture::free(job->frame);
+    }
+    delete job;
+    dropped++;
+}
+
+void IngestPipeline::submit(Picture *frame) {
+    struct ingest_job *job = new struct ingest_job;
+    struct timeval tv;
+    job_list_t::iterator i;
+
+    gettimeofday(&tv, NULL);
+
+    job->frame = frame;
+    job->wall_usec = (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+    job->clock = SEEK_NO_CLOCK;
+    if (clock_ipc != NULL) {
+        clock_ipc->get(&job->clock, sizeof(job->clock));
+    }
+    job->quality = base_quality;
+    job->started = false;
+    job->done = false;
+    job->result = NULL;
+    job->result_size = 0;
+    job->written = false;
+
+    MutexLock lock(mut);
+
+    if (waiting >= depth) {
+        switch (policy) {
+            case OVERFLOW_DROP_NEWEST:
+                drop(job);
+                return;
+
+            case OVERFLOW_DROP_OLDEST:
+                for (i = jobs.begin( ); i != jobs.end( ); i++) {
+                    if (!(*i)->started) {
+                        drop(*i);
+                        jobs.erase(i);
+                        waiting--;
+                        break;
+                    }
+                }
+                break;
+
+            case OVERFLOW_LOWER_QUALITY:
+                quality -= INGEST_QUALITY_STEP;
+                if (quality < MIN_INGEST_QUALITY) {
+                    quality = MIN_INGEST_QUALITY;
+                }
+                /* but don't let the queue grow without bound */
+                if (waiting >= 2 * depth) {
+                    drop(job);
+                    return;
+                }
+                break;
+        }
+    }
+
+    jobs.push_back(job);
+    waiting++;
+    job_queued.signal( );
+}
+
+void IngestPipeline::encode(MJPEGEncoder *enc) {
+    struct ingest_job *job;
+    struct mjpeg_frame *frm;
+    job_list_t::iterator i;
+
+    for (;;) {
+        /* take the oldest frame nobody else is working on */
+        {
+            MutexLock lock(mut);
+            for (;;) {
+                for (i = jobs.begin( ); i != jobs.end( ); i++) {
+                    if (!(*i)->started) {
+                        break;
+                    }
+                }
+                if (i != jobs.end( )) {
+                    break;
+                }
+                if (finishing) {
+                    return;
+                }
+                job_queued.wait(mut);
+            }
+            job = *i;
+            job->started = true;
+            job->quality = quality;
+            waiting--;
+        }
+
+        /* Interlaced video gets stored as separate fields. */
+        try {
+            enc->set_quality(job->quality);
+            if (n_encoders == 1) {
+                encode_direct(enc, job);
+            } else {
+                /* the encoder reuses its output buffer: take a copy */
+                frm = mode->interlaced
+                    ? enc->encode_interlaced(job->frame, mode->odd_dominant)
+                    : enc->encode_full(job->frame, mode->odd_dominant);
+
+                job->result_size = sizeof(struct mjpeg_frame)
+                    + frm->f1size + frm->f2size;
+                job->result = (struct mjpeg_frame *) malloc(job->result_size);
+                if (job->result != NULL) {
+                    memcpy(job->result, frm, job->result_size);
+                    job->result->clock = job->clock;
+                }
+            }
+        } catch (std::runtime_error &e) {
+            fprintf(stderr, "ingest encode failed: %s\n", e.what( ));
+        }
+
+        Picture::free(job->frame);
+        job->frame = NULL;
+
+        {
+            MutexLock lock(mut);
+            job->done = true;
+            job_done.broadcast( );
+        }
+    }
+}
+
+/*
+ * Encode into space reserved in the buffer and commit it there, with no
+ * copies. The reservation is a guess (twice the last frame, in a packed
+ * buffer) so it doesn't push out more old frames than it has to; a frame
+ * that outgrows it spills into the encoder's own buffer and gets put( )
+ * the usual way.
+ */
+void IngestPipeline::encode_direct(MJPEGEncoder *enc, struct ingest_job *job) {
+    struct mjpeg_frame *frm;
+    size_t max = buffer->max_size( );
+    size_t want = (last_size > 0 && 2 * last_size < max) ? 2 * last_size : max;
+    size_t room;
+    void *dest;
+
+    dest = buffer->reserve(want, &room);
+    frm = mode->interlaced
+        ? enc->encode_interlaced(job->frame, mode->odd_dominant, dest, room)
+        : enc->encode_full(job->frame, mode->odd_dominant, dest, room);
+
+    frm->clock = job->clock;
+    job->result_size = sizeof(struct mjpeg_frame) + frm->f1size + frm->f2size;
+
+    if ((void *) frm == dest) {
+        buffer->commit(job->result_size, job->clock, job->wall_usec);
+    } else {
+        buffer->put(frm, job->result_size, job->clock, job->wall_usec);
+    }
+
+    last_size = job->result_size;
+    job->written = true;
+}
+
+void IngestPipeline::write(void) {
+    struct ingest_job *job;
+    uint32_t n_dropped;
+    struct MmapBuffer::residency_stats residency;
+
+    for (;;) {
+        {
+            MutexLock lock(mut);
+            while (jobs.empty( ) || !jobs.front( )->done) {
+                if (finishing && jobs.empty( )) {
+                    return;
+                }
+                job_done.wait(mut);
+            }
+            job = jobs.front( );
+            jobs.pop_front( );
+
+            /* caught up, so work back toward full quality */
+            if (waiting == 0 && quality < base_quality) {
+                quality++;
+            }
+
+            n_dropped = dropped;
+            dropped = 0;
+        }
+
+        if (job->result != NULL) {
+            buffer->put(job->result, job->result_size, job->clock,
+                job->wall_usec);
+        }
+
+        if (stats != NULL) {
+            if (buffer->get_residency(&residency)) {
+                stats->buffer_residency(residency.hot_bytes,
+                    residency.resident_bytes, residency.locked_bytes);
+            }
+            if (n_dropped > 0) {
+                stats->drop_frames(n_dropped);
+            }
+            if (job->result != NULL || job->written) {
+                stats->input_bytes(2 * mode->w * mode->h);
+                stats->output_bytes(job->result_size 
+                    - sizeof(struct mjpeg_frame));
+                stats->finish_frames(1);
+            }
+        }
+
+        free(job->result);
+        delete job;
+    }
+}
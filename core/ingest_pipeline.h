@@ -0,0 +1,171 @@
+#ifndef _INGEST_PIPELINE_H
+#define _INGEST_PIPELINE_H
+
+#include "picture.h"
+#include "mjpeg_frame.h"
+#include "mmap_buffer.h"
+#include "mmap_state.h"
+#include "stats.h"
+#include "video_mode.h"
+#include "thread.h"
+#include "mutex.h"
+#include "condition.h"
+
+#include <stdint.h>
+#include <getopt.h>
+#include <list>
+#include <vector>
+
+/* what to do with a frame that comes in while the encode queue is full */
+enum overflow_policy {
+    OVERFLOW_DROP_OLDEST,   /* throw away the oldest frame still waiting */
+    OVERFLOW_DROP_NEWEST,   /* throw away the one that just came in */
+    OVERFLOW_LOWER_QUALITY  /* keep it, and encode at lower quality to catch up */
+};
+
+#define DEFAULT_INGEST_ENCODERS 2
+#define DEFAULT_INGEST_QUEUE 8
+#define MAX_INGEST_ENCODERS 16
+#define DEFAULT_INGEST_QUALITY 80
+
+/*
+ * Lowering quality takes it down this much per frame over the limit, as
+ * far as the floor, and lets it back up one step per frame written
+ * while the queue is empty.
+ */
+#define INGEST_QUALITY_STEP 5
+#define MIN_INGEST_QUALITY 30
+
+class IngestEncodeWorker;
+class IngestWriter;
+
+/* "drop-oldest", "drop-newest" or "lower-quality"; false if none of those */
+bool find_overflow_policy(const char *name, enum overflow_policy *policy);
+
+/* 
+ * The options every ingest tool takes. Tools print INGEST_USAGE as part
+ * of their usage line.
+ */
+struct ingest_options {
+    const struct video_mode *mode;
+    int band_threads;               /* -j: slices per frame, encoded at once */
+    int encoders;                   /* -e: frames encoded at once */
+    int queue;                      /* -q: frames waiting to be encoded */
+    enum overflow_policy policy;    /* -o: what gives when they pile up */
+    size_t target_size;             /* -t: rate control, 0 for none */
+    unsigned int hot_seconds;       /* -k: keep these frames in memory */
+    bool recover;                   /* -r: pick up after a crashed ingest */
+};
+
+#define INGEST_USAGE "[-m mode] [-j threads] [-e encoders] [-q frames] " \
+    "[-o policy] [-t bytes] [-k seconds] [-r]"
+
+/* handles one of a tool's own options; false if its argument is no good */
+typedef bool (*ingest_option_fn)(int opt, const char *arg, void *data);
+
+/*
+ * getopt_long( ) the ingest options out of argv into opts, starting from
+ * the defaults. A tool with options of its own passes their getopt string
+ * and long option table (ending in a zeroed entry), and extra gets called
+ * for each of them it finds. Returns false, having said what was wrong,
+ * if the tool should print its usage and give up; otherwise optind is at
+ * the first argument that isn't an option.
+ */
+bool parse_ingest_options(int argc, char * const *argv,
+    struct ingest_options *opts, const char *extra_optstring = "",
+    const struct option *extra_options = NULL, ingest_option_fn extra = NULL,
+    void *extra_data = NULL);
+
+/* 
+ * Open (or, with -r, recover) the buffer an ingest writes to, tagged with
+ * the mode, and start keeping it hot if -k asked for that.
+ */
+MmapBuffer *open_ingest_buffer(const char *file, 
+    const struct ingest_options *opts);
+
+/*
+ * Capture, encode and store as three stages, so a slow JPEG doesn't hold
+ * up the capture thread and cost us input frames. Whoever captures hands
+ * each frame to submit( ), which notes the scoreboard and wall clocks
+ * and queues it without waiting. A pool of encoders, each with an
+ * MJPEGEncoder of its own, takes frames off the queue in order, and one
+ * writer thread puts them in the buffer in the order they were captured.
+ * The queue of frames waiting to be encoded is bounded; past that the
+ * overflow policy decides what gives. With only one encoder the order
+ * takes care of itself, so it encodes straight into the buffer.
+ */
+class IngestPipeline {
+    public:
+        /* clock_ipc may be NULL if there's no scoreboard clock */
+        IngestPipeline(MmapBuffer *buffer, const struct video_mode *mode,
+            MmapState *clock_ipc);
+        ~IngestPipeline( );
+
+        /* these only take effect before start( ) */
+        void set_encoders(int n);
+        void set_band_threads(int n); /* per encoder, see MJPEGEncoder */
+        void set_queue_depth(int frames);
+        void set_overflow_policy(enum overflow_policy policy);
+        void set_quality(int quality);
+        /* rate control per encoder, with set_quality as the ceiling */
+        void set_target_size(size_t bytes);
+        void set_stats(EncodeStats *stats);
+        /* all of the above that parse_ingest_options( ) covers */
+        void set_options(const struct ingest_options *opts);
+
+        void start(void);
+
+        /* takes a UYVY8 frame at the mode's geometry, and ownership of it */
+        void submit(Picture *frame);
+
+        /* write out everything submitted so far, and stop the threads */
+        void finish(void);
+
+    protected:
+        struct ingest_job {
+            Picture *frame;
+            uint32_t clock;
+            uint64_t wall_usec;
+            int quality;
+
+            bool started, done;
+            struct mjpeg_frame *result; /* NULL if failed, or already put */
+            size_t result_size;
+            bool written;               /* the encoder put it in the buffer */
+        };
+
+        typedef std::list<struct ingest_job *> job_list_t;
+
+        void encode(MJPEGEncoder *enc);
+        void encode_direct(MJPEGEncoder *enc, struct ingest_job *job);
+        void write(void);
+        void drop(struct ingest_job *job);
+
+        MmapBuffer *buffer;
+        const struct video_mode *mode;
+        MmapState *clock_ipc;
+        EncodeStats *stats;
+
+        int n_encoders, band_threads, depth;
+        enum overflow_policy policy;
+        int base_quality, quality;
+        size_t target_size;
+
+        job_list_t jobs;
+        int waiting;        /* jobs no encoder has started on */
+        uint32_t dropped;   /* since the writer last reported */
+        size_t last_size;   /* of the last frame encoded in place */
+        bool finishing;
+
+        Mutex mut;
+        Condition job_queued;
+        Condition job_done;
+
+        std::vector<IngestEncodeWorker *> workers;
+        IngestWriter *writer;
+
+        friend class IngestEncodeWorker;
+        friend class IngestWriter;
+};
+
+#endif
@@ -1,7 +1,11 @@
 #ifndef _MJPEG_CONFIG_H
 #define _MJPEG_CONFIG_H
 
-#define MAX_FRAME_SIZE 131072
+/* big enough for a high-quality 1080i frame */
+#define MAX_FRAME_SIZE 1048576
 #define FRAMES_PER_SEC 30
 
+/* read ahead this much of a replay from disk as soon as it's cued */
+#define CUE_PREFETCH_FRAMES (4 * FRAMES_PER_SEC)
+
 #endif
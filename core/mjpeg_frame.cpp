@@ -4,6 +4,11 @@
 #include <assert.h>
 
 #include "mjpeg_frame.h"
+#include "mjpeg_config.h"
+#include "stats.h"
+
+#include <sys/time.h>
+#include <math.h>
 #include "jerror.h"
 
 #include <stdexcept>
@@ -65,6 +70,11 @@ struct mem_destination_mgr {
     uint8_t *data_ptr;
     size_t total_len;
     size_t *len_ptr;
+
+    /* somewhere bigger to carry on if data_ptr fills up (or NULL) */
+    uint8_t *spill_ptr;
+    size_t spill_len;
+    uint8_t **out_ptr;
 };
 
 METHODDEF(void) mem_init_destination(j_compress_ptr cinfo) {
@@ -73,9 +83,26 @@ METHODDEF(void) mem_init_destination(j_compress_ptr cinfo) {
     dest->pub.free_in_buffer = dest->total_len;
 }
 
+/*
+ * libjpeg only calls this once the whole buffer is full. If there's a
+ * spill buffer, move what we have over and keep going there. If not,
+ * throw (like my_error_exit does) so the encoder can try lower quality.
+ */
 METHODDEF(boolean) mem_empty_output_buffer(j_compress_ptr cinfo) {
-    ERREXIT(cinfo, JERR_OUT_OF_MEMORY);
-    return FALSE;
+    mem_destination_mgr *dest = (mem_destination_mgr *)cinfo->dest;
+
+    if (dest->spill_ptr == NULL || dest->spill_len <= dest->total_len) {
+        throw FrameTooLarge( );
+    }
+
+    memcpy(dest->spill_ptr, dest->data_ptr, dest->total_len);
+    dest->pub.next_output_byte = dest->spill_ptr + dest->total_len;
+    dest->pub.free_in_buffer = dest->spill_len - dest->total_len;
+    dest->data_ptr = dest->spill_ptr;
+    dest->total_len = dest->spill_len;
+    dest->spill_ptr = NULL;
+    *(dest->out_ptr) = dest->data_ptr;
+    return TRUE;
 }
 
 METHODDEF(void) mem_term_destination(j_compress_ptr cinfo) {
@@ -83,7 +110,12 @@ METHODDEF(void) mem_term_destination(j_compress_ptr cinfo) {
     *(dest->len_ptr) = dest->total_len - dest->pub.free_in_buffer;
 }
 
-GLOBAL(void) jpeg_mem_dest(j_compress_ptr cinfo, void *data, size_t *len) {
+/* 
+ * Compress into *out (*len bytes), moving to spill if that runs out; *out
+ * and *len say where the JPEG ended up and how big it is. 
+ */
+GLOBAL(void) jpeg_mem_dest(j_compress_ptr cinfo, uint8_t **out, size_t *len,
+        uint8_t *spill, size_t spill_len) {
     mem_destination_mgr *dest;
 
     if (cinfo->dest == NULL) {
@@ -96,9 +128,12 @@ GLOBAL(void) jpeg_mem_dest(j_compress_ptr cinfo, void *data, size_t *len) {
     dest->pub.init_destination = mem_init_destination;
     dest->pub.empty_output_buffer = mem_empty_output_buffer;
     dest->pub.term_destination = mem_term_destination;
-    dest->data_ptr = (uint8_t *)data;
+    dest->data_ptr = *out;
     dest->total_len = *len;
     dest->len_ptr = len;
+    dest->spill_ptr = spill;
+    dest->spill_len = spill_len;
+    dest->out_ptr = out;
 }
 
 METHODDEF(void) my_error_exit(j_common_ptr cinfo) {
@@ -107,6 +142,374 @@ METHODDEF(void) my_error_exit(j_common_ptr cinfo) {
     throw std::runtime_error("JPEG decode error");
 }
 
+/* make sure scratch has at least size bytes; it never shrinks */
+static uint8_t *reserve_rows(struct planar_rows *scratch, size_t size) {
+    if (scratch->size < size) {
+        free(scratch->buf);
+        scratch->buf = (uint8_t *) malloc(size);
+        if (scratch->buf == NULL) {
+            scratch->size = 0;
+            throw std::runtime_error("allocation failure");
+        }
+        scratch->size = size;
+    }
+
+    return scratch->buf;
+}
+
+/* 
+ * Split one UYVY scanline into Y, Cb and Cr, replicating the last pixel 
+ * out to y_width (which is a whole number of MCUs).
+ */
+static void uyvy_to_planar(const uint8_t *src, uint16_t w, size_t y_width,
+        uint8_t *y, uint8_t *cb, uint8_t *cr) {
+    size_t i;
+    size_t pairs = w / 2;
+
+    for (i = 0; i < pairs; i++) {
+        cb[i] = src[0];
+        y[2*i] = src[1];
+        cr[i] = src[2];
+        y[2*i + 1] = src[3];
+        src += 4;
+    }
+
+    for (i = pairs; i < y_width / 2; i++) {
+        cb[i] = cb[pairs - 1];
+        cr[i] = cr[pairs - 1];
+        y[2*i] = y[2*pairs - 1];
+        y[2*i + 1] = y[2*pairs - 1];
+    }
+}
+
+/* 
+ * Feed a UYVY band through jpeg_write_raw_data, one iMCU row (8 lines at
+ * 2h1v) at a time. The rows are staged in planar form in scratch, which
+ * only gets reallocated if the picture got wider.
+ */
+static void write_raw_uyvy(j_compress_ptr cinfo, struct encode_band *band,
+        struct planar_rows *scratch) {
+    JSAMPROW y_rows[DCTSIZE], cb_rows[DCTSIZE], cr_rows[DCTSIZE];
+    JSAMPARRAY planes[3] = { y_rows, cb_rows, cr_rows };
+    size_t y_width = (band->w + 2*DCTSIZE - 1) & ~(size_t)(2*DCTSIZE - 1);
+    size_t c_width = y_width / 2;
+    size_t needed = DCTSIZE * (y_width + 2*c_width);
+    uint8_t *buf = reserve_rows(scratch, needed);
+    unsigned int line;
+    int j;
+
+    for (j = 0; j < DCTSIZE; j++) {
+        y_rows[j] = buf + j * y_width;
+        cb_rows[j] = buf + DCTSIZE * y_width + j * c_width;
+        cr_rows[j] = buf + DCTSIZE * (y_width + c_width) + j * c_width;
+    }
+
+    while (cinfo->next_scanline < cinfo->image_height) {
+        for (j = 0; j < DCTSIZE; j++) {
+            /* pad out the last iMCU row by repeating the last line */
+            line = cinfo->next_scanline + j;
+            if (line >= band->h) {
+                line = band->h - 1;
+            }
+
+            uyvy_to_planar(band->data + line * band->line_pitch, band->w,
+                y_width, y_rows[j], cb_rows[j], cr_rows[j]);
+        }
+
+        jpeg_write_raw_data(cinfo, planes, DCTSIZE);
+    }
+}
+
+/* 
+ * Compress one band with the given compressor, into dest (or spill, if
+ * dest fills up and there is one: band->out says which). 
+ * Throws FrameTooLarge if it doesn't fit, or std::runtime_error (via
+ * my_error_exit) if libjpeg doesn't like it.
+ */
+static void compress_band(j_compress_ptr cinfo, struct encode_band *band,
+        struct planar_rows *scratch, uint8_t *dest, size_t dest_size,
+        uint8_t *spill = NULL, size_t spill_size = 0) {
+    struct timeval start, finish;
+
+    gettimeofday(&start, NULL);
+
+    cinfo->image_width = band->w;
+    cinfo->image_height = band->h;
+    cinfo->input_components = 3;
+    cinfo->in_color_space = (band->pix_fmt == RGB8) ? JCS_RGB : JCS_YCbCr;
+
+    band->out = dest;
+    band->out_size = dest_size;
+    jpeg_mem_dest(cinfo, &band->out, &band->out_size, spill, spill_size);
+
+    /* 
+     * stock Huffman tables, so every band can share the first one's headers
+     */
+    jpeg_set_defaults(cinfo);
+    jpeg_set_quality(cinfo, band->quality, TRUE);
+
+    if (band->pix_fmt == UYVY8) {
+        /* 4:2:2 in, 4:2:2 out; libjpeg doesn't have to resample anything */
+        cinfo->raw_data_in = TRUE;
+        cinfo->comp_info[0].h_samp_factor = 2;
+        cinfo->comp_info[0].v_samp_factor = 1;
+        cinfo->comp_info[1].h_samp_factor = 1;
+        cinfo->comp_info[1].v_samp_factor = 1;
+        cinfo->comp_info[2].h_samp_factor = 1;
+        cinfo->comp_info[2].v_samp_factor = 1;
+
+        jpeg_start_compress(cinfo, TRUE);
+        write_raw_uyvy(cinfo, band, scratch);
+    } else {
+        jpeg_start_compress(cinfo, TRUE);
+
+        while (cinfo->next_scanline < cinfo->image_height) {
+            JSAMPLE *scanline = (JSAMPLE *)
+                (band->data + cinfo->next_scanline * band->line_pitch);
+            jpeg_write_scanlines(cinfo, &scanline, 1);
+        }
+    }
+
+    jpeg_finish_compress(cinfo);
+
+    gettimeofday(&finish, NULL);
+    band->usec = (finish.tv_sec - start.tv_sec) * 1000000
+        + (finish.tv_usec - start.tv_usec);
+}
+
+/* 
+ * The same, for a band compressed alongside others: a failure is noted
+ * in band->failed (and band->too_large) instead of thrown.
+ */
+static void compress_band_noted(j_compress_ptr cinfo, struct encode_band *band,
+        struct planar_rows *scratch, uint8_t *dest, size_t dest_size,
+        uint8_t *spill = NULL, size_t spill_size = 0) {
+    band->failed = false;
+    band->too_large = false;
+
+    try {
+        compress_band(cinfo, band, scratch, dest, dest_size, 
+            spill, spill_size);
+    } catch (FrameTooLarge &e) {
+        jpeg_abort_compress(cinfo);
+        band->failed = true;
+        band->too_large = true;
+    } catch (std::runtime_error &e) {
+        /* so cinfo is usable for the next band */
+        jpeg_abort_compress(cinfo);
+        band->failed = true;
+    }
+}
+
+/* throw for the bands that failed, if any did */
+static void check_bands(struct encode_band **bands, int n_bands) {
+    bool failed = false, too_large = false;
+    int i;
+
+    for (i = 0; i < n_bands; i++) {
+        failed = failed || bands[i]->failed;
+        too_large = too_large || bands[i]->too_large;
+    }
+
+    if (too_large) {
+        throw FrameTooLarge( );
+    } else if (failed) {
+        throw std::runtime_error("JPEG encode failed");
+    }
+}
+
+/* 
+ * Find the entropy-coded data in a JPEG we made ourselves, along with its
+ * SOF and SOS marker segments. Returns 0 if it doesn't look like one.
+ */
+static size_t find_scan_data(const uint8_t *jpeg, size_t len, 
+        size_t *sof, size_t *sos) {
+    size_t pos = 2; /* skip SOI */
+    size_t seg_len;
+
+    *sof = 0;
+    *sos = 0;
+
+    while (pos + 4 <= len) {
+        if (jpeg[pos] != 0xff) {
+            return 0;
+        }
+
+        seg_len = (jpeg[pos + 2] << 8) | jpeg[pos + 3];
+
+        if (jpeg[pos + 1] == 0xc0 || jpeg[pos + 1] == 0xc1) {
+            *sof = pos;
+        } else if (jpeg[pos + 1] == 0xda) {
+            *sos = pos;
+            return pos + 2 + seg_len;
+        }
+
+        pos += 2 + seg_len;
+    }
+
+    return 0;
+}
+
+/* 
+ * Glue separately compressed bands into one JPEG: the first band's headers
+ * (with the real image height and a DRI segment added), then each band's
+ * entropy-coded data separated by RSTn markers. Since each band started
+ * from scratch, that's exactly what a decoder expects to see after a
+ * restart, as long as the restart interval is the number of MCUs per band.
+ * It goes in *dest, or spill (changing *dest) if it doesn't fit.
+ */
+static size_t stitch_bands(struct encode_band *bands, int n_bands, 
+        uint16_t h, unsigned int restart_interval, 
+        uint8_t **dest, size_t dest_size, uint8_t *spill, size_t spill_size) {
+    size_t sof = 0, sos = 0, total;
+    size_t scan_start[MAX_ENCODE_THREADS];
+    uint8_t *out;
+    int i;
+
+    if (restart_interval > 0xffff) {
+        throw std::runtime_error("bands too large for a restart interval");
+    }
+
+    if (n_bands < 1) {
+        throw std::runtime_error("no bands to stitch");
+    }
+
+    /* 
+     * headers + DRI segment + entropy data for each band
+     * + RSTn between bands + EOI 
+     */
+    total = 6 + 2 * (n_bands - 1) + 2;
+    for (i = n_bands - 1; i >= 0; i--) {
+        scan_start[i] = find_scan_data(bands[i].out, bands[i].out_size, 
+            &sof, &sos);
+
+        /* a band without an SOF or SOS marker is no use to us */
+        if (scan_start[i] == 0 || sof == 0 || sos == 0
+                || bands[i].out_size < scan_start[i] + 2) {
+            throw std::runtime_error("can't parse encoded band");
+        }
+
+        total += bands[i].out_size - scan_start[i] - 2;
+    }
+    /* (sof and sos are now those of the first band) */
+    total += scan_start[0];
+
+    if (total > dest_size) {
+        if (spill == NULL || total > spill_size) {
+            throw FrameTooLarge( );
+        }
+        *dest = spill;
+    }
+    out = *dest;
+
+    memcpy(out, bands[0].out, sos);
+    out[sof + 5] = h >> 8;
+    out[sof + 6] = h & 0xff;
+    out += sos;
+
+    *out++ = 0xff;
+    *out++ = 0xdd; /* DRI */
+    *out++ = 0x00;
+    *out++ = 0x04;
+    *out++ = restart_interval >> 8;
+    *out++ = restart_interval & 0xff;
+
+    memcpy(out, bands[0].out + sos, scan_start[0] - sos);
+    out += scan_start[0] - sos;
+
+    for (i = 0; i < n_bands; i++) {
+        if (i > 0) {
+            *out++ = 0xff;
+            *out++ = 0xd0 + ((i - 1) & 7); /* RSTn */
+        }
+
+        /* everything up to (not including) the EOI */
+        memcpy(out, bands[i].out + scan_start[i], 
+            bands[i].out_size - scan_start[i] - 2);
+        out += bands[i].out_size - scan_start[i] - 2;
+    }
+
+    *out++ = 0xff;
+    *out++ = 0xd9; /* EOI */
+
+    return out - *dest;
+}
+
+MJPEGEncodeWorker::MJPEGEncodeWorker(size_t alloc_size) {
+    memset(&cinfo, 0, sizeof(cinfo));
+    cinfo.err = jpeg_std_error(&jerr);
+    jerr.error_exit = my_error_exit;
+
+    jpeg_create_compress(&cinfo);
+
+    this->alloc_size = alloc_size;
+    buf = (uint8_t *) malloc(alloc_size);
+    if (buf == NULL) {
+        throw std::runtime_error("allocation failure");
+    }
+
+    scratch.buf = NULL;
+    scratch.size = 0;
+
+    job = NULL;
+    exiting = false;
+
+    start( );
+}
+
+MJPEGEncodeWorker::~MJPEGEncodeWorker( ) {
+    { MutexLock lock(mut);
+        exiting = true;
+        job_cond.signal( );
+    }
+
+    join( );
+
+    jpeg_destroy_compress(&cinfo);
+    free(buf);
+    free(scratch.buf);
+}
+
+void MJPEGEncodeWorker::submit(struct encode_band *band) {
+    { MutexLock lock(mut);
+        job = band;
+        job_cond.signal( );
+    }
+}
+
+void MJPEGEncodeWorker::wait_done(void) {
+    { MutexLock lock(mut);
+        while (job != NULL) {
+            done_cond.wait(mut);
+        }
+    }
+}
+
+void MJPEGEncodeWorker::run(void) {
+    struct encode_band *band;
+
+    for (;;) {
+        { MutexLock lock(mut);
+            while (job == NULL && !exiting) {
+                job_cond.wait(mut);
+            }
+
+            if (exiting) {
+                return;
+            }
+
+            band = job;
+        }
+
+        compress_band_noted(&cinfo, band, &scratch, buf, alloc_size);
+
+        { MutexLock lock(mut);
+            job = NULL;
+            done_cond.signal( );
+        }
+    }
+}
+
 MJPEGEncoder::MJPEGEncoder( ) {
     memset(&cinfo, 0, sizeof(cinfo));
     cinfo.err = jpeg_std_error(&jerr);
@@ -114,70 +517,442 @@ MJPEGEncoder::MJPEGEncoder( ) {
 
     jpeg_create_compress(&cinfo);
 
-    /* arbitrary constants, really... */
-    alloc_size = 131072;
+    /* whatever is left of a buffer record after the frame header */
+    alloc_size = MAX_FRAME_SIZE - sizeof(mjpeg_frame);
+    frame_limit = alloc_size;
     quality = 80;
 
+    target_size = 0;
+    complexity = 0;
+    rc_quality = quality;
+
+    n_threads = 1;
+    memset(workers, 0, sizeof(workers));
+    band_buf = NULL;
+    stats = NULL;
+    scratch.buf = NULL;
+    scratch.size = 0;
+
     out_frame = (mjpeg_frame *) malloc(alloc_size + sizeof(mjpeg_frame));
+    dest_frame = out_frame;
+    dest_room = frame_limit;
+}
+
+void MJPEGEncoder::set_max_frame_size(size_t bytes) {
+    if (bytes <= sizeof(mjpeg_frame) || bytes > MAX_FRAME_SIZE) {
+        throw std::runtime_error("Invalid maximum frame size");
+    }
+    frame_limit = bytes - sizeof(mjpeg_frame);
+}
+
+/* 
+ * Point the next encode at dest (dest_size bytes, header and all), or at
+ * our own buffer if dest is NULL or too small to bother with.
+ */
+void MJPEGEncoder::aim(void *dest, size_t dest_size) {
+    if (dest != NULL && dest_size > sizeof(mjpeg_frame)) {
+        dest_frame = (mjpeg_frame *) dest;
+        dest_room = dest_size - sizeof(mjpeg_frame);
+        if (dest_room > frame_limit) {
+            dest_room = frame_limit;
+        }
+    } else {
+        dest_frame = out_frame;
+        dest_room = frame_limit;
+    }
+}
+
+/* where to go when the caller's buffer runs out (NULL if we're in ours) */
+uint8_t *MJPEGEncoder::spill_data(void) {
+    return (dest_frame != out_frame) ? out_frame->data : NULL;
+}
+
+/* carry on in our own buffer, bringing along the used bytes so far */
+void MJPEGEncoder::spill(size_t used) {
+    if (used > 0) {
+        memcpy(out_frame->data, dest_frame->data, used);
+    }
+    dest_frame = out_frame;
+    dest_room = frame_limit;
+}
+
+void MJPEGEncoder::set_threads(int n_threads) {
+    int i;
+
+    if (n_threads < 1 || n_threads > MAX_ENCODE_THREADS) {
+        throw std::runtime_error("Invalid number of encode threads");
+    }
+
+    /* the calling thread does the first band itself */
+    for (i = 0; i < MAX_ENCODE_THREADS; i++) {
+        if (i < n_threads - 1 && workers[i] == NULL) {
+            workers[i] = new MJPEGEncodeWorker(alloc_size);
+        } else if (i >= n_threads - 1 && workers[i] != NULL) {
+            delete workers[i];
+            workers[i] = NULL;
+        }
+    }
+
+    if (n_threads > 1 && band_buf == NULL) {
+        band_buf = (uint8_t *) malloc(alloc_size);
+        if (band_buf == NULL) {
+            throw std::runtime_error("allocation failure");
+        }
+    }
+
+    this->n_threads = n_threads;
 }
 
-mjpeg_frame *MJPEGEncoder::encode_full(Picture *pict, bool odd_dominant) {
-    Picture *p_to_use;
-    if (pict->pix_fmt == RGB8 || pict->pix_fmt == YUV8) {
-        p_to_use = pict;
-    } else if (pict->pix_fmt == UYVY8) {
-        p_to_use = pict->convert_to_format(YUV8);
+/* 
+ * Compress pict into dest_frame, splitting it across the worker pool if we
+ * have one. Returns the size of the JPEG.
+ */
+size_t MJPEGEncoder::encode_banded(Picture *pict, int q) {
+    struct encode_band bands[MAX_ENCODE_THREADS];
+    struct encode_band *band_list[MAX_ENCODE_THREADS];
+    int mcu_rows = (pict->h + ENCODE_BAND_ALIGN - 1) / ENCODE_BAND_ALIGN;
+    int n_bands = n_threads;
+    int band_h, i;
+    size_t size;
+    uint8_t *out;
+
+    if (n_bands > mcu_rows) {
+        n_bands = mcu_rows;
+    }
+
+    if (n_bands < 1) {
+        n_bands = 1;
+    }
+
+    /* 
+     * Every band but the last must be the same whole number of MCU rows,
+     * so that the restart interval lines up with the band boundaries.
+     */
+    band_h = (mcu_rows + n_bands - 1) / n_bands * ENCODE_BAND_ALIGN;
+    n_bands = (pict->h + band_h - 1) / band_h;
+
+    for (i = 0; i < n_bands; i++) {
+        bands[i].data = pict->scanline(i * band_h);
+        bands[i].line_pitch = pict->line_pitch;
+        bands[i].w = pict->w;
+        bands[i].h = (pict->h - i * band_h < band_h) ? pict->h - i * band_h : band_h;
+        bands[i].pix_fmt = pict->pix_fmt;
+        bands[i].quality = q;
+        bands[i].failed = false;
+        bands[i].too_large = false;
+        band_list[i] = &bands[i];
+    }
+
+    if (n_bands == 1) {
+        try {
+            compress_band(&cinfo, &bands[0], &scratch, dest_frame->data, 
+                dest_room, spill_data( ), frame_limit);
+        } catch (std::runtime_error &e) {
+            /* so cinfo is usable for the next try */
+            jpeg_abort_compress(&cinfo);
+            throw;
+        }
+        size = bands[0].out_size;
+        out = bands[0].out;
+    } else {
+        for (i = 1; i < n_bands; i++) {
+            workers[i - 1]->submit(&bands[i]);
+        }
+
+        compress_band_noted(&cinfo, &bands[0], &scratch, band_buf, 
+            alloc_size);
+
+        for (i = 1; i < n_bands; i++) {
+            workers[i - 1]->wait_done( );
+        }
+        check_bands(band_list, n_bands);
+
+        out = dest_frame->data;
+        size = stitch_bands(bands, n_bands, pict->h, 
+            cinfo.MCUs_per_row * cinfo.MCU_rows_in_scan, &out, dest_room,
+            spill_data( ), frame_limit);
+    }
+
+    /* (the data is already over there) */
+    if (out != dest_frame->data) {
+        spill(0);
+    }
+
+    if (stats) {
+        for (i = 0; i < n_bands; i++) {
+            stats->band_time(i, bands[i].usec);
+        }
+    }
+
+    return size;
+}
+
+/* 
+ * Get pict into something we can hand libjpeg directly (RGB8, YUV8, or
+ * UYVY8 via the raw data interface). 
+ * Returns either pict itself or a converted copy the caller must free.
+ */
+Picture *MJPEGEncoder::prepare(Picture *pict) {
+    if (pict->pix_fmt == RGB8 || pict->pix_fmt == YUV8 
+            || pict->pix_fmt == UYVY8) {
+        return pict;
     } else {
         // variation on the RGB theme??
-        p_to_use = pict->convert_to_format(RGB8);
-    }
-
-    cinfo.image_width = p_to_use->w;
-    cinfo.image_height = p_to_use->h;
-    /* TODO: make this a bit smarter when dealing with UYVY inputs */
-    cinfo.input_components = 3;
-    if (p_to_use->pix_fmt == YUV8) {
-        // just encode directly as YCbCr if we have it
-        cinfo.in_color_space = JCS_YCbCr;
-    } else if (p_to_use->pix_fmt == RGB8) {
-        cinfo.in_color_space = JCS_RGB;
+        return pict->convert_to_format(RGB8);
+    }
+}
+
+/* 
+ * Describe every line_step'th scanline of p, starting at first_line, 
+ * as something to compress. (line_step = 2 picks out a field.)
+ */
+static void field_band(struct encode_band *band, Picture *p, int first_line,
+        int line_step, int quality) {
+    band->data = p->scanline(first_line);
+    band->line_pitch = p->line_pitch * line_step;
+    band->w = p->w;
+    band->h = (p->h - first_line + line_step - 1) / line_step;
+    band->pix_fmt = p->pix_fmt;
+    band->quality = quality;
+    band->failed = false;
+    band->too_large = false;
+}
+
+mjpeg_frame *MJPEGEncoder::encode_full(Picture *pict, bool odd_dominant,
+        void *dest, size_t dest_size) {
+    return encode(ENCODE_FULL, pict, NULL, odd_dominant, dest, dest_size);
+}
+
+mjpeg_frame *MJPEGEncoder::encode_fields(Picture *f1, Picture *f2, 
+        bool odd_dominant, void *dest, size_t dest_size) {
+    return encode(ENCODE_FIELDS, f1, f2, odd_dominant, dest, dest_size);
+}
+
+mjpeg_frame *MJPEGEncoder::encode_interlaced(Picture *pict, 
+        bool odd_dominant, void *dest, size_t dest_size) {
+    return encode(ENCODE_INTERLACED, pict, NULL, odd_dominant, 
+        dest, dest_size);
+}
+
+/* libjpeg's quantizer scaling (in percent) for a quality setting */
+static double quality_scale(int q) {
+    double scale = (q < 50) ? 5000.0 / q : 200.0 - 2 * q;
+    return (scale < 1) ? 1 : scale;
+}
+
+/*
+ * Invert the size model for the quality that should give target_size
+ * bytes, then keep the change (and the result) within bounds.
+ */
+int MJPEGEncoder::pick_quality(void) {
+    double scale;
+    int q;
+
+    if (target_size == 0) {
+        return quality;
+    }
+
+    if (complexity == 0) {
+        /* nothing to go on until the first frame */
+        q = rc_quality;
     } else {
-        throw std::runtime_error("Internal error - should never happen");
+        scale = pow(complexity / target_size, 1.0 / RC_EXPONENT);
+        q = (scale <= 100) ? (int) ((200 - scale) / 2 + 0.5) : (int) (5000 / scale + 0.5);
+
+        if (q > rc_quality + RC_MAX_STEP) {
+            q = rc_quality + RC_MAX_STEP;
+        } else if (q < rc_quality - RC_MAX_STEP) {
+            q = rc_quality - RC_MAX_STEP;
+        }
     }
 
-    /* set up the frame structure */
-    out_frame->f1size = alloc_size;
-    out_frame->f2size = 0;
-    out_frame->odd_dominant = odd_dominant;
+    if (q > quality) {
+        q = quality;
+    }
+    if (q < RC_MIN_QUALITY) {
+        q = RC_MIN_QUALITY;
+    }
 
-    jpeg_mem_dest(&cinfo, &out_frame->data, &out_frame->f1size);
+    return q;
+}
 
-    jpeg_set_defaults(&cinfo);
-    jpeg_set_quality(&cinfo, quality, TRUE);
+void MJPEGEncoder::update_rate(size_t size, int q) {
+    double k = size * pow(quality_scale(q), RC_EXPONENT);
 
-    jpeg_start_compress(&cinfo, TRUE);
+    if (complexity == 0) {
+        complexity = k;
+    } else {
+        complexity += (k - complexity) * RC_SMOOTHING;
+    }
+    rc_quality = q;
+}
 
-    while (cinfo.next_scanline < cinfo.image_height) {
-        JSAMPLE *scanline = (JSAMPLE *)p_to_use->scanline(cinfo.next_scanline);
-        jpeg_write_scanlines(&cinfo, &scanline, 1);
+/*
+ * Encode at the quality rate control picks. A frame that doesn't fit in
+ * a buffer slot at that quality (a busy crowd shot, say) is encoded
+ * again at lower quality until it does, rather than lost. Anything else
+ * that goes wrong would just go wrong again, so that's thrown right away.
+ */
+mjpeg_frame *MJPEGEncoder::encode(enum encode_kind kind, Picture *p1, 
+        Picture *p2, bool odd_dominant, void *dest, size_t dest_size) {
+    mjpeg_frame *ret = NULL;
+    int q = pick_quality( );
+    int tries;
+
+    for (tries = 0; ret == NULL; tries++) {
+        aim(dest, dest_size);
+        try {
+            ret = encode_at(kind, p1, p2, odd_dominant, q);
+        } catch (FrameTooLarge &e) {
+            if (tries + 1 >= MAX_ENCODE_RETRIES || q <= 1) {
+                throw;
+            }
+            q = q * 2 / 3;
+            if (q < 1) {
+                q = 1;
+            }
+        }
     }
 
-    jpeg_finish_compress(&cinfo);
+    if (target_size != 0) {
+        update_rate(ret->f1size + ret->f2size, q);
+    }
 
-    /* note (FIXME): could leak a Picture if we error out here */
-    if (p_to_use != pict) {
-        Picture::free(p_to_use);
+    if (stats) {
+        stats->frame_quality(q, tries > 1);
     }
 
-    return out_frame;
+    return ret;
 }
 
-mjpeg_frame *MJPEGEncoder::encode_fields(Picture *f1, Picture *f2, bool odd_dominant) {
-    throw std::runtime_error("stub");
+/* free what prepare( ) made, if it had to make anything */
+static void free_prepared(Picture *prepared, Picture *pict) {
+    if (prepared != NULL && prepared != pict) {
+        Picture::free(prepared);
+    }
+}
+
+mjpeg_frame *MJPEGEncoder::encode_at(enum encode_kind kind, Picture *p1,
+        Picture *p2, bool odd_dominant, int q) {
+    Picture *p1_to_use = NULL, *p2_to_use = NULL;
+    struct encode_band bands[2];
+    mjpeg_frame *ret;
+    size_t size;
+
+    try {
+        if (kind == ENCODE_FIELDS) {
+            /* f1 is the field that comes first in time (odd scanlines if odd_dominant) */
+            if (p1->w != p2->w || p1->h != p2->h) {
+                throw std::runtime_error("fields must be the same size");
+            }
+
+            p1_to_use = prepare(p1);
+            p2_to_use = prepare(p2);
+
+            if (p1_to_use->pix_fmt != p2_to_use->pix_fmt) {
+                throw std::runtime_error("fields must be the same format");
+            }
+
+            field_band(&bands[0], p1_to_use, 0, 1, q);
+            field_band(&bands[1], p2_to_use, 0, 1, q);
+
+            ret = encode_field_pair(&bands[0], &bands[1], odd_dominant);
+        } else if (kind == ENCODE_INTERLACED) {
+            p1_to_use = prepare(p1);
+
+            /* Split a full interlaced frame into fields, without copying it. */
+            /* the dominant field goes first */
+            if (odd_dominant) {
+                field_band(&bands[0], p1_to_use, 1, 2, q);
+                field_band(&bands[1], p1_to_use, 0, 2, q);
+            } else {
+                field_band(&bands[0], p1_to_use, 0, 2, q);
+                field_band(&bands[1], p1_to_use, 1, 2, q);
+            }
+
+            ret = encode_field_pair(&bands[0], &bands[1], odd_dominant);
+        } else {
+            p1_to_use = prepare(p1);
+            size = encode_banded(p1_to_use, q);
+
+            /* set up the frame structure, wherever the data ended up */
+            ret = dest_frame;
+            ret->f1size = size;
+            ret->f2size = 0;
+            ret->interlaced = false;
+            ret->odd_dominant = odd_dominant;
+        }
+    } catch (std::runtime_error &e) {
+        free_prepared(p1_to_use, p1);
+        free_prepared(p2_to_use, p2);
+        throw;
+    }
+
+    free_prepared(p1_to_use, p1);
+    free_prepared(p2_to_use, p2);
+
+    return ret;
+}
+
+/* 
+ * Compress both fields at once: the first here, the second on a worker.
+ * f1 goes straight into dest_frame, then f2 gets copied in after it.
+ */
+mjpeg_frame *MJPEGEncoder::encode_field_pair(struct encode_band *f1,
+        struct encode_band *f2, bool odd_dominant) {
+    struct encode_band *fields[2] = { f1, f2 };
+
+    if (workers[0] == NULL) {
+        workers[0] = new MJPEGEncodeWorker(alloc_size);
+    }
+
+    workers[0]->submit(f2);
+
+    compress_band_noted(&cinfo, f1, &scratch, dest_frame->data, dest_room,
+        spill_data( ), frame_limit);
+
+    workers[0]->wait_done( );
+    check_bands(fields, 2);
+
+    if (f1->out != dest_frame->data) {
+        spill(0);
+    }
+
+    if (f1->out_size + f2->out_size > dest_room && spill_data( ) != NULL) {
+        spill(f1->out_size);
+    }
+
+    if (f1->out_size + f2->out_size > dest_room) {
+        throw FrameTooLarge( );
+    }
+
+    memcpy(dest_frame->data + f1->out_size, f2->out, f2->out_size);
+
+    dest_frame->f1size = f1->out_size;
+    dest_frame->f2size = f2->out_size;
+    dest_frame->interlaced = true;
+    dest_frame->odd_dominant = odd_dominant;
+
+    if (stats) {
+        stats->band_time(0, f1->usec);
+        stats->band_time(1, f2->usec);
+    }
+
+    return dest_frame;
 }
 
 MJPEGEncoder::~MJPEGEncoder( ) {
+    int i;
+
+    for (i = 0; i < MAX_ENCODE_THREADS; i++) {
+        if (workers[i] != NULL) {
+            delete workers[i];
+        }
+    }
+
     jpeg_destroy_compress(&cinfo);
+    free(band_buf);
+    free(scratch.buf);
     free(out_frame);
 }
 
@@ -190,15 +965,36 @@ MJPEGDecoder::MJPEGDecoder( ) {
 
     jpeg_create_decompress(&cinfo);
 
+    scratch.buf = NULL;
+    scratch.size = 0;
+    scale_denom = 1;
+}
+
+void MJPEGDecoder::set_scale(int denom) {
+    if (denom != 1 && denom != 2 && denom != 4 && denom != 8) {
+        throw std::runtime_error("decode scale must be 1/1, 1/2, 1/4 or 1/8");
+    }
+
+    scale_denom = denom;
 }
 
-Picture *MJPEGDecoder::decode_full(mjpeg_frame *frame, enum pixel_format fmt) {
+/*
+ * header is the caller's own copy (see mjpeg_frame_copy_header), so
+ * nothing here reads the frame's header back out of a shared buffer.
+ */
+Picture *MJPEGDecoder::decode_full(const struct mjpeg_frame *header,
+        const uint8_t *data, enum pixel_format fmt) {
     Picture *f1, *f2, *out;
-    if (frame->interlaced) {
-        f1 = decode_first(frame, fmt);
-        f2 = decode_second(frame, fmt);
+    if (header->interlaced) {
+        f1 = decode_first(header, data, fmt);
+        try {
+            f2 = decode_second(header, data, fmt);
+        } catch (std::runtime_error &e) {
+            Picture::free(f1);
+            throw;
+        }
         
-        if (frame->odd_dominant) {
+        if (header->odd_dominant) {
             out = weave(f2, f1);
         } else {
             out = weave(f1, f2);
@@ -207,7 +1003,7 @@ Picture *MJPEGDecoder::decode_full(mjpeg_frame *frame, enum pixel_format fmt) {
         Picture::free(f1);
         Picture::free(f2);
     } else {
-        out = decode(frame->data, frame->f1size, fmt);
+        out = decode((void *) data, header->f1size, fmt);
     }
     return out;
 }
@@ -237,27 +1033,30 @@ Picture *MJPEGDecoder::weave(Picture *even, Picture *odd) {
     return out;
 }
 
-Picture *MJPEGDecoder::decode_first(mjpeg_frame *frame, enum pixel_format fmt) {
-    if (frame->interlaced) {
-        return decode(frame->data, frame->f1size, fmt);
+Picture *MJPEGDecoder::decode_first(const struct mjpeg_frame *header,
+        const uint8_t *data, enum pixel_format fmt) {
+    if (header->interlaced) {
+        return decode((void *) data, header->f1size, fmt);
     } else {
-        return decode_full(frame, fmt);
+        return decode_full(header, data, fmt);
     }
 }
 
-Picture *MJPEGDecoder::decode_second(mjpeg_frame *frame, enum pixel_format fmt) {
-    if (frame->interlaced) {
-        return decode(frame->data + frame->f1size, frame->f2size, fmt);
+Picture *MJPEGDecoder::decode_second(const struct mjpeg_frame *header,
+        const uint8_t *data, enum pixel_format fmt) {
+    if (header->interlaced) {
+        return decode((void *) (data + header->f1size), header->f2size, fmt);
     } else {
-        return decode_full(frame, fmt);
+        return decode_full(header, data, fmt);
     }
 }
 
-Picture *MJPEGDecoder::decode_first_doubled(mjpeg_frame *frame, enum pixel_format fmt) {
+Picture *MJPEGDecoder::decode_first_doubled(const struct mjpeg_frame *header,
+        const uint8_t *data, enum pixel_format fmt) {
     Picture *field, *ret;
-    if (frame->interlaced) {
-        field = decode_first(frame, fmt);
-        if (frame->odd_dominant) {
+    if (header->interlaced) {
+        field = decode_first(header, data, fmt);
+        if (header->odd_dominant) {
             ret = scan_double_up(field);
         } else {
             ret = scan_double_down(field);
@@ -266,8 +1065,8 @@ Picture *MJPEGDecoder::decode_first_doubled(mjpeg_frame *frame, enum pixel_forma
         return ret;
     } else {
         // scan double the appropriate scanlines from the full frame
-        Picture *out = decode_full(frame, fmt);
-        if (frame->odd_dominant) {
+        Picture *out = decode_full(header, data, fmt);
+        if (header->odd_dominant) {
             scan_double_full_frame_odd(out);
         } else {
             scan_double_full_frame_even(out);
@@ -276,11 +1075,12 @@ Picture *MJPEGDecoder::decode_first_doubled(mjpeg_frame *frame, enum pixel_forma
     }
 }
 
-Picture *MJPEGDecoder::decode_second_doubled(mjpeg_frame *frame, enum pixel_format fmt) {
+Picture *MJPEGDecoder::decode_second_doubled(const struct mjpeg_frame *header,
+        const uint8_t *data, enum pixel_format fmt) {
     Picture *field, *ret;
-    if (frame->interlaced) {
-        field = decode_second(frame, fmt);
-        if (frame->odd_dominant) {
+    if (header->interlaced) {
+        field = decode_second(header, data, fmt);
+        if (header->odd_dominant) {
             ret = scan_double_down(field);
         } else {
             ret = scan_double_up(field);
@@ -289,8 +1089,8 @@ Picture *MJPEGDecoder::decode_second_doubled(mjpeg_frame *frame, enum pixel_form
         return ret;
     } else {
         // scan double the appropriate scanlines from the full frame
-        Picture *out = decode_full(frame, fmt);
-        if (frame->odd_dominant) {
+        Picture *out = decode_full(header, data, fmt);
+        if (header->odd_dominant) {
             scan_double_full_frame_even(out);
         } else {
             scan_double_full_frame_odd(out);
@@ -383,38 +1183,158 @@ void MJPEGDecoder::scan_double_full_frame_odd(Picture *p) {
     }
 }
 
+/*
+ * A torn or corrupt frame makes libjpeg throw part way through, so put
+ * cinfo back to a clean state before passing the error on; otherwise
+ * every decode after it fails too.
+ */
 Picture *MJPEGDecoder::decode(void *data, size_t len, enum pixel_format fmt) {
-    Picture *output;
-        
-    
-    jpeg_mem_src(&cinfo, data, len);
-    jpeg_read_header(&cinfo, TRUE);
+    Picture *output = NULL;
 
-    if (fmt == RGB8) {
-        cinfo.out_color_space = JCS_RGB;
-    } else if (fmt == YUV8) {
-        cinfo.out_color_space = JCS_YCbCr;
-    } else {
-        throw std::runtime_error("Cannot decode to that pixel format");
+    try {
+        jpeg_mem_src(&cinfo, data, len);
+        jpeg_read_header(&cinfo, TRUE);
+
+        /* jpeg_read_header resets these, so set them every time */
+        cinfo.scale_num = 1;
+        cinfo.scale_denom = scale_denom;
+
+        if (fmt == UYVY8) {
+            decode_uyvy8(&output);
+        } else {
+            if (fmt == RGB8) {
+                cinfo.out_color_space = JCS_RGB;
+            } else if (fmt == YUV8) {
+                cinfo.out_color_space = JCS_YCbCr;
+            } else {
+                throw std::runtime_error("Cannot decode to that pixel format");
+            }
+
+            jpeg_start_decompress(&cinfo);
+
+            /* picture dimensions are calculated, so allocate */
+            output = Picture::alloc(cinfo.output_width, cinfo.output_height,
+                cinfo.output_width * cinfo.output_components, fmt);
+
+            uint8_t *data_ptr = output->data;
+            while (cinfo.output_scanline < cinfo.output_height) {
+                jpeg_read_scanlines(&cinfo, &data_ptr, 1);        
+                data_ptr += output->line_pitch;
+            }
+        }
+
+        jpeg_finish_decompress(&cinfo);
+    } catch (std::runtime_error &e) {
+        jpeg_abort_decompress(&cinfo);
+        if (output != NULL) {
+            Picture::free(output);
+        }
+        throw;
     }
 
-    jpeg_start_decompress(&cinfo);
+    return output;
+}
 
-    /* picture dimensions are calculated, so allocate */
-    output = Picture::alloc(cinfo.output_width, cinfo.output_height,
-        cinfo.output_width * cinfo.output_components, fmt);
+/* interleave one line's worth of planar 4:2:2 into UYVY */
+static void planar_to_uyvy(uint8_t *dst, const uint8_t *y, const uint8_t *cb,
+        const uint8_t *cr, uint16_t w) {
+    uint16_t i;
 
-    uint8_t *data_ptr = output->data;
-    while (cinfo.output_scanline < cinfo.output_height) {
-        jpeg_read_scanlines(&cinfo, &data_ptr, 1);        
-        data_ptr += output->line_pitch;
+    for (i = 0; i < w / 2; i++) {
+        *dst++ = cb[i];
+        *dst++ = y[2*i];
+        *dst++ = cr[i];
+        *dst++ = y[2*i + 1];
     }
+}
+
+/* 
+ * Decode straight to UYVY8, after decode( ) has read the header, into
+ * *output (set as soon as it's allocated, so decode( ) can clean up).
+ * If the JPEG is YCbCr with 2:1 horizontal chroma subsampling (what we
+ * encode, or 4:2:0 from older ingest), take the planes as raw data from
+ * libjpeg and just interleave them. Anything else gets converted to
+ * YCbCr by libjpeg and has its chroma averaged down.
+ */
+void MJPEGDecoder::decode_uyvy8(Picture **out) {
+    jpeg_component_info *comp = cinfo.comp_info;
+    Picture *output;
+    uint8_t *buf;
+    int j, v;
+    JDIMENSION base;
+
+    /* the raw path assumes full 8x8 blocks, so scaled decodes go the slow way */
+    bool raw = scale_denom == 1
+        && cinfo.num_components == 3 
+        && cinfo.jpeg_color_space == JCS_YCbCr
+        && comp[0].h_samp_factor == 2
+        && (comp[0].v_samp_factor == 1 || comp[0].v_samp_factor == 2)
+        && comp[1].h_samp_factor == 1 && comp[1].v_samp_factor == 1
+        && comp[2].h_samp_factor == 1 && comp[2].v_samp_factor == 1;
+
+    if (raw) {
+        JSAMPROW y_rows[2*DCTSIZE], cb_rows[DCTSIZE], cr_rows[DCTSIZE];
+        JSAMPARRAY planes[3] = { y_rows, cb_rows, cr_rows };
+        size_t y_width, c_width;
+
+        cinfo.raw_data_out = TRUE;
+        jpeg_start_decompress(&cinfo);
+
+        /* whole MCUs, since that's what libjpeg hands back */
+        v = comp[0].v_samp_factor;
+        c_width = cinfo.MCUs_per_row * DCTSIZE;
+        y_width = 2 * c_width;
+
+        buf = reserve_rows(&scratch, DCTSIZE * (v * y_width + 2 * c_width));
+        for (j = 0; j < v * DCTSIZE; j++) {
+            y_rows[j] = buf + j * y_width;
+        }
+        buf += v * DCTSIZE * y_width;
+        for (j = 0; j < DCTSIZE; j++) {
+            cb_rows[j] = buf + j * c_width;
+            cr_rows[j] = buf + (DCTSIZE + j) * c_width;
+        }
 
-    jpeg_finish_decompress(&cinfo);
+        output = *out = Picture::alloc(cinfo.output_width, 
+            cinfo.output_height, 2 * cinfo.output_width, UYVY8);
 
-    return output;
+        while (cinfo.output_scanline < cinfo.output_height) {
+            base = cinfo.output_scanline;
+            jpeg_read_raw_data(&cinfo, planes, v * DCTSIZE);
+
+            for (j = 0; j < v * DCTSIZE && base + j < cinfo.output_height; j++) {
+                planar_to_uyvy(output->scanline(base + j), y_rows[j], 
+                    cb_rows[j / v], cr_rows[j / v], output->w);
+            }
+        }
+    } else {
+        uint8_t *row, *in_ptr, *out_ptr;
+        JDIMENSION i;
+
+        cinfo.out_color_space = JCS_YCbCr;
+        jpeg_start_decompress(&cinfo);
+
+        row = reserve_rows(&scratch, 3 * cinfo.output_width);
+        output = *out = Picture::alloc(cinfo.output_width, 
+            cinfo.output_height, 2 * cinfo.output_width, UYVY8);
+
+        while (cinfo.output_scanline < cinfo.output_height) {
+            out_ptr = output->scanline(cinfo.output_scanline);
+            jpeg_read_scanlines(&cinfo, &row, 1);
+
+            in_ptr = row;
+            for (i = 0; i + 1 < cinfo.output_width; i += 2) {
+                *out_ptr++ = (in_ptr[1] + in_ptr[4]) / 2;
+                *out_ptr++ = in_ptr[0];
+                *out_ptr++ = (in_ptr[2] + in_ptr[5]) / 2;
+                *out_ptr++ = in_ptr[3];
+                in_ptr += 6;
+            }
+        }
+    }
 }
 
 MJPEGDecoder::~MJPEGDecoder( ) {
     jpeg_destroy_decompress(&cinfo);
+    free(scratch.buf);
 }
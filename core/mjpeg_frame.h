@@ -3,15 +3,48 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "jpeglib.h"
 
 #include <stdint.h>
 #include <list>
 
 #include "picture.h"
+#include "thread.h"
+#include "mutex.h"
+#include "condition.h"
 
 #include <stdexcept>
 
+class EncodeStats;
+
+/* 
+ * Most bands a frame will be split into for parallel encoding.
+ * Band boundaries fall on MCU rows (16 scanlines for 4:2:0 or 4:2:2).
+ */
+#define MAX_ENCODE_THREADS 16
+#define ENCODE_BAND_ALIGN 16
+
+/*
+ * Rate control models a frame's size as complexity / scale^RC_EXPONENT,
+ * where scale is libjpeg's quantizer scaling for the quality, and tracks
+ * complexity from recent frames. Quality moves at most RC_MAX_STEP per
+ * frame and never below RC_MIN_QUALITY, except to make a frame fit.
+ */
+#define RC_EXPONENT 0.75
+#define RC_SMOOTHING 0.25
+#define RC_MAX_STEP 10
+#define RC_MIN_QUALITY 20
+
+/* a frame too big for its buffer slot gets this many tries at lower quality */
+#define MAX_ENCODE_RETRIES 6
+
+/* what the encoder throws when a frame won't fit where it has to go */
+class FrameTooLarge : public std::runtime_error {
+    public:
+        FrameTooLarge( ) : std::runtime_error("encoded frame too large") { }
+};
+
 struct mjpeg_frame {
     uint32_t clock;
     bool interlaced;
@@ -21,17 +54,137 @@ struct mjpeg_frame {
     uint8_t data[0];
 };
 
+/* 
+ * Sanity check a frame header against the size of the record it came from
+ * (for frames borrowed from a buffer, which could be torn or overwritten).
+ */
+static inline bool mjpeg_frame_fits(const struct mjpeg_frame *frame, size_t size) {
+    return size >= sizeof(struct mjpeg_frame)
+        && frame->f1size <= size - sizeof(struct mjpeg_frame)
+        && frame->f2size <= size - sizeof(struct mjpeg_frame) - frame->f1size;
+}
+
+/*
+ * The same for a frame the writer may be rewriting as we go: take a copy
+ * of its header first and check that, and decode with the copy from then
+ * on. (Checking the header in place and reading it again later could
+ * see two different headers.)
+ */
+static inline bool mjpeg_frame_copy_header(const struct mjpeg_frame *frame, 
+        size_t size, struct mjpeg_frame *header) {
+    if (size < sizeof(struct mjpeg_frame)) {
+        return false;
+    }
+    memcpy(header, frame, sizeof(struct mjpeg_frame));
+    return mjpeg_frame_fits(header, size);
+}
+
+/* 
+ * One horizontal slice of a picture, compressed as a JPEG of its own.
+ * The encoder fills in the input half and whoever runs it does the rest.
+ */
+struct encode_band {
+    uint8_t *data;
+    size_t line_pitch;
+    uint16_t w, h;
+    enum pixel_format pix_fmt; /* RGB8, YUV8 or UYVY8 */
+    int quality;
+
+    uint8_t *out;
+    size_t out_size;
+    uint32_t usec;
+    bool failed;
+    bool too_large;     /* failed because it ran out of room */
+};
+
+/* staging area for feeding UYVY to libjpeg as planar rows */
+struct planar_rows {
+    uint8_t *buf;
+    size_t size;
+};
+
+class MJPEGEncodeWorker : public Thread {
+    public:
+        MJPEGEncodeWorker(size_t alloc_size);
+        virtual ~MJPEGEncodeWorker( );
+
+        void submit(struct encode_band *band);
+        void wait_done(void);
+
+    protected:
+        void run(void);
+
+        struct jpeg_compress_struct cinfo;
+        struct jpeg_error_mgr jerr;
+        uint8_t *buf;
+        size_t alloc_size;
+        struct planar_rows scratch;
+
+        struct encode_band *job;
+        bool exiting;
+        Mutex mut;
+        Condition job_cond;
+        Condition done_cond;
+};
+
 class MJPEGEncoder {
     public:
         MJPEGEncoder( );
-        mjpeg_frame *encode_full(Picture *pict, bool odd_dominant);
-        mjpeg_frame *encode_fields(Picture *f1, Picture *f2, bool odd_dominant);
+
+        /*
+         * These return a frame the encoder owns, good until the next call.
+         * Given dest, they encode straight into it instead (dest_size
+         * bytes, header and all: say, space from MmapBuffer::reserve( )).
+         * A frame that outgrows dest spills over into the encoder's own
+         * buffer, so check which one came back.
+         */
+        mjpeg_frame *encode_full(Picture *pict, bool odd_dominant,
+            void *dest = NULL, size_t dest_size = 0);
+        mjpeg_frame *encode_fields(Picture *f1, Picture *f2, bool odd_dominant,
+            void *dest = NULL, size_t dest_size = 0);
+        /* same, but split the fields out of a full interlaced frame */
+        mjpeg_frame *encode_interlaced(Picture *pict, bool odd_dominant,
+            void *dest = NULL, size_t dest_size = 0);
         
         void set_quality(int quality) {
             if (quality < 0 || quality > 100) {
                 throw std::runtime_error("Invalid quality value supplied");
             }
             this->quality = quality;
+
+            /* rate control starts again from under the new ceiling */
+            if (rc_quality > quality) {
+                rc_quality = quality;
+            }
+        }
+
+        /* 
+         * Split each frame into this many bands and encode them in
+         * parallel. The result is still one baseline JPEG, with restart
+         * markers at the band boundaries.
+         */
+        void set_threads(int n_threads);
+
+        /*
+         * Rate control: aim for frames of about this many bytes, picking
+         * each frame's quality from the sizes of the last few and never
+         * going above the quality given to set_quality( ). 0 (the default)
+         * encodes everything at that quality.
+         */
+        void set_target_size(size_t bytes) {
+            target_size = bytes;
+        }
+
+        /* 
+         * Never make a frame (header and all) bigger than this; a frame
+         * that would be gets encoded again at lower quality. Defaults to,
+         * and can't go over, MAX_FRAME_SIZE. 
+         */
+        void set_max_frame_size(size_t bytes);
+
+        /* if set, per-band encode times (and qualities used) get reported here */
+        void set_stats(EncodeStats *stats) {
+            this->stats = stats;
         }
 
         ~MJPEGEncoder( );
@@ -40,20 +193,84 @@ class MJPEGEncoder {
         struct jpeg_compress_struct cinfo;
         struct jpeg_error_mgr jerr;
         size_t alloc_size;
+        size_t frame_limit; /* most data a frame may have, <= alloc_size */
         int quality;
 
+        /* where the frame being encoded is going, and how much fits */
+        mjpeg_frame *dest_frame;
+        size_t dest_room;
+
+        size_t target_size;
+        double complexity;  /* 0 until the first frame */
+        int rc_quality;     /* what rate control chose last */
+
+        int n_threads;
+        MJPEGEncodeWorker *workers[MAX_ENCODE_THREADS];
+        uint8_t *band_buf;
+        EncodeStats *stats;
+
+        struct planar_rows scratch;
+
+        enum encode_kind { ENCODE_FULL, ENCODE_FIELDS, ENCODE_INTERLACED };
+        mjpeg_frame *encode(enum encode_kind kind, Picture *p1, Picture *p2,
+            bool odd_dominant, void *dest, size_t dest_size);
+        mjpeg_frame *encode_at(enum encode_kind kind, Picture *p1, Picture *p2,
+            bool odd_dominant, int q);
+        int pick_quality(void);
+        void update_rate(size_t size, int q);
+
+        Picture *prepare(Picture *pict);
+        void aim(void *dest, size_t dest_size);
+        uint8_t *spill_data(void);
+        void spill(size_t used);
+
+        size_t encode_banded(Picture *pict, int q);
+        mjpeg_frame *encode_field_pair(struct encode_band *f1,
+            struct encode_band *f2, bool odd_dominant);
 };
 
 class MJPEGDecoder {
     public:
         MJPEGDecoder( );
         ~MJPEGDecoder( );
-        Picture *decode_full(struct mjpeg_frame *frame, enum pixel_format fmt = RGB8);
-        Picture *decode_first(struct mjpeg_frame *frame, enum pixel_format fmt = RGB8);
-        Picture *decode_second(struct mjpeg_frame *frame, enum pixel_format fmt = RGB8);
+        Picture *decode_full(struct mjpeg_frame *frame, enum pixel_format fmt = RGB8) {
+            return decode_full(frame, frame->data, fmt);
+        }
+        Picture *decode_first(struct mjpeg_frame *frame, enum pixel_format fmt = RGB8) {
+            return decode_first(frame, frame->data, fmt);
+        }
+        Picture *decode_second(struct mjpeg_frame *frame, enum pixel_format fmt = RGB8) {
+            return decode_second(frame, frame->data, fmt);
+        }
         /* Scan doubling - e.g. for smooth slow motion */
-        Picture *decode_first_doubled(struct mjpeg_frame *frame, enum pixel_format fmt = RGB8);
-        Picture *decode_second_doubled(struct mjpeg_frame *frame, enum pixel_format fmt = RGB8);
+        Picture *decode_first_doubled(struct mjpeg_frame *frame, enum pixel_format fmt = RGB8) {
+            return decode_first_doubled(frame, frame->data, fmt);
+        }
+        Picture *decode_second_doubled(struct mjpeg_frame *frame, enum pixel_format fmt = RGB8) {
+            return decode_second_doubled(frame, frame->data, fmt);
+        }
+
+        /* 
+         * The same for frames borrowed from a buffer: decode data (the
+         * frame's) as described by header, a copy made with
+         * mjpeg_frame_copy_header( ), never the header in the buffer.
+         */
+        Picture *decode_full(const struct mjpeg_frame *header, 
+            const uint8_t *data, enum pixel_format fmt);
+        Picture *decode_first(const struct mjpeg_frame *header, 
+            const uint8_t *data, enum pixel_format fmt);
+        Picture *decode_second(const struct mjpeg_frame *header, 
+            const uint8_t *data, enum pixel_format fmt);
+        Picture *decode_first_doubled(const struct mjpeg_frame *header, 
+            const uint8_t *data, enum pixel_format fmt);
+        Picture *decode_second_doubled(const struct mjpeg_frame *header, 
+            const uint8_t *data, enum pixel_format fmt);
+        /* 
+         * Shrink decoded pictures by 1/denom (1, 2, 4 or 8) in the DCT
+         * domain. Much cheaper than decoding full size and scaling down,
+         * so it's what thumbnails and multiviewers want.
+         */
+        void set_scale(int denom);
     protected:
         /* These return a full-frame Picture given one field. */
         Picture *scan_double_up(Picture *in);
@@ -65,9 +282,12 @@ class MJPEGDecoder {
         void scan_double_full_frame_odd(Picture *p); 
 
         Picture *decode(void *data, size_t len, enum pixel_format fmt = RGB8);
+        void decode_uyvy8(Picture **out);
         Picture *weave(Picture *even, Picture *odd);
         struct jpeg_decompress_struct cinfo;
         struct jpeg_error_mgr jerr;
+        struct planar_rows scratch;
+        int scale_denom;
 };
 
 #endif
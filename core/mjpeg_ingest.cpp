@@ -28,10 +28,11 @@ extern "C" {
 MmapBuffer *buffer;
 
 void usage(const char *name) {
-    fprintf(stderr, "usage: %s [-e|-o|--even-dominant|--odd-dominant] [-p|--progressive-input] buffer_file\n", name);
+    fprintf(stderr, "usage: %s [-e|-o|--even-dominant|--odd-dominant] [-p|--progressive-input] [-r|--recover] buffer_file\n", name);
     fprintf(stderr, "    -e, --even-dominant: assume input is sequential fields in even-dominant order\n");
     fprintf(stderr, "    -o, --odd-dominant: assume input is sequential fields in odd-dominant order\n");
     fprintf(stderr, "    -p, --progressive-input: assume input is interlaced fields with the specified dominance\n");
+    fprintf(stderr, "    -r, --recover: rebuild the buffer header from the frames (after a crash)\n");
     fprintf(stderr, "examples:\n");
     fprintf(stderr, "    some_stream_of_frames | %s d1: input progressive scan video\n", name);
     fprintf(stderr, "    some_stream_of_fields | %s -e d1: input separate fields in even-dominant order\n", name);
@@ -55,6 +56,7 @@ int main(int argc, char *argv[])
     /* The dominant field is input (and output, and stored) first. */
     bool dominant_field = true;
     bool force_progressive_input = false;
+    bool recover = false;
 
     /* getopt stuff */
     const struct option options[] = {
@@ -75,12 +77,19 @@ int main(int argc, char *argv[])
             has_arg: 0,
             flag: NULL,
             val: 'p'
-        }
+        },
+        {
+            name: "recover",
+            has_arg: 0,
+            flag: NULL,
+            val: 'r'
+        },
+        { 0, 0, 0, 0 }
     };
 
     int opt;
 
-    while ((opt = getopt_long(argc, argv, "eop", options, NULL)) != EOF) {
+    while ((opt = getopt_long(argc, argv, "eopr", options, NULL)) != EOF) {
         switch (opt) {
             case 'e':
                 if (interlacing_mode == PROGRESSIVE) {
@@ -103,6 +112,9 @@ int main(int argc, char *argv[])
             case 'p':
                 force_progressive_input = true;
                 break;
+            case 'r':
+                recover = true;
+                break;
             default:
                 usage(argv[0]);
                 exit(1);
@@ -140,6 +152,14 @@ int main(int argc, char *argv[])
 
     /* Open the ring buffer files. */
     buffer = new MmapBuffer(argv[optind], MAX_FRAME_SIZE); 
+    if (recover) {
+        if (buffer->recover( )) {
+            fprintf(stderr, "recovered buffer up to timecode %d\n",
+                buffer->get_timecode( ) + 1);
+        } else {
+            fprintf(stderr, "nothing to recover, starting an empty buffer\n");
+        }
+    }
 
     /* 
      * Parse stdin, looking for jpeg markers. 
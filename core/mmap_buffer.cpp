@@ -8,34 +8,69 @@
  */
 
 #include "mmap_buffer.h"
+#include "thread.h"
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdexcept>
 #include <memory.h>
+#include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <time.h>
 
-/* cycles of the spinlock loop before we think to write it off as a dead process */
-#define DEADLOCK_THRESHOLD 1000000
+/* 
+ * spins of the seqlock read loop before we decide the writer died in the
+ * middle of updating the header
+ */
+#define SEQLOCK_RETRY_LIMIT 1000000
 
 /*
  * appropriate given the hour of the night at which I wrote most of this...
  */
 #define MAGIC 0xdecafbad
+#define SEEK_MAGIC 0x5eec1dec
+
+/* how often the residency keeper catches up with the head */
+#define RESIDENCY_PASS_USEC 1000000
+#define RESIDENCY_TICK_USEC 100000
+
+/* (Linux 5.4; older kernels just say EINVAL, which is fine) */
+#ifndef MADV_COLD
+#define MADV_COLD 20
+#endif
 
 
 /* 
  * Important assumptions which are pervasive in this code: 
  *
  * Only one process ever writes to the ring buffer at a time. (ingest process)
- * Only access to the metadata is locked. If the buffer is large enough, data
- * will never be read and written at the same time.
+ * Nobody ever takes a lock. The writer bumps mmapped_ipc->seq to an odd
+ * value while it moves the head and back to an even one when it's done,
+ * so readers just retry if they see an odd or changed sequence number.
+ * Records are guarded the same way by their own timecode and valid flag:
+ * the writer clears valid before it touches a record, and readers check
+ * both again after copying the data out.
+ *
+ * In packed buffers a new record can land on top of the middle of an old
+ * one, so the valid flag isn't enough there. Instead the writer publishes
+ * write_limit (the logical end of whatever it is about to scribble on)
+ * before it starts, and a record is intact as long as it starts no more
+ * than data_size bytes before write_limit.
+ *
+ * The seek index lives in its own file so old buffers and old readers
+ * don't notice it. It is created by whoever first puts a frame into the
+ * buffer; a reader that finds no index just can't seek by time.
  */
- 
+
+static inline uint64_t packed_align(uint64_t x) {
+    return (x + PACKED_RECORD_ALIGN - 1) & ~(uint64_t)(PACKED_RECORD_ALIGN - 1);
+}
 
 MmapBuffer::MmapBuffer(const char *file, unsigned int record_size, bool reset) {
     struct stat statbuf;
@@ -43,6 +78,23 @@ MmapBuffer::MmapBuffer(const char *file, unsigned int record_size, bool reset) {
     data_fd = -1;
     mmapped_ipc = NULL;
     mmapped_data = NULL;
+    index = NULL;
+    packed_data = NULL;
+    seek_ipc = NULL;
+    seek_entries = NULL;
+    seek_map_size = 0;
+    reserved = NULL;
+    keeper = NULL;
+    hot_start = hot_length = 0;
+    lock_start = lock_length = 0;
+    lock_limit = 0;
+
+    seek_file = (char *) malloc(strlen(file) + sizeof(".index"));
+    if (seek_file == NULL) {
+        throw std::runtime_error("Failed to allocate seek index name");
+    }
+    strcpy(seek_file, file);
+    strcat(seek_file, ".index");
 
     my_pid = getpid( );
 
@@ -71,20 +123,48 @@ MmapBuffer::MmapBuffer(const char *file, unsigned int record_size, bool reset) {
         throw std::runtime_error("Failed to mmap shared state");
     }
 
+    bool fresh = (mmapped_ipc->magic != MAGIC || reset);
+
+    if (fresh) {
+        uint16_t epoch = (mmapped_ipc->magic == MAGIC)
+            ? mmapped_ipc->epoch + 1 : (uint16_t) time(NULL);
 
-    if (mmapped_ipc->magic != MAGIC || reset) {
         // we're the first one here. we must be the source...
-        // note this also will forcibly unlock any old locks... for better or worse.
-        mmapped_ipc->lock_pid = my_pid;
+        mmapped_ipc->seq = 1;
+        mmapped_ipc->lock_pid = 0;
         mmapped_ipc->magic = MAGIC;
         mmapped_ipc->record_size = record_size;
         mmapped_ipc->current_timecode = -1;
         mmapped_ipc->current_offset = 0;
         mmapped_ipc->max_offset = (statbuf.st_size - RINGBUF_ALIGN_BOUNDARY);
-        mmapped_ipc->lock_pid = 0;
+        mmapped_ipc->layout = LAYOUT_PACKED;
+        mmapped_ipc->index_entries = mmapped_ipc->max_offset 
+            / (PACKED_BYTES_PER_INDEX_SLOT + sizeof(struct index_entry));
+        mmapped_ipc->data_start = 
+            (mmapped_ipc->index_entries * sizeof(struct index_entry)
+                + RINGBUF_ALIGN_BOUNDARY - 1)
+            & ~(offset_t)(RINGBUF_ALIGN_BOUNDARY - 1);
+        mmapped_ipc->data_size = 
+            (mmapped_ipc->max_offset - mmapped_ipc->data_start)
+            & ~(offset_t)(PACKED_RECORD_ALIGN - 1);
+        mmapped_ipc->write_pos = 0;
+        mmapped_ipc->write_limit = 0;
+        memset((void *)mmapped_ipc->format, 0, FORMAT_TAG_SIZE);
+        mmapped_ipc->epoch = (epoch != 0) ? epoch : 1;
     }
 
-    n_records = mmapped_ipc->max_offset / mmapped_ipc->record_size;
+    /* 
+     * A writer starting afresh always makes a packed buffer, whatever it
+     * was before, so readers go by the layout they found and give up on
+     * the buffer if it changes (see read_head).
+     */
+    layout = mmapped_ipc->layout;
+
+    if (layout == LAYOUT_PACKED) {
+        n_records = mmapped_ipc->index_entries;
+    } else {
+        n_records = mmapped_ipc->max_offset / mmapped_ipc->record_size;
+    }
 
     /* 
      * align data starting at 4k (page boundary) into the file
@@ -101,11 +181,118 @@ MmapBuffer::MmapBuffer(const char *file, unsigned int record_size, bool reset) {
         perror("warning: madvise failed");
     }
 
+    if (layout == LAYOUT_PACKED) {
+        index = (struct index_entry *) mmapped_data;
+        packed_data = mmapped_data + mmapped_ipc->data_start;
+    }
+
+    if (fresh) {
+        if (layout == LAYOUT_PACKED) {
+            init_packed( );
+        }
+        __sync_synchronize( );
+        mmapped_ipc->seq = 0;
+    }
+
+    /* a reset buffer starts again at timecode 0, so the old index must go */
+    if (!open_seek_index(fresh, fresh) && fresh) {
+        perror("warning: failed to create seek index");
+    }
+}
+
+/*
+ * Map the seek index. With create, make (or resize) it if need be; with
+ * reset too, throw away whatever it held. Readers only map an index
+ * that matches the buffer.
+ */
+bool MmapBuffer::open_seek_index(bool create, bool reset) {
+    struct stat statbuf;
+    size_t size = sizeof(struct seek_header) 
+        + (size_t) n_records * sizeof(struct seek_entry);
+    bool init;
+    int fd;
+    void *map;
+
+    close_seek_index( );
+
+    fd = open(seek_file, create ? (O_RDWR | O_CREAT) : O_RDWR, 0644);
+    if (fd < 0) {
+        return false;
+    }
+
+    if (fstat(fd, &statbuf) < 0) {
+        close(fd);
+        return false;
+    }
+
+    init = reset || (size_t) statbuf.st_size != size;
+    if (init) {
+        /* 
+         * Zeroed entries are harmless: an entry reading timecode 0 can
+         * only be mistaken for timecode 0, which goes in slot 0 and is
+         * rewritten by the first put( ).
+         */
+        if (!create || ftruncate(fd, 0) < 0 || ftruncate(fd, size) < 0) {
+            close(fd);
+            return false;
+        }
+    }
+
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+
+    seek_ipc = (struct seek_header *) map;
+    seek_entries = (struct seek_entry *) 
+        ((char *) map + sizeof(struct seek_header));
+    seek_map_size = size;
+
+    if (init) {
+        seek_ipc->slots = n_records;
+        seek_ipc->segment = 0;
+        seek_ipc->last_clock = SEEK_NO_CLOCK;
+        __sync_synchronize( );
+        seek_ipc->magic = SEEK_MAGIC;
+    } else if (seek_ipc->magic != SEEK_MAGIC 
+            || seek_ipc->slots != (uint64_t) n_records) {
+        close_seek_index( );
+        return create && open_seek_index(true, true);
+    }
 
+    return true;
+}
+
+void MmapBuffer::close_seek_index(void) {
+    if (seek_ipc != NULL) {
+        munmap((void *)seek_ipc, seek_map_size);
+    }
+    seek_ipc = NULL;
+    seek_entries = NULL;
+    seek_map_size = 0;
+}
+
+/*
+ * Wipe the index of a freshly reset packed buffer, so entries left over
+ * from whatever used the file last can't be mistaken for ours.
+ * Punching a hole is nearly free; fall back to writing zeros.
+ */
+void MmapBuffer::init_packed(void) {
+    size_t index_size = mmapped_ipc->data_start;
+
+    if (fallocate(data_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+            RINGBUF_ALIGN_BOUNDARY, index_size) < 0) {
+        memset((void *)index, 0, index_size);
+    }
 }
 
 // Clean up the memory mappings.
 MmapBuffer::~MmapBuffer( ) {
+    keep_hot(0);
+    close_seek_index( );
+    free(seek_file);
+
     if (0 != mmapped_data) {
         munmap((void *)mmapped_data, mmapped_ipc->max_offset);
     }
@@ -123,118 +310,1255 @@ void MmapBuffer::on_fork( ) {
     my_pid = getpid( );
 }
 
-void MmapBuffer::lock( ) {
-    int counter = 0;
-    while (__sync_bool_compare_and_swap(&(mmapped_ipc->lock_pid), 0, my_pid)) {
-        ++counter;
-        if (counter == DEADLOCK_THRESHOLD) {
-            fprintf(stderr, "maybe deadlocked (held by pid %d)\n", mmapped_ipc->lock_pid);
-        }
-        if (counter > DEADLOCK_THRESHOLD) {
-            check_lock( );
+/*
+ * Read a consistent (timecode, offset) pair for the head of the buffer.
+ * Returns false if the writer seems to have died halfway through an update,
+ * or if the buffer has been reset into a different layout since we opened
+ * it.
+ */
+bool MmapBuffer::read_head(timecode_t *timecode, offset_t *offset) {
+    uint32_t seq_before, seq_after;
+    bool same_layout;
+    int counter;
+
+    for (counter = 0; counter < SEQLOCK_RETRY_LIMIT; ++counter) {
+        seq_before = mmapped_ipc->seq;
+        __sync_synchronize( );
+        *timecode = mmapped_ipc->current_timecode;
+        *offset = mmapped_ipc->current_offset;
+        same_layout = (mmapped_ipc->layout == layout);
+        __sync_synchronize( );
+        seq_after = mmapped_ipc->seq;
+
+        if (seq_before == seq_after && (seq_before & 1) == 0) {
+            /* 
+             * reset into the other layout since we opened it: the buffer
+             * we know how to read is gone, and nothing in it now is ours
+             */
+            return same_layout;
         }
     }
+
+    return false;
 }
 
-void MmapBuffer::check_lock( ) {
-    char buffer[256];
-    struct stat st;
-    int ret;
+timecode_t MmapBuffer::put(const void *data, size_t size, uint32_t clock,
+        uint64_t wall_usec) {
+    memcpy(reserve(size), data, size);
+    return commit(size, clock, wall_usec);
+}
 
-    pid_t holding_pid = mmapped_ipc->lock_pid;
-    snprintf(buffer, sizeof(buffer) - 1, "/proc/%d", holding_pid);
-    buffer[sizeof(buffer) - 1] = 0;
+size_t MmapBuffer::max_size(void) {
+    if (layout == LAYOUT_PACKED) {
+        offset_t room = mmapped_ipc->data_size - sizeof(struct record);
+        return (mmapped_ipc->record_size < room) 
+            ? mmapped_ipc->record_size : room;
+    } else {
+        return mmapped_ipc->record_size - sizeof(struct record);
+    }
+}
 
-    ret = stat(buffer, &st);
+void *MmapBuffer::reserve(size_t size, size_t *room) {
+    void *data;
 
-    if (ret < 0) {
-        // ENOENT = process not alive
-        if (errno == ENOENT) {
-            fprintf(stderr, "process %d holding lock seems dead, trying to forcibly unlock...\n", holding_pid);
-            if (__sync_bool_compare_and_swap(&(mmapped_ipc->lock_pid), holding_pid, 0)) {
-                fprintf(stderr, "... and, we're back!\n");
-            } else {
-                fprintf(stderr, "someone else got there first. Oh well.\n");
-            }
-        }
+    if (size > max_size( )) {
+        throw std::runtime_error("record too large for buffer");
+    }
+
+    if (layout == LAYOUT_PACKED) {
+        data = reserve_packed(size);
+    } else {
+        data = reserve_fixed( );
     }
+
+    if (room != NULL) {
+        *room = reserved_size;
+    }
+    return data;
 }
 
-void MmapBuffer::unlock( ) {
-    mmapped_ipc->lock_pid = 0;
+timecode_t MmapBuffer::commit(size_t size, uint32_t clock, 
+        uint64_t wall_usec) {
+    timecode_t timecode;
+
+    if (reserved == NULL || size > reserved_size) {
+        throw std::runtime_error("commit without a big enough reservation");
+    }
+
+    /* 
+     * Stamp before the frame goes in, so a reader that can see the frame
+     * can always find its stamp. 
+     */
+    if (seek_ipc != NULL || open_seek_index(true, false)) {
+        stamp(mmapped_ipc->current_timecode + 1, clock, wall_usec);
+    }
+
+    if (layout == LAYOUT_PACKED) {
+        timecode = commit_packed(size);
+    } else {
+        timecode = commit_fixed(size);
+    }
+
+    reserved = NULL;
+    return timecode;
 }
 
-timecode_t MmapBuffer::put(const void *data, size_t size) {
-    timecode_t save_timecode = mmapped_ipc->current_timecode;
+/* every record takes a whole slot here, so size doesn't matter */
+void *MmapBuffer::reserve_fixed(void) {
     offset_t save_offset = mmapped_ipc->current_offset;
-    struct record *rec;
 
-    /* compute the offset and timecode values for the new frame */
-    save_timecode++;
+    /* compute the offset for the new frame */
     save_offset += mmapped_ipc->record_size;
     if (save_offset > mmapped_ipc->max_offset - mmapped_ipc->record_size) {
         save_offset = 0;
     }
 
-    /* copy the data into the buffer */
-    rec = (struct record *)(mmapped_data + save_offset);
+    /* 
+     * Invalidate the record before anything gets written into it, so any
+     * reader still copying out the old contents notices it lost the race.
+     */
+    reserved = (struct record *)(mmapped_data + save_offset);
+    reserved->valid = false;
+    __sync_synchronize( );
+
+    reserved_position = save_offset;
+    reserved_size = mmapped_ipc->record_size - sizeof(struct record);
+    return reserved->data;
+}
+
+timecode_t MmapBuffer::commit_fixed(size_t size) {
+    timecode_t save_timecode = mmapped_ipc->current_timecode + 1;
+    struct record *rec = reserved;
+    uint32_t seq;
+
+    rec->epoch = mmapped_ipc->epoch;
     rec->length = size;
+    rec->timecode = save_timecode;
+    __sync_synchronize( );
     rec->valid = true;
+
+    /* 
+     * update the pointer and timecode values. 
+     * (| 1 so we recover if a previous writer died with seq left odd)
+     */
+    seq = mmapped_ipc->seq | 1;
+    mmapped_ipc->seq = seq;
+    __sync_synchronize( );
+    mmapped_ipc->current_offset = reserved_position;
+    mmapped_ipc->current_timecode = save_timecode;
+    __sync_synchronize( );
+    mmapped_ipc->seq = seq + 1;
+
+    return save_timecode;
+}
+
+void *MmapBuffer::reserve_packed(size_t size) {
+    offset_t data_size = mmapped_ipc->data_size;
+    offset_t position = mmapped_ipc->write_pos;
+    offset_t total = packed_align(sizeof(struct record) + size);
+    offset_t physical;
+
+    /* records never straddle the end of the data area: skip to the start */
+    physical = position % data_size;
+    if (physical + total > data_size) {
+        position += data_size - physical;
+        physical = 0;
+    }
+
+    /* 
+     * Claim the space before touching it, so readers of whatever lives
+     * there now will see that it's gone. The claim never moves back: a
+     * record committed smaller than reserved doesn't give back space
+     * that may already have been written on.
+     */
+    if (position + total > mmapped_ipc->write_limit) {
+        mmapped_ipc->write_limit = position + total;
+    }
+    __sync_synchronize( );
+
+    reserved = (struct record *)(packed_data + physical);
+    reserved->valid = false;
+
+    reserved_position = position;
+    reserved_size = size;
+    return reserved->data;
+}
+
+timecode_t MmapBuffer::commit_packed(size_t size) {
+    timecode_t save_timecode = mmapped_ipc->current_timecode + 1;
+    offset_t position = reserved_position;
+    struct record *rec = reserved;
+    volatile struct index_entry *entry;
+    uint32_t seq;
+
+    rec->epoch = mmapped_ipc->epoch;
+    rec->length = size;
     rec->timecode = save_timecode;
-    memcpy(rec->data, data, size);
+    __sync_synchronize( );
+    rec->valid = true;
+
+    /* point the index at it */
+    entry = &index[save_timecode % mmapped_ipc->index_entries];
+    entry->timecode = -1;
+    __sync_synchronize( );
+    entry->position = position;
+    entry->length = size;
+    __sync_synchronize( );
+    entry->timecode = save_timecode;
 
-    /* update the pointer and timecode values */
-    lock( );
-    mmapped_ipc->current_offset = save_offset;
+    /* and move the head (see commit_fixed) */
+    seq = mmapped_ipc->seq | 1;
+    mmapped_ipc->seq = seq;
+    __sync_synchronize( );
+    mmapped_ipc->current_offset = position;
     mmapped_ipc->current_timecode = save_timecode;
-    unlock( );
-    return mmapped_ipc->current_timecode;
+    mmapped_ipc->write_pos = position 
+        + packed_align(sizeof(struct record) + size);
+    __sync_synchronize( );
+    mmapped_ipc->seq = seq + 1;
+
+    return save_timecode;
 }
 
-bool MmapBuffer::get(void *data, size_t *size, timecode_t timecode) {
+void MmapBuffer::stamp(timecode_t timecode, uint32_t clock, 
+        uint64_t wall_usec) {
+    volatile struct seek_entry *entry;
+    struct timeval tv;
+
+    if (wall_usec == 0) {
+        gettimeofday(&tv, NULL);
+        wall_usec = (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+    }
+
+    /* 
+     * frames without a clock hold the last one, so they can't break up
+     * the run of a segment 
+     */
+    if (clock == SEEK_NO_CLOCK) {
+        clock = seek_ipc->last_clock;
+    } else if (seek_ipc->last_clock != SEEK_NO_CLOCK 
+            && clock > seek_ipc->last_clock) {
+        seek_ipc->segment++;
+    }
+    seek_ipc->last_clock = clock;
+
+    entry = &seek_entries[timecode % seek_ipc->slots];
+    entry->timecode = -1;
+    __sync_synchronize( );
+    entry->clock = clock;
+    entry->segment = seek_ipc->segment;
+    entry->wall_usec = wall_usec;
+    __sync_synchronize( );
+    entry->timecode = timecode;
+}
+
+/* one thread's share of a recovery scan */
+class RecoveryScan : public Thread {
+    public:
+        RecoveryScan(MmapBuffer *buf_, uint64_t first_, uint64_t last_) {
+            buf = buf_;
+            first = first_;
+            last = last_;
+        }
+
+        virtual ~RecoveryScan( ) { }
+
+        struct MmapBuffer::scan_result result;
+
+    protected:
+        void run(void) {
+            buf->scan(first, last, &result);
+        }
+
+        MmapBuffer *buf;
+        uint64_t first, last;
+};
+
+/*
+ * Find the newest record header in records first to last - 1 of a fixed
+ * buffer, or the newest entry in those index slots of a packed one. Only
+ * headers get read, so this costs a page per record at most.
+ */
+void MmapBuffer::scan(uint64_t first, uint64_t last, 
+        struct scan_result *result) {
+    recsize_t record_size = mmapped_ipc->record_size;
+    uint16_t epoch = mmapped_ipc->epoch;
+    uint64_t i;
+
+    result->timecode = -1;
+    result->position = 0;
+
+    for (i = first; i < last; i++) {
+        if (layout == LAYOUT_PACKED) {
+            volatile struct index_entry *entry = &index[i];
+            timecode_t timecode = entry->timecode;
+
+            /* (punched-out slots read as timecode 0) */
+            if (timecode > result->timecode 
+                    && (uint64_t) timecode % mmapped_ipc->index_entries == i) {
+                result->timecode = timecode;
+                result->position = entry->position;
+            }
+        } else {
+            struct record *rec = 
+                (struct record *)(mmapped_data + i * record_size);
+
+            if (rec->valid && rec->epoch == epoch 
+                    && rec->timecode > result->timecode
+                    && rec->length <= record_size - sizeof(struct record)) {
+                result->timecode = rec->timecode;
+                result->position = i * record_size;
+            }
+        }
+    }
+}
+
+/* 
+ * Is the record the index says holds timecode really there? It may never
+ * have made it to disk before the machine went down.
+ */
+bool MmapBuffer::recovered(timecode_t timecode, offset_t position) {
+    volatile struct index_entry *entry = 
+        &index[timecode % mmapped_ipc->index_entries];
+    offset_t physical = position % mmapped_ipc->data_size;
+    struct record *rec = (struct record *)(packed_data + physical);
+
+    if (entry->timecode != timecode || entry->position != position
+            || physical + sizeof(struct record) + entry->length 
+                > mmapped_ipc->data_size) {
+        return false;
+    }
+
+    return rec->valid && rec->timecode == timecode 
+        && rec->epoch == mmapped_ipc->epoch && rec->length == entry->length;
+}
+
+/*
+ * Each thread scans its own slice; the newest record anywhere is the
+ * head. Fixed buffers have to be scanned record by record, so turn off
+ * readahead while we do it or every header would drag in a whole frame.
+ * Packed buffers only need their (much smaller) index scanned, then the
+ * record it points to checked, walking back if that didn't survive.
+ */
+bool MmapBuffer::recover(int threads) {
+    bool packed = (layout == LAYOUT_PACKED);
+    uint64_t total = packed ? mmapped_ipc->index_entries : n_records;
+    RecoveryScan **scans;
+    struct scan_result best;
+    timecode_t timecode;
+    offset_t position = 0;
+    uint32_t seq;
+    int i;
+
+    if (threads <= 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if ((uint64_t) threads > total) {
+        threads = total;
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+
+    if (!packed && madvise((void *)mmapped_data, mmapped_ipc->max_offset, 
+            MADV_RANDOM) < 0) {
+        perror("warning: madvise failed");
+    }
+
+    scans = new RecoveryScan *[threads];
+    for (i = 0; i < threads; i++) {
+        scans[i] = new RecoveryScan(this, 
+            total * i / threads, total * (i + 1) / threads);
+        scans[i]->start( );
+    }
+
+    best.timecode = -1;
+    best.position = 0;
+    for (i = 0; i < threads; i++) {
+        scans[i]->join( );
+        if (scans[i]->result.timecode > best.timecode) {
+            best = scans[i]->result;
+        }
+        delete scans[i];
+    }
+    delete [] scans;
+
+    if (!packed && madvise((void *)mmapped_data, mmapped_ipc->max_offset, 
+            MADV_SEQUENTIAL) < 0) {
+        perror("warning: madvise failed");
+    }
+
+    timecode = best.timecode;
+    if (packed) {
+        while (timecode >= 0 && best.timecode - timecode < n_records) {
+            position = index[timecode % mmapped_ipc->index_entries].position;
+            if (recovered(timecode, position)) {
+                break;
+            }
+            timecode--;
+        }
+        if (timecode >= 0 && best.timecode - timecode >= n_records) {
+            timecode = -1;
+        }
+    } else {
+        position = best.position;
+    }
+
+    /* 
+     * Move the head (see commit_fixed). Whatever a dead writer was in the
+     * middle of is past write_pos, and the headers it scribbled on no
+     * longer match, so it's safe to pull write_limit back.
+     */
+    seq = mmapped_ipc->seq | 1;
+    mmapped_ipc->seq = seq;
+    __sync_synchronize( );
+    if (timecode >= 0) {
+        mmapped_ipc->current_timecode = timecode;
+        mmapped_ipc->current_offset = position;
+        if (packed) {
+            struct record *rec = (struct record *)
+                (packed_data + position % mmapped_ipc->data_size);
+            mmapped_ipc->write_pos = 
+                position + packed_align(sizeof(struct record) + rec->length);
+        }
+    } else {
+        mmapped_ipc->current_timecode = -1;
+        mmapped_ipc->current_offset = 0;
+        mmapped_ipc->write_pos = 0;
+    }
+    mmapped_ipc->write_limit = mmapped_ipc->write_pos;
+    __sync_synchronize( );
+    mmapped_ipc->seq = seq + 1;
+
+    reserved = NULL;
+
+    return timecode >= 0;
+}
+
+/*
+ * Find the record holding the given timecode. Returns NULL if it has
+ * fallen off the end of the buffer or hasn't been written yet.
+ * *position is only meaningful for packed buffers.
+ */
+struct MmapBuffer::record *MmapBuffer::locate(timecode_t timecode, 
+        offset_t *position) {
     struct record *rec;
+    timecode_t head_timecode;
+    offset_t head_offset;
     
-    lock( );
+    if (!read_head(&head_timecode, &head_offset)) {
+        return NULL;
+    }
 
     if (
-        mmapped_ipc->current_timecode < timecode 
-        || mmapped_ipc->current_timecode - n_records > timecode 
-        || mmapped_ipc->current_timecode == -1
+        head_timecode < timecode 
+        || head_timecode - n_records >= timecode 
+        || head_timecode == -1
         || timecode < 0
     ) {
-        unlock( );
-        return false;
+        return NULL;
+    }
+
+    if (layout == LAYOUT_PACKED) {
+        volatile struct index_entry *entry = 
+            &index[timecode % mmapped_ipc->index_entries];
+
+        if (entry->timecode != timecode) {
+            return NULL;
+        }
+        __sync_synchronize( );
+        *position = entry->position;
+        __sync_synchronize( );
+        if (entry->timecode != timecode) {
+            // the writer rewrote the entry while we were reading it
+            return NULL;
+        }
+
+        rec = (struct record *)
+            (packed_data + *position % mmapped_ipc->data_size);
+    } else {
+        long long offset = 
+            head_offset 
+            - ((long long)(head_timecode - timecode) 
+                * mmapped_ipc->record_size);
+
+        if (offset < 0) {
+            offset += n_records * mmapped_ipc->record_size;
+        }       
+
+        *position = 0;
+        rec = (struct record *)(mmapped_data + offset);
+    }
+
+    // got the wrong data somehow (maybe it is being overwritten right now)
+    if (!intact(rec, timecode, *position)) {
+        return NULL;
+    }
+
+    return rec;
+}
+
+/*
+ * Where a record is, and how much of the mapping it covers, without
+ * reading it (that's what we're trying not to wait for). In a fixed
+ * buffer the length is in the record, so that's the whole slot.
+ */
+bool MmapBuffer::extent(timecode_t timecode, timecode_t head_timecode,
+        offset_t head_offset, volatile char **start, size_t *length) {
+    if (layout == LAYOUT_PACKED) {
+        volatile struct index_entry *entry = 
+            &index[timecode % mmapped_ipc->index_entries];
+        offset_t position;
+        uint32_t record_length;
+
+        if (entry->timecode != timecode) {
+            return false;
+        }
+        __sync_synchronize( );
+        position = entry->position;
+        record_length = entry->length;
+        __sync_synchronize( );
+        if (entry->timecode != timecode) {
+            return false;
+        }
+
+        *start = packed_data + position % mmapped_ipc->data_size;
+        *length = packed_align(sizeof(struct record) + record_length);
+    } else {
+        long long offset = 
+            head_offset 
+            - ((long long)(head_timecode - timecode) 
+                * mmapped_ipc->record_size);
+
+        if (offset < 0) {
+            offset += n_records * mmapped_ipc->record_size;
+        }
+
+        *start = mmapped_data + offset;
+        *length = mmapped_ipc->record_size;
     }
 
+    return true;
+}
 
-    long long offset = 
-        mmapped_ipc->current_offset 
-        - ((long long)(mmapped_ipc->current_timecode - timecode) 
-            * mmapped_ipc->record_size);
+/*
+ * Neighbouring frames are next to each other in the buffer (apart from
+ * at the wrap), so this gathers them into runs and issues one
+ * MADV_WILLNEED per run. The kernel reads those in in the background.
+ */
+void MmapBuffer::prefetch(timecode_t timecode, int count, int direction) {
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start, end, run_start = 0, run_end = 0;
+    timecode_t head_timecode, tc;
+    offset_t head_offset;
+    volatile char *rec;
+    size_t length;
+    int i;
 
-    if (offset < 0) {
-        offset += n_records * mmapped_ipc->record_size;
-    }       
+    if (!read_head(&head_timecode, &head_offset) || head_timecode < 0) {
+        return;
+    }
+
+    for (i = 0; i < count; i++) {
+        tc = (direction < 0) ? timecode - i : timecode + i;
+        if (tc < 0 || tc > head_timecode 
+                || head_timecode - tc >= n_records) {
+            continue;
+        }
 
-    rec = (struct record *)(mmapped_data + offset);
+        if (!extent(tc, head_timecode, head_offset, &rec, &length)) {
+            continue;
+        }
 
-    if (rec->length < *size) {
-        *size = rec->length;
+        start = (uintptr_t) rec & ~(page - 1);
+        end = (uintptr_t) rec + length;
+
+        if (run_end != 0 && start <= run_end && end >= run_start) {
+            run_start = (start < run_start) ? start : run_start;
+            run_end = (end > run_end) ? end : run_end;
+        } else {
+            if (run_end != 0) {
+                madvise((void *) run_start, run_end - run_start, 
+                    MADV_WILLNEED);
+            }
+            run_start = start;
+            run_end = end;
+        }
     }
 
-    // got the wrong data somehow (maybe it was overwritten just now)
-    if (rec->timecode != timecode || !rec->valid) {
-        unlock( );
+    if (run_end != 0) {
+        madvise((void *) run_start, run_end - run_start, MADV_WILLNEED);
+    }
+}
+
+/* 
+ * Is the record still the one we're after? Call again after reading the
+ * data to be sure the writer didn't get to it in the meantime.
+ */
+bool MmapBuffer::intact(const struct record *rec, timecode_t timecode, 
+        offset_t position) {
+    if (mmapped_ipc->layout != layout) {
         return false;
     }
 
-    unlock( );
+    if (layout == LAYOUT_PACKED) {
+        offset_t write_limit = mmapped_ipc->write_limit;
+        if (position >= write_limit 
+                || write_limit - position > mmapped_ipc->data_size) {
+            return false;
+        }
+    }
+
+    return rec->timecode == timecode && rec->valid;
+}
 
+bool MmapBuffer::get(void *data, size_t *size, timecode_t timecode) {
+    struct record *rec;
+    size_t copy_size;
+    offset_t position;
+
+    rec = locate(timecode, &position);
+    if (rec == NULL) {
+        return false;
+    }
 
-    memcpy(data, rec->data, *size);
+    copy_size = rec->length;
+    if (copy_size > *size) {
+        copy_size = *size;
+    }
+
+    memcpy(data, rec->data, copy_size);
+    __sync_synchronize( );
+
+    // the writer got to this record while we were copying it
+    if (!intact(rec, timecode, position)) {
+        return false;
+    }
+
+    *size = copy_size;
     return true;
 }
 
+/*
+ * Zero-copy version of get( ): returns a pointer straight into the mapped
+ * record. The writer may overwrite it at any time, so anything computed
+ * from the data is only trustworthy if still_valid( ) says so afterwards.
+ */
+const void *MmapBuffer::borrow(timecode_t timecode, size_t *size, 
+        borrow_token *token) {
+    struct record *rec;
+    size_t max_length;
+    offset_t position;
+
+    rec = locate(timecode, &position);
+    if (rec == NULL) {
+        return NULL;
+    }
+
+    /* a torn length must not send the caller off the end of the record */
+    if (layout == LAYOUT_PACKED) {
+        max_length = mmapped_ipc->data_size 
+            - position % mmapped_ipc->data_size - sizeof(struct record);
+    } else {
+        max_length = mmapped_ipc->record_size - sizeof(struct record);
+    }
+
+    *size = rec->length;
+    if (*size > max_length) {
+        *size = max_length;
+    }
+
+    token->record = rec;
+    token->timecode = timecode;
+    token->position = position;
+
+    return rec->data;
+}
+
+bool MmapBuffer::still_valid(const borrow_token *token) {
+    __sync_synchronize( );
+    return intact((const struct record *)token->record, 
+        token->timecode, token->position);
+}
+
+void MmapBuffer::set_format(const char *format) {
+    memset((void *)mmapped_ipc->format, 0, FORMAT_TAG_SIZE);
+    strncpy((char *)mmapped_ipc->format, format, FORMAT_TAG_SIZE - 1);
+}
+
+/* returns "" if the writer never said */
+const char *MmapBuffer::get_format(void) {
+    memcpy(format_copy, (const char *)mmapped_ipc->format, FORMAT_TAG_SIZE);
+    format_copy[FORMAT_TAG_SIZE - 1] = 0;
+    return format_copy;
+}
+
+uint16_t MmapBuffer::get_epoch(void) {
+    return mmapped_ipc->epoch;
+}
+
 int MmapBuffer::get_timecode(void) {
     return mmapped_ipc->current_timecode - 1;
 }
+
+bool MmapBuffer::read_stamp(timecode_t timecode, struct seek_entry *out) {
+    volatile struct seek_entry *entry = 
+        &seek_entries[timecode % seek_ipc->slots];
+
+    if (entry->timecode != timecode) {
+        return false;
+    }
+    __sync_synchronize( );
+    out->clock = entry->clock;
+    out->segment = entry->segment;
+    out->wall_usec = entry->wall_usec;
+    __sync_synchronize( );
+    if (entry->timecode != timecode) {
+        return false;
+    }
+
+    out->timecode = timecode;
+    return true;
+}
+
+/*
+ * The timecodes we can seek among: everything in the index whose frame
+ * is still in the buffer. In packed buffers the data can run out before
+ * the index does, so find the oldest frame still there by bisection too.
+ */
+bool MmapBuffer::seek_range(timecode_t *oldest, timecode_t *newest) {
+    timecode_t head, lo, hi, mid;
+    offset_t offset, position;
+
+    if (seek_ipc == NULL && !open_seek_index(false, false)) {
+        return false;
+    }
+
+    if (!read_head(&head, &offset) || head < 0) {
+        return false;
+    }
+
+    lo = head - n_records + 1;
+    if (lo < 0) {
+        lo = 0;
+    }
+    hi = head;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (locate(mid, &position) != NULL) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    *oldest = lo;
+    *newest = head;
+    return true;
+}
+
+timecode_t MmapBuffer::find_wall_time(uint64_t wall_usec) {
+    timecode_t lo, hi, mid;
+    struct seek_entry entry;
+
+    if (!seek_range(&lo, &hi)) {
+        return -1;
+    }
+
+    if (!read_stamp(lo, &entry) || wall_usec < entry.wall_usec) {
+        return -1;
+    }
+    if (!read_stamp(hi, &entry) || wall_usec > entry.wall_usec) {
+        return -1;
+    }
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (!read_stamp(mid, &entry)) {
+            return -1;
+        }
+        if (entry.wall_usec < wall_usec) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+/*
+ * Work back from the newest segment (period) to the most recent one the
+ * clock passed through the value in, then bisect within it. Each step is
+ * O(log n), and there are only as many as there are periods (or upward
+ * clock corrections) in the buffer.
+ */
+timecode_t MmapBuffer::find_clock(uint32_t clock) {
+    timecode_t oldest, lo, hi, mid, end;
+    struct seek_entry first, last, entry;
+
+    if (!seek_range(&oldest, &hi)) {
+        return -1;
+    }
+
+    while (hi >= oldest) {
+        if (!read_stamp(hi, &last)) {
+            return -1;
+        }
+
+        /* find where this segment starts */
+        lo = oldest;
+        end = hi;
+        while (lo < end) {
+            mid = lo + (end - lo) / 2;
+            if (!read_stamp(mid, &entry)) {
+                return -1;
+            }
+            if ((int32_t)(entry.segment - last.segment) < 0) {
+                lo = mid + 1;
+            } else {
+                end = mid;
+            }
+        }
+
+        if (!read_stamp(lo, &first)) {
+            return -1;
+        }
+
+        if (first.clock >= clock && last.clock <= clock) {
+            /* the clock only runs down within a segment */
+            end = hi;
+            while (lo < end) {
+                mid = lo + (end - lo) / 2;
+                if (!read_stamp(mid, &entry)) {
+                    return -1;
+                }
+                if (entry.clock > clock) {
+                    lo = mid + 1;
+                } else {
+                    end = mid;
+                }
+            }
+            return lo;
+        }
+
+        hi = first.timecode - 1;
+    }
+
+    return -1;
+}
+
+bool MmapBuffer::get_stamp(timecode_t timecode, uint64_t *wall_usec, 
+        uint32_t *clock) {
+    struct seek_entry entry;
+
+    if (seek_ipc == NULL && !open_seek_index(false, false)) {
+        return false;
+    }
+
+    if (timecode < 0 || !read_stamp(timecode, &entry)) {
+        return false;
+    }
+
+    if (wall_usec != NULL) {
+        *wall_usec = entry.wall_usec;
+    }
+    if (clock != NULL) {
+        *clock = entry.clock;
+    }
+    return true;
+}
+
+/* follows the head around, keeping the newest frames in memory */
+class ResidencyKeeper : public Thread {
+    public:
+        ResidencyKeeper(MmapBuffer *buf_, uint64_t window_usec_) {
+            buf = buf_;
+            window_usec = window_usec_;
+            stopping = false;
+        }
+
+        virtual ~ResidencyKeeper( ) { }
+
+        void stop(void) {
+            stopping = true;
+            join( );
+        }
+
+    protected:
+        void run(void) {
+            unsigned int ticks = 0;
+
+            while (!stopping) {
+                if (ticks == 0) {
+                    buf->update_hot_tail(window_usec);
+                }
+                ticks = (ticks + 1) % (RESIDENCY_PASS_USEC / RESIDENCY_TICK_USEC);
+                usleep(RESIDENCY_TICK_USEC);
+            }
+
+            buf->release_hot_tail( );
+        }
+
+        MmapBuffer *buf;
+        uint64_t window_usec;
+        volatile bool stopping;
+};
+
+bool MmapBuffer::keep_hot(unsigned int seconds) {
+    if (keeper != NULL) {
+        keeper->stop( );
+        delete keeper;
+        keeper = NULL;
+    }
+
+    if (seconds == 0) {
+        return true;
+    }
+
+    /* (open it here, so the keeper never races the writer to do it) */
+    if (seek_ipc == NULL && !open_seek_index(true, false)) {
+        fprintf(stderr, "no seek index, so no telling how old frames are\n");
+        return false;
+    }
+
+    hot_start = hot_length = 0;
+    lock_start = lock_length = 0;
+    lock_limit = UINT64_MAX;
+    memset((void *)&residency, 0, sizeof(residency));
+
+    keeper = new ResidencyKeeper(this, (uint64_t) seconds * 1000000);
+    keeper->start( );
+    return true;
+}
+
+bool MmapBuffer::get_residency(struct residency_stats *stats) {
+    if (keeper == NULL) {
+        return false;
+    }
+
+    stats->hot_bytes = residency.hot_bytes;
+    stats->resident_bytes = residency.resident_bytes;
+    stats->locked_bytes = residency.locked_bytes;
+    return true;
+}
+
+/* where the records live, and how much room they have */
+void MmapBuffer::data_area(volatile char **base, uint64_t *size) {
+    if (layout == LAYOUT_PACKED) {
+        *base = packed_data;
+        *size = mmapped_ipc->data_size;
+    } else {
+        *base = mmapped_data;
+        *size = (uint64_t) n_records * mmapped_ipc->record_size;
+    }
+}
+
+/*
+ * The stretch of the data area from the first frame captured within
+ * window_usec of the newest one to the end of the newest. (Measured
+ * back from the newest frame rather than now, so a pause in capture
+ * doesn't let the replay window go cold.)
+ */
+bool MmapBuffer::find_hot_tail(uint64_t window_usec, uint64_t *start, 
+        uint64_t *length) {
+    timecode_t oldest, newest, first;
+    struct seek_entry entry;
+    struct record *first_rec, *newest_rec;
+    offset_t position;
+    volatile char *base;
+    uint64_t size, end;
+
+    if (!seek_range(&oldest, &newest) || !read_stamp(newest, &entry)) {
+        return false;
+    }
+
+    first = oldest;
+    if (entry.wall_usec > window_usec) {
+        /* -1 if the window reaches back past the oldest frame */
+        first = find_wall_time(entry.wall_usec - window_usec);
+        if (first < oldest) {
+            first = oldest;
+        }
+    }
+
+    first_rec = locate(first, &position);
+    newest_rec = locate(newest, &position);
+    if (first_rec == NULL || newest_rec == NULL) {
+        return false;
+    }
+
+    data_area(&base, &size);
+    *start = (char *) first_rec - (char *) base;
+    end = (char *) newest_rec - (char *) base;
+    if (layout == LAYOUT_PACKED) {
+        end += packed_align(sizeof(struct record) + newest_rec->length);
+    } else {
+        end += mmapped_ipc->record_size;
+    }
+
+    /* (0 here means it wrapped all the way around) */
+    *length = (end + size - *start) % size;
+    if (*length == 0) {
+        *length = size;
+    }
+
+    return true;
+}
+
+/*
+ * One pass of the keeper. The tail normally just creeps forward, so only
+ * what fell off the old end gets cooled and only what was added at the
+ * new end gets heated; anything else (a reset, say) redoes the lot.
+ */
+void MmapBuffer::update_hot_tail(uint64_t window_usec) {
+    uint64_t start, length, size, advanced, overlap;
+    volatile char *base;
+
+    if (!find_hot_tail(window_usec, &start, &length)) {
+        return;
+    }
+
+    data_area(&base, &size);
+    advanced = (start + size - hot_start) % size;
+    overlap = (hot_start + hot_length + size - start) % size;
+
+    if (hot_length > 0 && advanced <= hot_length && overlap <= length) {
+        cool(hot_start, advanced);
+        heat((hot_start + hot_length) % size, length - overlap);
+    } else {
+        cool(hot_start, hot_length);
+        heat(start, length);
+    }
+
+    hot_start = start;
+    hot_length = length;
+    update_locked_tail(start, length);
+
+    residency.hot_bytes = length;
+    residency.resident_bytes = count_resident(start, length);
+    residency.locked_bytes = lock_length;
+}
+
+/*
+ * Lock as much of the newest end of the hot tail as RLIMIT_MEMLOCK
+ * allows, moving the locked stretch along the same way update_hot_tail( )
+ * moves the tail. If mlock( ) fails anyway (other locked memory counts
+ * against the limit too), unlock it all and try half as much next pass.
+ */
+void MmapBuffer::update_locked_tail(uint64_t start, uint64_t length) {
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    uint64_t size, want, first, pad, advanced, overlap;
+    volatile char *base;
+    struct rlimit limit;
+    bool ok;
+
+    data_area(&base, &size);
+
+    want = lock_limit;
+    if (getrlimit(RLIMIT_MEMLOCK, &limit) == 0 
+            && limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < want) {
+        want = limit.rlim_cur;
+    }
+    /* (ending part way into a page, and wrapping, can each cost a page) */
+    want = (want > 2 * page) ? want - 2 * page : 0;
+    if (want > length) {
+        want = length;
+    }
+
+    /* start on a page boundary, so nothing older gets locked with it */
+    first = (start + length - want) % size;
+    pad = (page - first % page) % page;
+    if (pad > size - first) {
+        pad = size - first;
+    }
+    if (pad >= want) {
+        want = 0;
+    } else {
+        first = (first + pad) % size;
+        want -= pad;
+    }
+
+    advanced = (first + size - lock_start) % size;
+    overlap = (lock_start + lock_length + size - first) % size;
+
+    if (lock_length > 0 && want > 0 
+            && advanced <= lock_length && overlap <= want) {
+        unlock_pages(lock_start, advanced);
+        ok = lock_pages((lock_start + lock_length) % size, want - overlap);
+    } else {
+        if (lock_length > 0) {
+            munlock((void *) base, size);
+        }
+        ok = lock_pages(first, want);
+    }
+
+    if (ok) {
+        lock_start = first;
+        lock_length = want;
+    } else {
+        perror("warning: can't lock the buffer's hot tail in memory "
+            "(check RLIMIT_MEMLOCK)");
+        munlock((void *) base, size);
+        lock_start = lock_length = 0;
+        lock_limit = (want / 2 >= page) ? want / 2 : 0;
+    }
+}
+
+void MmapBuffer::release_hot_tail(void) {
+    volatile char *base;
+    uint64_t size;
+
+    data_area(&base, &size);
+    munlock((void *) base, size);
+    hot_start = hot_length = 0;
+    lock_start = lock_length = 0;
+    memset((void *)&residency, 0, sizeof(residency));
+}
+
+/* ask for huge pages for a stretch of the data area, and to keep it */
+void MmapBuffer::heat(uint64_t start, uint64_t length) {
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    volatile char *base;
+    uint64_t size, n;
+    uintptr_t addr, end;
+
+    data_area(&base, &size);
+
+    while (length > 0) {
+        n = (start + length > size) ? size - start : length;
+
+        /* the whole of every page it touches */
+        addr = (uintptr_t) (base + start) & ~(page - 1);
+        end = (uintptr_t) (base + start + n);
+
+        /* undo MADV_SEQUENTIAL, which would drop these first */
+        madvise((void *) addr, end - addr, MADV_NORMAL);
+        /* only does anything on file systems with huge pages (tmpfs) */
+        madvise((void *) addr, end - addr, MADV_HUGEPAGE);
+
+        start = (start + n) % size;
+        length -= n;
+    }
+}
+
+/* tell the kernel a stretch is the first to evict */
+void MmapBuffer::cool(uint64_t start, uint64_t length) {
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    volatile char *base;
+    uint64_t size, n;
+    uintptr_t addr, end;
+
+    data_area(&base, &size);
+
+    while (length > 0) {
+        n = (start + length > size) ? size - start : length;
+
+        /* 
+         * Stop short of a page the tail still has a piece of. (Whatever
+         * shares a page with start, ahead of it, was cold already.)
+         */
+        addr = (uintptr_t) (base + start) & ~(page - 1);
+        end = (uintptr_t) (base + start + n) & ~(page - 1);
+
+        if (end > addr) {
+            madvise((void *) addr, end - addr, MADV_COLD);
+        }
+
+        start = (start + n) % size;
+        length -= n;
+    }
+}
+
+/* mlock( ) every page a stretch of the data area touches */
+bool MmapBuffer::lock_pages(uint64_t start, uint64_t length) {
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    volatile char *base;
+    uint64_t size, n;
+    uintptr_t addr, end;
+
+    data_area(&base, &size);
+
+    while (length > 0) {
+        n = (start + length > size) ? size - start : length;
+
+        addr = (uintptr_t) (base + start) & ~(page - 1);
+        end = (uintptr_t) (base + start + n);
+
+        if (mlock((void *) addr, end - addr) < 0) {
+            return false;
+        }
+
+        start = (start + n) % size;
+        length -= n;
+    }
+
+    return true;
+}
+
+/* 
+ * munlock( ) a stretch that starts on a page boundary, leaving alone the
+ * page it ends part way into (the rest of which is still locked).
+ */
+void MmapBuffer::unlock_pages(uint64_t start, uint64_t length) {
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    volatile char *base;
+    uint64_t size, n;
+    uintptr_t addr, end;
+
+    data_area(&base, &size);
+
+    while (length > 0) {
+        n = (start + length > size) ? size - start : length;
+
+        addr = (uintptr_t) (base + start);
+        end = (uintptr_t) (base + start + n);
+        if (start + n < size) {
+            end &= ~(page - 1);
+        }
+
+        if (end > addr) {
+            munlock((void *) addr, end - addr);
+        }
+
+        start = (start + n) % size;
+        length -= n;
+    }
+}
+
+uint64_t MmapBuffer::count_resident(uint64_t start, uint64_t length) {
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    unsigned char vec[4096];
+    volatile char *base;
+    uint64_t size, n, resident = 0, total = length;
+    uintptr_t addr, end, chunk, i;
+
+    data_area(&base, &size);
+
+    while (length > 0) {
+        n = (start + length > size) ? size - start : length;
+
+        addr = (uintptr_t) (base + start) & ~(page - 1);
+        end = (uintptr_t) (base + start + n);
+
+        while (addr < end) {
+            chunk = end - addr;
+            if (chunk > sizeof(vec) * page) {
+                chunk = sizeof(vec) * page;
+            }
+            if (mincore((void *) addr, chunk, vec) == 0) {
+                for (i = 0; i < (chunk + page - 1) / page; i++) {
+                    resident += (vec[i] & 1) * page;
+                }
+            }
+            addr += chunk;
+        }
+
+        start = (start + n) % size;
+        length -= n;
+    }
+
+    /* (page rounding can make it a bit more than the tail) */
+    return (resident > total) ? total : resident;
+}
@@ -3,19 +3,135 @@
 
 #include <semaphore.h>
 #include <stdint.h>
+#include <stddef.h>
 
 #define RINGBUF_ALIGN_BOUNDARY 4096 /* pages on x86 */
 
+/* 
+ * Packed buffers pack records back to back on this boundary, and keep one
+ * index slot per this many bytes of data (i.e. frames averaging smaller
+ * than this run the index out before they run the data out).
+ */
+#define PACKED_RECORD_ALIGN 64
+#define PACKED_BYTES_PER_INDEX_SLOT 16384
+
+#define FORMAT_TAG_SIZE 16
+
+/* put( ) without a scoreboard clock */
+#define SEEK_NO_CLOCK 0xffffffff
+
 typedef int timecode_t;
 
+class ResidencyKeeper;
+
 class MmapBuffer {
     public:
+    /* 
+     * Handed back by borrow( ). Check it with still_valid( ) when you're
+     * done with the borrowed data to make sure it wasn't overwritten.
+     */
+    struct borrow_token {
+        const void *record;
+        timecode_t timecode;
+        uint64_t position;
+    };
+
     MmapBuffer(const char *file, unsigned int record_size, bool writer = false);
     ~MmapBuffer( ); 
-    timecode_t put(const void *data, size_t size);
+    /* wall_usec is when the frame was captured; 0 means now */
+    timecode_t put(const void *data, size_t size, 
+        uint32_t clock = SEEK_NO_CLOCK, uint64_t wall_usec = 0);
+
+    /*
+     * put( ) without the copy: reserve( ) hands back room for a record of
+     * up to size bytes right in the buffer, to fill in place, and
+     * commit( ) makes the first size bytes of it the next frame. *room, if
+     * given, says how much there really is (a whole slot, in fixed layout
+     * buffers). Reserving again (or put( )) before committing gives up the
+     * old reservation. Both throw std::runtime_error if sizes don't fit.
+     */
+    void *reserve(size_t size, size_t *room = NULL);
+    timecode_t commit(size_t size, 
+        uint32_t clock = SEEK_NO_CLOCK, uint64_t wall_usec = 0);
+
+    /* the largest record put( ) or reserve( ) will take */
+    size_t max_size(void);
+
     bool get(void *data, size_t *size, timecode_t timecode);
+    const void *borrow(timecode_t timecode, size_t *size, borrow_token *token);
+    bool still_valid(const borrow_token *token);
     timecode_t get_timecode(void);
 
+    /*
+     * Start reading count frames from timecode on (direction 1) or back
+     * (-1) in from disk, without waiting for them, so playing them out
+     * doesn't stall on page faults. Frames not in the buffer are skipped.
+     */
+    void prefetch(timecode_t timecode, int count, int direction = 1);
+
+    /*
+     * For a writer picking up where a crashed one (or a crashed machine)
+     * left off: don't trust the header, rebuild the head from the newest
+     * intact record, scanning the buffer with this many threads (0 for
+     * one per CPU). Returns false, leaving the buffer empty, if there was
+     * nothing to recover.
+     */
+    bool recover(int threads = 0);
+
+    /* 
+     * Free-form tag describing what the writer is storing (e.g. the name
+     * of the video mode), so readers can tell what they're dealing with.
+     */
+    void set_format(const char *format);
+    const char *get_format(void);
+
+    /* 
+     * Goes up every time the buffer is reset and its timecodes start
+     * again from 0, so readers can tell a timecode's new frame from the
+     * one it held before.
+     */
+    uint16_t get_epoch(void);
+
+    /*
+     * Seeking by time. Every put( ) also stamps the record's wall-clock
+     * time (microseconds since the epoch) and the scoreboard clock into a
+     * sidecar index next to the buffer file (<file>.index), so these are
+     * binary searches instead of scans through the frames. They return -1
+     * if the time isn't in the buffer, or if the buffer has no index.
+     */
+
+    /* the first frame captured at or after wall_usec */
+    timecode_t find_wall_time(uint64_t wall_usec);
+
+    /* 
+     * The most recent frame where the scoreboard clock (counting down,
+     * in tenths of a second) first got to clock.
+     */
+    timecode_t find_clock(uint32_t clock);
+
+    /* what put( ) stamped the frame with (either pointer may be NULL) */
+    bool get_stamp(timecode_t timecode, uint64_t *wall_usec, uint32_t *clock);
+
+    /*
+     * Keep the newest seconds worth of frames (by capture time) in
+     * memory, since that's what the operator is about to replay: a thread
+     * follows the head around, mlock( )ing that tail (as far as
+     * RLIMIT_MEMLOCK allows), asking for huge pages for it where the file
+     * system can do them, and telling the kernel that older frames are
+     * the ones to evict. 0 stops it. Needs the seek index, so it's for
+     * the writer; returns false if it can't be done.
+     */
+    bool keep_hot(unsigned int seconds);
+
+    struct residency_stats {
+        uint64_t hot_bytes;         // what the hot tail takes up
+        uint64_t resident_bytes;    // how much of it is in memory
+        uint64_t locked_bytes;      // and locked there
+    };
+
+    /* as of the keeper's last pass; false if it isn't running */
+    bool get_residency(struct residency_stats *stats);
+
     void on_fork(void);
     
     private:
@@ -28,8 +144,24 @@ class MmapBuffer {
         size_t length;
         timecode_t timecode;
         bool valid; // should read as zero if the sparse file hasn't been filled yet
+        uint16_t epoch; // fits in what was padding, so data doesn't move
         unsigned char data[0]; // seemingly legal only in gcc
     };
+
+    /* 
+     * Buffers come in two layouts. LAYOUT_FIXED is the original one: every
+     * record takes up record_size bytes, so a record's offset follows
+     * from its timecode. LAYOUT_PACKED puts variable-length records back
+     * to back and finds them through a fixed-stride timecode -> position
+     * index at the start of the mapping.
+     */
+    enum { LAYOUT_FIXED = 0, LAYOUT_PACKED = 1 };
+
+    struct index_entry {
+        offset_t position; // logical: never wraps, physical = position % data_size
+        uint32_t length;
+        timecode_t timecode; // -1 while the writer is rewriting the entry
+    };
     
     // mmap this thing into the buffer file so that we have shared data among all processes
     volatile struct control_data {
@@ -39,15 +171,117 @@ class MmapBuffer {
             offset_t max_offset;
             recsize_t record_size;
 
-            pid_t lock_pid;
+            pid_t lock_pid; // no longer used, kept so old buffers stay readable
+            uint32_t seq;   // odd while the writer is updating the head
+
+            /* everything below here reads as zero in old (fixed layout) buffers */
+            uint32_t layout;
+            offset_t index_entries;
+            offset_t data_start;    // data area offset within mmapped_data
+            offset_t data_size;
+            offset_t write_pos;     // logical end of the newest record
+            offset_t write_limit;   // logical end of the record being written
+
+            char format[FORMAT_TAG_SIZE];
+
+            /* 
+             * bumped on every reset, so recovery can tell our records
+             * from ones left behind by the previous use of the file 
+             */
+            uint16_t epoch;
     } *mmapped_ipc;
 
-    void lock( );
-    void unlock( );
-    void check_lock( );
+    char format_copy[FORMAT_TAG_SIZE];
+
+    void init_packed(void);
+    void *reserve_fixed(void);
+    void *reserve_packed(size_t size);
+    timecode_t commit_fixed(size_t size);
+    timecode_t commit_packed(size_t size);
+
+    /* where reserve( ) put the next record, NULL if nothing is reserved */
+    struct record *reserved;
+    offset_t reserved_position;
+    size_t reserved_size;
+
+    friend class RecoveryScan;
+    struct scan_result {
+        timecode_t timecode;
+        offset_t position;
+    };
+    void scan(uint64_t first, uint64_t last, struct scan_result *result);
+    bool recovered(timecode_t timecode, offset_t position);
+
+    bool read_head(timecode_t *timecode, offset_t *offset);
+    struct record *locate(timecode_t timecode, offset_t *position);
+    bool extent(timecode_t timecode, timecode_t head_timecode, 
+        offset_t head_offset, volatile char **start, size_t *length);
+    bool intact(const struct record *rec, timecode_t timecode, 
+        offset_t position);
+
+    volatile struct index_entry *index;
+    volatile char *packed_data;
+
+    /* 
+     * The sidecar seek index: one entry per timecode, slot timecode %
+     * slots, guarded by its timecode the same way as index_entry.
+     * segment goes up whenever the scoreboard clock does (i.e. a new
+     * period starts), so within a segment the clock never rises and
+     * (segment, -clock) is sorted by timecode.
+     */
+    struct seek_entry {
+        timecode_t timecode; // -1 while the writer is rewriting the entry
+        uint32_t clock;
+        uint32_t segment;
+        uint32_t reserved;
+        uint64_t wall_usec;
+    };
+
+    volatile struct seek_header {
+        uint32_t magic;
+        uint32_t segment;       // writer's state, so a restart carries on
+        uint32_t last_clock;
+        uint32_t reserved;
+        uint64_t slots;
+    } *seek_ipc;
+
+    volatile struct seek_entry *seek_entries;
+    char *seek_file;
+    size_t seek_map_size;
+
+    bool open_seek_index(bool create, bool reset);
+    void close_seek_index(void);
+    void stamp(timecode_t timecode, uint32_t clock, uint64_t wall_usec);
+    bool read_stamp(timecode_t timecode, struct seek_entry *out);
+    bool seek_range(timecode_t *oldest, timecode_t *newest);
+
+    /*
+     * The hot tail, as a stretch of the data area (start, length) that
+     * may wrap around its end, and the newest part of it that's locked.
+     * The keeper thread owns these; it only publishes residency.
+     */
+    friend class ResidencyKeeper;
+    ResidencyKeeper *keeper;
+    uint64_t hot_start, hot_length;
+    uint64_t lock_start, lock_length;
+    uint64_t lock_limit;    /* lowered if mlock( ) fails under the rlimit */
+    volatile struct residency_stats residency;
+
+    void data_area(volatile char **base, uint64_t *size);
+    bool find_hot_tail(uint64_t window_usec, uint64_t *start, 
+        uint64_t *length);
+    void update_hot_tail(uint64_t window_usec);
+    void update_locked_tail(uint64_t start, uint64_t length);
+    void release_hot_tail(void);
+    void heat(uint64_t start, uint64_t length);
+    void cool(uint64_t start, uint64_t length);
+    bool lock_pages(uint64_t start, uint64_t length);
+    void unlock_pages(uint64_t start, uint64_t length);
+    uint64_t count_resident(uint64_t start, uint64_t length);
 
     int data_fd;
     int n_records;
+    uint32_t layout;    // as it was when we opened the buffer
 
     pid_t my_pid; // fork( ) unsafe
 };
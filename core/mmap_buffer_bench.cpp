@@ -0,0 +1,199 @@
+/*
+ * mmap_buffer_bench.cpp
+ *
+ * This file is part of openreplay. See the README file for the license
+ * terms governing its use.
+ *
+ * Contention benchmark for MmapBuffer: one writer process putting frames
+ * as fast as it can, and several reader processes hammering get( ) on the
+ * most recent frames (like sdl_gui and playoutd do). Reports throughput
+ * and the worst get( ) latency seen by each reader.
+ */
+
+#include "mmap_buffer.h"
+#include "mjpeg_config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define MAX_READERS 64
+
+struct bench_result {
+    uint64_t ops;
+    uint64_t misses;
+    uint64_t max_latency_ns;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void usage(const char *name) {
+    fprintf(stderr, "usage: %s [options] buffer_file\n", name);
+    fprintf(stderr, "-r, --readers <n>: number of reader processes (default 8)\n");
+    fprintf(stderr, "-s, --seconds <n>: how long to run (default 10)\n");
+    fprintf(stderr, "-f, --frame-size <bytes>: size of each put (default 49152)\n");
+    fprintf(stderr, "-m, --megabytes <n>: create buffer_file with this size first\n");
+}
+
+void run_writer(const char *file, size_t frame_size, uint64_t deadline,
+        struct bench_result *result) {
+    MmapBuffer buf(file, MAX_FRAME_SIZE, false);
+    uint8_t *data = (uint8_t *)malloc(frame_size);
+    uint64_t start, elapsed;
+
+    memset(data, 0x5a, frame_size);
+
+    while (now_ns( ) < deadline) {
+        start = now_ns( );
+        buf.put(data, frame_size);
+        elapsed = now_ns( ) - start;
+
+        if (elapsed > result->max_latency_ns) {
+            result->max_latency_ns = elapsed;
+        }
+        result->ops++;
+    }
+
+    free(data);
+}
+
+void run_reader(const char *file, uint64_t deadline,
+        struct bench_result *result) {
+    MmapBuffer buf(file, MAX_FRAME_SIZE);
+    uint8_t *data = (uint8_t *)malloc(MAX_FRAME_SIZE);
+    uint64_t start, elapsed;
+    size_t size;
+    timecode_t tc;
+
+    while (now_ns( ) < deadline) {
+        /* stay a couple of frames behind live, like the multiviewer */
+        tc = buf.get_timecode( ) - 1;
+        size = MAX_FRAME_SIZE;
+
+        start = now_ns( );
+        if (!buf.get(data, &size, tc)) {
+            result->misses++;
+        }
+        elapsed = now_ns( ) - start;
+
+        if (elapsed > result->max_latency_ns) {
+            result->max_latency_ns = elapsed;
+        }
+        result->ops++;
+    }
+
+    free(data);
+}
+
+int main(int argc, char *argv[]) {
+    int n_readers = 8;
+    int seconds = 10;
+    size_t frame_size = 49152;
+    long megabytes = 0;
+    int opt, i, fd;
+    uint64_t deadline;
+    struct bench_result *results;
+    pid_t pid;
+
+    const struct option options[] = {
+        { "readers", 1, NULL, 'r' },
+        { "seconds", 1, NULL, 's' },
+        { "frame-size", 1, NULL, 'f' },
+        { "megabytes", 1, NULL, 'm' },
+        { 0, 0, 0, 0 }
+    };
+
+    while ((opt = getopt_long(argc, argv, "r:s:f:m:", options, NULL)) != EOF) {
+        switch (opt) {
+            case 'r':
+                n_readers = atoi(optarg);
+                break;
+            case 's':
+                seconds = atoi(optarg);
+                break;
+            case 'f':
+                frame_size = atoi(optarg);
+                break;
+            case 'm':
+                megabytes = atol(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind != argc - 1 || n_readers < 0 || n_readers > MAX_READERS
+            || frame_size > MAX_FRAME_SIZE - 64) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (megabytes > 0) {
+        fd = open(argv[optind], O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || ftruncate(fd, megabytes * 1048576) < 0) {
+            perror("create buffer file");
+            return 1;
+        }
+        close(fd);
+    }
+
+    /* initialize the buffer header before anyone forks off */
+    delete new MmapBuffer(argv[optind], MAX_FRAME_SIZE, true);
+
+    results = (struct bench_result *) mmap(NULL,
+        (n_readers + 1) * sizeof(struct bench_result),
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (results == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    memset(results, 0, (n_readers + 1) * sizeof(struct bench_result));
+
+    deadline = now_ns( ) + (uint64_t)seconds * 1000000000ULL;
+
+    for (i = 0; i <= n_readers; i++) {
+        pid = fork( );
+        if (pid == -1) {
+            perror("fork");
+            return 1;
+        } else if (pid == 0) {
+            if (i == 0) {
+                run_writer(argv[optind], frame_size, deadline, &results[i]);
+            } else {
+                run_reader(argv[optind], deadline, &results[i]);
+            }
+            _exit(0);
+        }
+    }
+
+    for (i = 0; i <= n_readers; i++) {
+        wait(NULL);
+    }
+
+    fprintf(stderr, "writer: %.0f puts/s, worst put %.1f us\n",
+        (float)results[0].ops / seconds,
+        results[0].max_latency_ns / 1000.0f);
+
+    for (i = 1; i <= n_readers; i++) {
+        fprintf(stderr, "reader %d: %.0f gets/s, %.2f%% missed, "
+            "worst get %.1f us\n", i,
+            (float)results[i].ops / seconds,
+            results[i].ops ? 100.0f * results[i].misses / results[i].ops : 0.0f,
+            results[i].max_latency_ns / 1000.0f);
+    }
+
+    return 0;
+}
@@ -1,10 +1,8 @@
 #ifndef _OUTPUT_ADAPTER_H
 #define _OUTPUT_ADAPTER_H
 
-#define OUT_FRAME_W 720
-#define OUT_FRAME_H 480
-
 #include "picture.h"
+#include "video_mode.h"
 
 #include <stdlib.h>
 #include <stdexcept>
@@ -61,16 +59,21 @@ public:
     // Magic framerate divisors for NTSC: timebase = 30000 ticks per second, frame duration = 1001 ticks
     // Magic framerate divisors for PAL 25FPS: timebase = 25 ticks per second, frame duration =  1 tick
     // (I wish I was in Europe. This API would seem so much more elegant over there.)
-    DecklinkOutput(EventHandler *new_evtq, int cardIndex = 0) 
+    // The video_mode table carries both for whatever we're running.
+    DecklinkOutput(EventHandler *new_evtq, int cardIndex = 0,
+            const struct video_mode *mode_ = NULL) 
         : deckLink(0), deckLinkOutput(0), deckLinkIterator(0),
-          displayMode(0), frame_duration(1001), 
-          time_base(30000), frame_counter(0),
+          displayMode(0), frame_counter(0),
           evtq(new_evtq), current_frame(0),
           current_frame_is_stale(true)
     {
         HRESULT result;
         const char *string;
 
+        mode = mode_ ? mode_ : default_video_mode( );
+        frame_duration = mode->frame_duration;
+        time_base = mode->time_base;
+
         deckLinkIterator = CreateDeckLinkIteratorInstance( ); 
 	/* Connect to DeckLink card */
 	if (!deckLinkIterator) {
@@ -101,7 +104,8 @@ public:
 
 
         // enable video output
-	if (deckLinkOutput->EnableVideoOutput(bmdModeNTSC, bmdVideoOutputFlagDefault) != S_OK) {
+	if (deckLinkOutput->EnableVideoOutput((BMDDisplayMode) mode->decklink_mode, 
+                bmdVideoOutputFlagDefault) != S_OK) {
             throw std::runtime_error("Failed to enable video output!\n");
         }
 
@@ -111,7 +115,8 @@ public:
             IDeckLinkMutableVideoFrame *frame;
             if (
                 deckLinkOutput->CreateVideoFrame(
-                    720, 480, 1440, bmdFormat8BitYUV, bmdFrameFlagDefault, &frame
+                    mode->w, mode->h, 2*mode->w, bmdFormat8BitYUV, 
+                    bmdFrameFlagDefault, &frame
                 ) != S_OK
             ) {
                     throw std::runtime_error("Failed to create frame");
@@ -127,7 +132,7 @@ public:
 
         // ask client for its first frame
         if (evtq) {
-            evtq->post_event(EVT_OUTPUT_NEED_FRAME, NULL);
+            evtq->post_event(EVT_OUTPUT_NEED_FRAME, NULL, EVT_PRIORITY_OUTPUT);
         }
     }
 
@@ -223,6 +228,7 @@ protected:
     IDeckLinkOutput *deckLinkOutput;
     IDeckLinkIterator *deckLinkIterator;
     IDeckLinkDisplayMode *displayMode;
+    const struct video_mode *mode;
     BMDTimeScale time_base;
     BMDTimeValue frame_duration;
 
@@ -251,7 +257,7 @@ protected:
                 if (!was_stale) {
                     // we have just made the frame stale so let's ask for a new one
                     if (evtq) {
-                        evtq->post_event(EVT_OUTPUT_NEED_FRAME, NULL);
+                        evtq->post_event(EVT_OUTPUT_NEED_FRAME, NULL, EVT_PRIORITY_OUTPUT);
                     }
                 }
             }
@@ -267,8 +273,9 @@ protected:
 
         if (in_frame != NULL) {
             int in_scanline_size = in_frame->line_pitch;
-            int out_scanline_size = 1440; /* size of a 720 pixel UYVY scanline */
+            int out_scanline_size = 2*mode->w; /* UYVY */
             int copy_size;
+            int copy_lines = (in_frame->h < mode->h) ? in_frame->h : mode->h;
 
             if (in_scanline_size < out_scanline_size) {
                 copy_size = in_scanline_size;
@@ -276,7 +283,7 @@ protected:
                 copy_size = out_scanline_size;
             }
 
-            for (int j = 0; j < 480; j++) {
+            for (int j = 0; j < copy_lines; j++) {
                 memcpy(frame_data, in_frame->scanline(j), copy_size);
                 frame_data += out_scanline_size;
             }
@@ -284,7 +291,7 @@ protected:
             Picture::free(in_frame);
         } else {
             // black 
-            for (int i = 0; i < 720*480; i++, frame_data += 2) {
+            for (int i = 0; i < mode->w*mode->h; i++, frame_data += 2) {
                 frame_data[0] = 128; // u, v
                 frame_data[1] = 16; // y
             }
@@ -302,8 +309,11 @@ protected:
 
 class StdoutOutput : public OutputAdapter, public Thread {
 public:
-    StdoutOutput(EventHandler *evtq_) : evtq(evtq_) {
-        data = (uint8_t *)malloc(2*720*480);
+    StdoutOutput(EventHandler *evtq_, const struct video_mode *mode_ = NULL) 
+            : evtq(evtq_) {
+        mode = mode_ ? mode_ : default_video_mode( );
+        frame_size = 2*mode->w*mode->h;
+        data = (uint8_t *)malloc(frame_size);
         if (!data) {
             throw std::runtime_error("allocation failure");
         }
@@ -329,12 +339,12 @@ public:
             convert = in_frame->convert_to_format(UYVY8);
         }
 
-        int blit_max_w = (in_frame->w < 720) ? in_frame->w : 720;
-        int blit_max_h = (in_frame->h < 480) ? in_frame->h : 480;
+        int blit_max_w = (in_frame->w < mode->w) ? in_frame->w : mode->w;
+        int blit_max_h = (in_frame->h < mode->h) ? in_frame->h : mode->h;
 
         { MutexLock lock(mut);
             for (i = 0; i < blit_max_h; ++i) {
-                memcpy(data + 1440*i, convert->scanline(i), 2*blit_max_w);
+                memcpy(data + 2*mode->w*i, convert->scanline(i), 2*blit_max_w);
             }
             data_ready = true;
             data_ready_cond.signal( );
@@ -359,20 +369,23 @@ protected:
     void run(void) {
         for (;;) {
             if (evtq) {
-                evtq->post_event(EVT_OUTPUT_NEED_FRAME, NULL);
+                evtq->post_event(EVT_OUTPUT_NEED_FRAME, NULL, EVT_PRIORITY_OUTPUT);
             }
             { MutexLock lock(mut);
                 if (!data_ready) {
                     data_ready_cond.wait(mut);
                 }
         
-                write(STDOUT_FILENO, data, 2*720*480);    
+                write(STDOUT_FILENO, data, frame_size);    
                 data_ready = false;
             }
-            usleep(33667); /* crude NTSC approximation */
+            /* crude approximation of the frame rate */
+            usleep(1000000LL * mode->frame_duration / mode->time_base);
         }
     }
 
+    const struct video_mode *mode;
+    size_t frame_size;
     uint8_t *data;
     Condition data_ready_cond;
     Mutex mut;
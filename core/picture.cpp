@@ -1,4 +1,6 @@
 #include "picture.h"
+#include "picture_convert.h"
+#include "mutex.h"
 
 #include <stdlib.h>
 #include <stdexcept>
@@ -6,6 +8,7 @@
 #include <assert.h>
 #include <malloc.h> // memalign
 #include <stdarg.h>
+#include <unistd.h> // getpagesize
 
 #define align_malloc malloc
 #define align_realloc realloc
@@ -31,6 +34,12 @@ void Picture::addref( ) {
     __sync_add_and_fetch(&rcount, 1);
 }
 
+// round up to nearest alignment boundary
+static size_t page_round(size_t size) {
+    size_t pagesize = (size_t) getpagesize( );
+    return (size + pagesize - 1) & ~(pagesize - 1);
+}
+
 void Picture::alloc_data(size_t size) {
     size_t pagesize;
 
@@ -42,24 +51,114 @@ void Picture::alloc_data(size_t size) {
     }
     dfprintf(stderr, "ALLOC DATA %p\n", this);
     
-    // round up to nearest alignment boundary
-    size = (size + pagesize - 1) & ~(pagesize - 1);    
+    size = page_round(size);
 
     data = (uint8_t *)memalign(pagesize, size);
     alloc_size = size;
 }
 
+/* 
+ * Recycles Pictures (object and buffer together) by buffer size.
+ * Everything that touches the bins holds mut; rcount is only looked at
+ * once it has dropped to zero, when nobody else can see the Picture.
+ */
+class PicturePool {
+    public:
+        PicturePool( );
+        Picture *get(size_t size);
+        bool put(Picture *pic);
+        void get_stats(struct picture_pool_stats *out);
+
+    protected:
+        struct size_class {
+            size_t size;
+            int n;
+            Picture *pics[PICTURE_POOL_DEPTH];
+        } classes[PICTURE_POOL_CLASSES];
+
+        struct picture_pool_stats stats;
+        Mutex mut;
+};
+
+PicturePool::PicturePool( ) {
+    memset(classes, 0, sizeof(classes));
+    memset(&stats, 0, sizeof(stats));
+}
+
+Picture *PicturePool::get(size_t size) {
+    MutexLock lock(mut);
+    int i;
+
+    for (i = 0; i < PICTURE_POOL_CLASSES; i++) {
+        if (classes[i].size == size && classes[i].n > 0) {
+            stats.hits++;
+            stats.pooled--;
+            return classes[i].pics[--classes[i].n];
+        }
+    }
+
+    stats.misses++;
+    return NULL;
+}
+
+bool PicturePool::put(Picture *pic) {
+    MutexLock lock(mut);
+    struct size_class *cls = NULL;
+    int i;
+
+    for (i = 0; i < PICTURE_POOL_CLASSES; i++) {
+        if (classes[i].size == pic->alloc_size) {
+            cls = &classes[i];
+            break;
+        } else if (cls == NULL && classes[i].n == 0) {
+            /* an empty class can be taken over by a new size */
+            cls = &classes[i];
+        }
+    }
+
+    if (cls == NULL || cls->n == PICTURE_POOL_DEPTH) {
+        stats.discards++;
+        return false;
+    }
+
+    cls->size = pic->alloc_size;
+    cls->pics[cls->n++] = pic;
+    stats.pooled++;
+    return true;
+}
+
+void PicturePool::get_stats(struct picture_pool_stats *out) {
+    MutexLock lock(mut);
+    *out = stats;
+}
+
+/* 
+ * Never destroyed, so Pictures freed by other threads during exit still 
+ * have somewhere to go.
+ */
+static PicturePool *pool( ) {
+    static PicturePool *the_pool = new PicturePool;
+    return the_pool;
+}
+
 Picture *Picture::alloc(uint16_t w, uint16_t h, uint16_t line_pitch,
         enum pixel_format pix_fmt) {
     Picture *candidate;
     size_t pic_size = h * line_pitch;
 
-    candidate = new Picture;
+    candidate = pool( )->get(page_round(pic_size));
+    if (candidate != NULL) {
+        dfprintf(stderr, "RECYCLE %p\n", candidate);
+        candidate->rcount = 1;
+    } else {
+        candidate = new Picture;
+        candidate->alloc_data(pic_size);
+    }
+
     candidate->w = w;
     candidate->h = h;
     candidate->line_pitch = line_pitch;
     candidate->pix_fmt = pix_fmt;
-    candidate->alloc_data(pic_size);
 
     return candidate;
 }
@@ -94,7 +193,22 @@ void Picture::free(Picture *pic) {
     }
 
     dfprintf(stderr, "FINALIZE %p\n", pic);
-    delete pic;
+
+#ifdef HAVE_PANGOCAIRO
+    /* whoever gets this Picture next shouldn't inherit our font */
+    if (pic->font_description) {
+        pango_font_description_free(pic->font_description);
+        pic->font_description = NULL;
+    }
+#endif
+
+    if (!pool( )->put(pic)) {
+        delete pic;
+    }
+}
+
+void Picture::pool_stats(struct picture_pool_stats *out) {
+    pool( )->get_stats(out);
 }
 
 Picture *Picture::convert_to_format(enum pixel_format pix_fmt) {
@@ -172,182 +286,72 @@ Picture *Picture::to_yuva8(void) {
     return NULL; /* suppress a meaningless warning - the switch either returns or throws */
 }
 
-#undef CLAMP
-#undef SCLAMP
-#define CLAMP(x) ( (x < 256) ? x : 0 )
-#define SCLAMP(x) ( (x > 0) ? CLAMP(x) : 0 )
-
+/* 
+ * The per-line work is in picture_convert.cpp, which picks SIMD versions
+ * when the CPU has them.
+ */
 Picture *Picture::rgb8_to_uyvy8(void) {
-    int i, j;
-    uint8_t r, g, b;
-    uint16_t y1, y2, u, v;
+    const struct convert_kernels *k = convert_kernels_best( );
+    int i;
 
     /* UYVY8 = 4 bytes/2 pixels (w must be even) */
     assert(this->w % 2 == 0);
     Picture *out = Picture::alloc(this->w, this->h, 2*this->w, UYVY8);
-    uint8_t *pix_ptr, *out_ptr;
 
     for (i = 0; i < this->h; i++) {
-        pix_ptr = this->scanline(i);
-        out_ptr = out->scanline(i);
-        for (j = 0; j < this->w; j += 2) {            
-            r = *pix_ptr++;
-            g = *pix_ptr++;
-            b = *pix_ptr++;
-
-            y1 = 16 + (r * 66 + g * 129 + b * 25) / 256;
-            u = 128 + (b * 112 - g * 74 - r * 37) / 256;
-            v = 128 + (r * 112 - g * 94 - b * 18) / 256;
-
-            r = *pix_ptr++;
-            g = *pix_ptr++;
-            b = *pix_ptr++;
-
-            y2 = 16 + (r * 66 + g * 129 + b * 25) / 256;
-            u += 128 + (b * 112 - g * 74 - r * 37) / 256;
-            v += 128 + (r * 112 - g * 94 - b * 18) / 256;
-            
-            u >>= 1;
-            v >>= 1;
-
-            *out_ptr++ = u;
-            *out_ptr++ = y1;
-            *out_ptr++ = v;
-            *out_ptr++ = y2;
-        }
+        k->rgb8_to_uyvy8(this->scanline(i), out->scanline(i), this->w);
     }
     
     return out;
 }
 
 Picture *Picture::bgra8_to_yuva8(void) {
-    int i, j;
-    uint8_t r, g, b, a;
-    uint16_t y, u, v;
+    const struct convert_kernels *k = convert_kernels_best( );
+    int i;
 
     Picture *out = Picture::alloc(this->w, this->h, 4*this->w, YUVA8);
-    uint8_t *pix_ptr, *out_ptr;
 
     for (i = 0; i < this->h; i++) {
-        pix_ptr = this->scanline(i);
-        out_ptr = out->scanline(i);
-        for (j = 0; j < this->w; j++) {            
-            b = *pix_ptr++;
-            g = *pix_ptr++;
-            r = *pix_ptr++;
-            a = *pix_ptr++;
-
-            y = 16 + (r * 66 + g * 129 + b * 25) / 256;
-            u = 128 + (b * 112 - g * 74 - r * 37) / 256;
-            v = 128 + (r * 112 - g * 94 - b * 18) / 256;
-
-            *out_ptr++ = y;
-            *out_ptr++ = u;
-            *out_ptr++ = v;
-            *out_ptr++ = a;
-        }
+        k->bgra8_to_yuva8(this->scanline(i), out->scanline(i), this->w);
     }
     
     return out;
 }
 
-/* THIS IS BROKEN and results in video artifacts */
-/* (maybe not anymore??) */
 Picture *Picture::uyvy8_to_rgb8(void) {
-    int i, j;
-    int16_t r, g, b;
-    uint8_t u, y1, v, y2;
+    const struct convert_kernels *k = convert_kernels_best( );
+    int i;
+
     Picture *out = Picture::alloc(this->w, this->h, 3*this->w, RGB8);
-    uint8_t *in_ptr, *out_ptr;
 
     for (i = 0; i < this->h; i++) {
-        in_ptr = this->scanline(i);
-        out_ptr = out->scanline(i);
-
-        for (j = 0; j < this->w; j += 2) {
-            u = *in_ptr++;
-            y1 = *in_ptr++;
-            v = *in_ptr++;
-            y2 = *in_ptr++;
-
-            r = (298 * y1 + 409 * v) / 256 - 223;
-            g = (298 * y1 - 100 * u - 208 * v) / 256 + 135;
-            b = (298 * y1 + 516 * u) / 256 - 277;
-
-            *out_ptr++ = SCLAMP(r);
-            *out_ptr++ = SCLAMP(g);
-            *out_ptr++ = SCLAMP(b);
-
-            r = (298 * y2 + 409 * v) / 256 - 223;
-            g = (298 * y2 - 100 * u - 208 * v) / 256 + 135;
-            b = (298 * y2 + 516 * u) / 256 - 277;
-
-            *out_ptr++ = SCLAMP(r);
-            *out_ptr++ = SCLAMP(g);
-            *out_ptr++ = SCLAMP(b);
-        }
+        k->uyvy8_to_rgb8(this->scanline(i), out->scanline(i), this->w);
     }
 
     return out;
 }
 
 Picture *Picture::uyvy8_to_yuv8(void) {
-    int i, j;
-    uint8_t u, y1, v, y2;
+    const struct convert_kernels *k = convert_kernels_best( );
+    int i;
+
     Picture *out = Picture::alloc(this->w, this->h, 3*this->w, YUV8);
-    uint8_t *in_ptr, *out_ptr;
 
     for (i = 0; i < this->h; i++) {
-        in_ptr = this->scanline(i);
-        out_ptr = out->scanline(i);
-
-        for (j = 0; j < this->w; j+=2) {
-            u = *in_ptr++;
-            y1 = *in_ptr++;
-            v = *in_ptr++;
-            y2 = *in_ptr++;
-
-            *out_ptr++ = y1;
-            *out_ptr++ = u;
-            *out_ptr++ = v;
-
-            *out_ptr++ = y2;
-            *out_ptr++ = u;
-            *out_ptr++ = v;
-        }
+        k->uyvy8_to_yuv8(this->scanline(i), out->scanline(i), this->w);
     }
 
     return out;
 }
 
 Picture *Picture::yuv8_to_uyvy8(void) {
-    int i, j;
-    uint16_t u, v;
-    uint8_t y1, y2;
+    const struct convert_kernels *k = convert_kernels_best( );
+    int i;
 
     Picture *out = Picture::alloc(this->w, this->h, 2*this->w, UYVY8);
-    uint8_t *in_ptr, *out_ptr;
 
     for (i = 0; i < this->h; i++) {
-        in_ptr = this->scanline(i);
-        out_ptr = out->scanline(i);
-
-        for (j = 0; j < this->w; j += 2) {
-            y1 = *in_ptr++;
-            u = *in_ptr++;
-            v = *in_ptr++;
-            y2 = *in_ptr++;
-            u += *in_ptr++;
-            v += *in_ptr++;
-
-            u /= 2;
-            v /= 2;
-    
-            *out_ptr++ = u;
-            *out_ptr++ = y1;
-            *out_ptr++ = v;
-            *out_ptr++ = y2;
-        }
+        k->yuv8_to_uyvy8(this->scanline(i), out->scanline(i), this->w);
     }
 
     return out;
@@ -371,186 +375,236 @@ int Picture::pixel_pitch(void) {
     }
 }
 
-/* god awful slow blit routine */
-void Picture::draw(Picture *src, uint_fast16_t x, uint_fast16_t y,
-        uint_fast8_t r, uint_fast8_t g, uint_fast8_t b) {
-    
-    uint_fast16_t blit_w, blit_h;
-    uint_fast16_t blit_x, blit_y;
-    
-    uint_fast32_t ad, bd, cd;
-    uint_fast8_t as, bs, cs;
-    uint_fast8_t alpha;
-
-    uint8_t *dst_start_ptr, *src_start_ptr;
-
-    Picture *src_conv;
-
-    if (src->pix_fmt == A8) {
-        drawA8(src, x, y, r, g, b);
-        return;
-    } else if (src->pix_fmt == pix_fmt) {
-        src_conv = src;
-    } else if (src->pix_fmt == BGRA8 && pix_fmt == RGB8) {
-        src_conv = src;
-    } else if (src->pix_fmt == YUVA8 && pix_fmt == YUV8) {
-        src_conv = src;
-    } else if (src->pix_fmt == YUVA8 && pix_fmt == RGB8) {
-        src_conv = src->convert_to_format(BGRA8);
-    } else if (src->pix_fmt == BGRA8 && pix_fmt == YUV8) {
-        src_conv = src->convert_to_format(YUVA8);
-    } else if (src->pix_fmt == BGRA8 || src->pix_fmt == YUVA8) {
-        throw std::runtime_error("unsupported pix fmt");
-    } else {
-        src_conv = src->convert_to_format(pix_fmt);
+/* the premultiplied overlay format for drawing onto fmt */
+static enum pixel_format overlay_format(enum pixel_format fmt) {
+    switch (fmt) {
+        case RGB8:
+            return RGB8P;
+        case YUV8:
+            return YUV8P;
+        case UYVY8:
+            return UYVY8P;
+        default:
+            throw std::runtime_error("cannot draw overlays onto this format");
     }
+}
 
+static bool is_overlay_format(enum pixel_format fmt) {
+    return fmt == RGB8P || fmt == YUV8P || fmt == UYVY8P;
+}
 
-    blit_w = src->w;
-    blit_h = src->h;
-
-    if (x >= w || y >= h) {
-        return;
-    }
+/* 
+ * c * a / 256 with alpha stretched to 0-256 (so 255 is fully opaque).
+ * blend_premultiplied does the matching thing to the background.
+ */
+static inline uint8_t premul(uint_fast16_t c, uint_fast16_t a) {
+    return (c * (a + (a >> 7))) >> 8;
+}
 
-    if (x + blit_w >= w) {
-        blit_w = w - x;
-    }
+Picture *Picture::premultiply(enum pixel_format dst_fmt,
+        uint_fast8_t r, uint_fast8_t g, uint_fast8_t b) {
+    enum pixel_format out_fmt = overlay_format(dst_fmt);
+    int pitch = (out_fmt == UYVY8P) ? 2 : 3;
+    Picture *src, *out;
+    uint8_t *src_ptr, *color, *alpha;
+    uint8_t fill[3] = { 0, 0, 0 }; /* only A8 uses it */
+    uint_fast16_t a, a2, ac;
+    int i, j;
 
-    if (y + blit_h >= h) {
-        blit_h = h - y;
+    if (pix_fmt == A8) {
+        /* A8 works backwards: 0 is all fill color, 255 leaves the background */
+        src = this;
+        if (dst_fmt == RGB8) {
+            fill[0] = r;
+            fill[1] = g;
+            fill[2] = b;
+        } else {
+            fill[0] = 16 + (r * 66 + g * 129 + b * 25) / 256;
+            fill[1] = 128 + (b * 112 - g * 74 - r * 37) / 256;
+            fill[2] = 128 + (r * 112 - g * 94 - b * 18) / 256;
+        }
+    } else if (dst_fmt == RGB8 && pix_fmt == BGRA8) {
+        src = this;
+    } else if (dst_fmt != RGB8 && (pix_fmt == BGRA8 || pix_fmt == YUVA8)) {
+        src = to_yuva8( );
+    } else {
+        throw std::runtime_error("cannot premultiply this pixel format");
     }
 
-    if (src->pix_fmt != BGRA8 && src->pix_fmt != YUVA8) {
-        for (blit_y = 0; blit_y < blit_h; ++blit_y) {
-            dst_start_ptr = data + line_pitch * blit_y + pixel_pitch( ) * x;
-            memcpy(dst_start_ptr, src->scanline(blit_y), pixel_pitch( ) * blit_w);
-        }
-    } else if (src->pix_fmt == BGRA8 && pix_fmt == RGB8) {
-        for (blit_y = 0; blit_y < blit_h; ++blit_y) {
-            dst_start_ptr = scanline(y + blit_y) + pixel_pitch( ) * x;
-            src_start_ptr = src->scanline(blit_y);
-            for (blit_x = 0; blit_x < blit_w; ++blit_x) {
-                ad = dst_start_ptr[0];
-                bd = dst_start_ptr[1];
-                cd = dst_start_ptr[2];
-
-                cs = *src_start_ptr++;
-                bs = *src_start_ptr++;
-                as = *src_start_ptr++;
-                alpha = *src_start_ptr++;
-
-                ad = as * alpha + ad * (256 - alpha);
-                bd = bs * alpha + bd * (256 - alpha);
-                cd = cs * alpha + cd * (256 - alpha);
-
-                *dst_start_ptr++ = ad / 256;
-                *dst_start_ptr++ = bd / 256;
-                *dst_start_ptr++ = cd / 256;
+    out = Picture::alloc(w, h, 2 * pitch * w, out_fmt);
+
+    for (i = 0; i < h; i++) {
+        src_ptr = src->scanline(i);
+        color = out->scanline(i);
+        alpha = color + pitch * w;
+
+        if (pix_fmt == A8 && out_fmt == UYVY8P) {
+            for (j = 0; j + 1 < w; j += 2) {
+                a = 255 - src_ptr[j];
+                a2 = 255 - src_ptr[j + 1];
+                ac = (a + a2) / 2;
+
+                color[0] = premul(fill[1], ac);
+                color[1] = premul(fill[0], a);
+                color[2] = premul(fill[2], ac);
+                color[3] = premul(fill[0], a2);
+                alpha[0] = ac;
+                alpha[1] = a;
+                alpha[2] = ac;
+                alpha[3] = a2;
+
+                color += 4;
+                alpha += 4;
             }
-        }
-    } else if (src->pix_fmt == YUVA8 && pix_fmt == YUV8) {
-        for (blit_y = 0; blit_y < blit_h; ++blit_y) {
-            dst_start_ptr = scanline(y + blit_y) + pixel_pitch( ) * x;
-            src_start_ptr = src->scanline(blit_y);
-            for (blit_x = 0; blit_x < blit_w; ++blit_x) {
-                ad = dst_start_ptr[0];
-                bd = dst_start_ptr[1];
-                cd = dst_start_ptr[2];
-
-                as = *src_start_ptr++;
-                bs = *src_start_ptr++;
-                cs = *src_start_ptr++;
-                alpha = *src_start_ptr++;
-
-                ad = as * alpha + ad * (256 - alpha);
-                bd = bs * alpha + bd * (256 - alpha);
-                cd = cs * alpha + cd * (256 - alpha);
-
-                *dst_start_ptr++ = ad / 256;
-                *dst_start_ptr++ = bd / 256;
-                *dst_start_ptr++ = cd / 256;
+        } else if (pix_fmt == A8) {
+            for (j = 0; j < w; j++) {
+                a = 255 - src_ptr[j];
+
+                *color++ = premul(fill[0], a);
+                *color++ = premul(fill[1], a);
+                *color++ = premul(fill[2], a);
+                *alpha++ = a;
+                *alpha++ = a;
+                *alpha++ = a;
+            }
+        } else if (out_fmt == RGB8P) {
+            for (j = 0; j < w; j++) {
+                a = src_ptr[3];
+
+                *color++ = premul(src_ptr[2], a);
+                *color++ = premul(src_ptr[1], a);
+                *color++ = premul(src_ptr[0], a);
+                *alpha++ = a;
+                *alpha++ = a;
+                *alpha++ = a;
+
+                src_ptr += 4;
+            }
+        } else if (out_fmt == YUV8P) {
+            for (j = 0; j < w; j++) {
+                a = src_ptr[3];
+
+                *color++ = premul(src_ptr[0], a);
+                *color++ = premul(src_ptr[1], a);
+                *color++ = premul(src_ptr[2], a);
+                *alpha++ = a;
+                *alpha++ = a;
+                *alpha++ = a;
+
+                src_ptr += 4;
+            }
+        } else {
+            for (j = 0; j + 1 < w; j += 2) {
+                /* each Y gets its own alpha, the shared chroma the average */
+                a = src_ptr[3];
+                a2 = src_ptr[7];
+                ac = (a + a2) / 2;
+
+                color[0] = premul((src_ptr[1] + src_ptr[5]) / 2, ac);
+                color[1] = premul(src_ptr[0], a);
+                color[2] = premul((src_ptr[2] + src_ptr[6]) / 2, ac);
+                color[3] = premul(src_ptr[4], a2);
+                alpha[0] = ac;
+                alpha[1] = a;
+                alpha[2] = ac;
+                alpha[3] = a2;
+
+                color += 4;
+                alpha += 4;
+                src_ptr += 8;
             }
         }
 
-    } else {
-        throw std::runtime_error("can't handle that yet");
+        if (out_fmt == UYVY8P && (w & 1)) {
+            /* a lone last pixel has no chroma pair; leave it transparent */
+            memset(color, 0, 2);
+            memset(alpha, 0, 2);
+        }
     }
 
-}
+    if (src != this) {
+        Picture::free(src);
+    }
 
+    return out;
+}
 
-void Picture::drawA8(Picture *src, uint_fast16_t x, uint_fast16_t y,
+/* 
+ * Opaque pictures are copied in. Overlays with alpha are composited,
+ * after being premultiplied for this format if they weren't already.
+ */
+void Picture::draw(Picture *src, uint_fast16_t x, uint_fast16_t y,
         uint_fast8_t r, uint_fast8_t g, uint_fast8_t b) {
+    
+    uint_fast16_t blit_w, blit_h;
+    uint_fast16_t blit_y;
+    int pitch;
 
-    uint_fast8_t blend_src[4];
-    int blend_pitch;
-    uint_fast16_t y1, u, v;
-    uint_fast16_t blit_w, blit_h, blit_x, blit_y;
-    uint_fast16_t blend;
-    uint8_t *src_ptr, *my_ptr;
-    uint8_t alpha;
-    int j;
-
-    /* use Y'CbCr format in 2 cases below */
-    y1 = 16 + (r * 66 + g * 129 + b * 25) / 256;
-    u = 128 + (b * 112 - g * 74 - r * 37) / 256;
-    v = 128 + (r * 112 - g * 94 - b * 18) / 256;
-    switch (pix_fmt) {
-        case RGB8:
-            blend_src[0] = r;
-            blend_src[1] = g;
-            blend_src[2] = b;
-            blend_pitch = 3;
-            break;
+    uint8_t *dst_start_ptr, *color;
 
-        case YUV8:
-            blend_src[0] = y1;
-            blend_src[1] = u;
-            blend_src[2] = v;
-            blend_pitch = 3;
-            break;
+    Picture *src_conv;
 
-        case UYVY8:
-            throw std::runtime_error("this doesn't quite work yet");
-            blend_src[0] = u;
-            blend_src[1] = y;
-            blend_src[2] = v;
-            blend_src[3] = y;
-            blend_pitch = 4;
-            break;
+    if (src->pix_fmt == pix_fmt) {
+        src_conv = src;
+    } else if (is_overlay_format(src->pix_fmt)) {
+        if (src->pix_fmt != overlay_format(pix_fmt)) {
+            throw std::runtime_error("overlay was premultiplied for another format");
+        }
+        src_conv = src;
+    } else if (src->pix_fmt == A8 || src->pix_fmt == BGRA8 || src->pix_fmt == YUVA8) {
+        src_conv = src->premultiply(pix_fmt, r, g, b);
+    } else {
+        src_conv = src->convert_to_format(pix_fmt);
+    }
+
+    pitch = pixel_pitch( );
+
+    if (pix_fmt == UYVY8) {
+        /* chroma is shared by pixel pairs, so start on an even pixel */
+        x &= ~1;
     }
 
     blit_w = src->w;
     blit_h = src->h;
 
     if (x >= w || y >= h) {
-        return;
-    }
+        /* nothing to draw, but src_conv still has to be freed below */
+        blit_w = blit_h = 0;
+    } else {
+        if (x + blit_w >= w) {
+            blit_w = w - x;
+        }
 
-    if (x + blit_w >= w) {
-        blit_w = w - x;
+        if (y + blit_h >= h) {
+            blit_h = h - y;
+        }
     }
 
-    if (y + blit_h >= h) {
-        blit_h = h - y;
+    if (pix_fmt == UYVY8) {
+        /* and only blend whole pairs */
+        blit_w &= ~1;
     }
 
-    for (blit_y = 0; blit_y < blit_h; ++blit_y) {
-        src_ptr = src->scanline(blit_y);
-        my_ptr = scanline(blit_y) + pixel_pitch( ) * x;
-        for (blit_x = 0; blit_x < blit_w; ++blit_x) {
-            alpha = src_ptr[blit_x];
-            for (j = 0; j < blend_pitch; ++j) {
-                /* alpha blending each pixel */
-                blend = (alpha * *my_ptr + (256 - alpha) * blend_src[j]) / 256;
-                *my_ptr = blend;
-                ++my_ptr;
-            }
+    if (!is_overlay_format(src_conv->pix_fmt)) {
+        for (blit_y = 0; blit_y < blit_h; ++blit_y) {
+            dst_start_ptr = scanline(y + blit_y) + pitch * x;
+            memcpy(dst_start_ptr, src_conv->scanline(blit_y), pitch * blit_w);
+        }
+    } else {
+        blend_line_fn blend = convert_kernels_best( )->blend_premultiplied;
+
+        for (blit_y = 0; blit_y < blit_h; ++blit_y) {
+            dst_start_ptr = scanline(y + blit_y) + pitch * x;
+            color = src_conv->scanline(blit_y);
+            blend(dst_start_ptr, color, color + pitch * src_conv->w, pitch * blit_w);
         }
     }
-    
+
+    if (src_conv != src) {
+        Picture::free(src_conv);
+    }
 }
+
 #ifdef HAVE_PANGOCAIRO
 
 cairo_surface_t *Picture::get_cairo(void) {
@@ -603,7 +657,25 @@ void Picture::set_font(const char *family, int height) {
 
 }
 
-Picture *Picture::from_png(const char *filename) {
+void Picture::unpremultiply(void) {
+    if (pix_fmt != BGRA8) {
+        throw std::runtime_error("can only unpremultiply BGRA8");
+    }
+
+    for (int ycopy = 0; ycopy < h; ++ycopy) {
+        uint8_t *px = scanline(ycopy);
+        for (int xp = 0; xp < w; ++xp, px += 4) {
+            if (px[3] != 0 && px[3] != 255) {
+                for (int c = 0; c < 3; ++c) {
+                    int v = (px[c] * 255 + px[3] / 2) / px[3];
+                    px[c] = (v > 255) ? 255 : v;
+                }
+            }
+        }
+    }
+}
+
+Picture *Picture::from_png(const char *filename, enum pixel_format overlay_fmt) {
     cairo_surface_t *pngs = cairo_image_surface_create_from_png(filename);
 
     if (cairo_surface_status(pngs) != CAIRO_STATUS_SUCCESS) {
@@ -635,6 +707,30 @@ Picture *Picture::from_png(const char *filename) {
     }
     
     cairo_surface_destroy(pngs);
+
+    if (overlay_fmt != BGRA8) {
+        /* 
+         * Convert once now so drawing it is just the blend. Cairo hands
+         * back premultiplied ARGB32 (and RGB24 with junk alpha), so get
+         * back to plain BGRA first: premultiply( ) does the colorspace
+         * conversion before applying alpha.
+         */
+        if (nf == CAIRO_FORMAT_RGB24) {
+            for (int ycopy = 0; ycopy < ret->h; ++ycopy) {
+                uint8_t *px = ret->scanline(ycopy);
+                for (int xp = 0; xp < ret->w; ++xp, px += 4) {
+                    px[3] = 255;
+                }
+            }
+        } else {
+            ret->unpremultiply( );
+        }
+
+        Picture *overlay = ret->premultiply(overlay_fmt);
+        Picture::free(ret);
+        ret = overlay;
+    }
+
     return ret;
 }
 #endif
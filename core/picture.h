@@ -3,9 +3,17 @@
 
 #include <list>
 #include <stdint.h>
-
+#include <stddef.h>
+
+/*
+ * RGB8P, YUV8P and UYVY8P are premultiplied overlays, ready to composite
+ * onto RGB8, YUV8 and UYVY8 pictures. Each scanline is w pixels of the
+ * target format with the overlay's alpha already multiplied in, then the
+ * same number of bytes again holding the alpha that goes with each of
+ * those bytes. Blending is then the same cheap operation on every byte.
+ */
 enum pixel_format {
-    RGB8, UYVY8, YUV8, BGRA8, YUVA8, A8
+    RGB8, UYVY8, YUV8, BGRA8, YUVA8, A8, RGB8P, YUV8P, UYVY8P
 };
 
 #ifdef HAVE_PANGOCAIRO
@@ -13,6 +21,22 @@ enum pixel_format {
 #include <pango/pangocairo.h>
 #endif
 
+/* 
+ * Freed Pictures are kept around, keyed by buffer size, so the next
+ * alloc of the same size can skip new/memalign. Pictures of up to
+ * PICTURE_POOL_CLASSES different sizes are kept, PICTURE_POOL_DEPTH
+ * of each.
+ */
+#define PICTURE_POOL_CLASSES 16
+#define PICTURE_POOL_DEPTH 8
+
+struct picture_pool_stats {
+    uint64_t hits;      /* allocs satisfied from the pool */
+    uint64_t misses;    /* allocs that had to go to the heap */
+    uint64_t discards;  /* frees that didn't fit in the pool */
+    uint32_t pooled;    /* Pictures sitting in the pool right now */
+};
+
 class Picture {
     public:
         uint8_t *data;
@@ -30,6 +54,7 @@ class Picture {
             enum pixel_format pix_fmt = RGB8);
         static Picture *copy(Picture *src);
         static void free(Picture *pic);
+        static void pool_stats(struct picture_pool_stats *out);
 
         int pixel_pitch(void);
         
@@ -39,12 +64,24 @@ class Picture {
         void draw(Picture *src, uint_fast16_t x, uint_fast16_t y,
             uint_fast8_t r, uint_fast8_t g, uint_fast8_t b);
 
+        /* 
+         * Convert a BGRA8, YUVA8 or A8 (filled with r, g, b) picture to the
+         * premultiplied overlay format for drawing onto dst_fmt. Drawing
+         * one of those skips all per-frame conversion.
+         */
+        Picture *premultiply(enum pixel_format dst_fmt,
+            uint_fast8_t r = 0, uint_fast8_t g = 0, uint_fast8_t b = 0);
+
         void addref( );
 
 #ifdef HAVE_PANGOCAIRO
         cairo_surface_t *get_cairo(void);
         void render_text(uint_fast16_t x, uint_fast16_t y, const char *fmt, ...);
-        static Picture *from_png(const char *filename);
+        /* BGRA8, or premultiplied for drawing onto overlay_fmt */
+        static Picture *from_png(const char *filename,
+            enum pixel_format overlay_fmt = BGRA8);
+        /* cairo's ARGB32 is premultiplied; turn it into plain BGRA8 in place */
+        void unpremultiply(void);
         void set_font(const char *family, int height);
 #endif
     protected:
@@ -64,16 +101,15 @@ class Picture {
 
         void alloc_data(size_t size);
 
-        void drawA8(Picture *src, uint_fast16_t x, uint_fast16_t y,
-            uint_fast8_t r, uint_fast8_t g, uint_fast8_t b);
-
-        uint16_t alloc_size;
+        size_t alloc_size;
 
         
         
 #ifdef HAVE_PANGOCAIRO
         PangoFontDescription *font_description;
 #endif
+
+        friend class PicturePool;
 };
 
 #endif
@@ -0,0 +1,998 @@
+/*
+ * picture_convert.cpp
+ *
+ * This file is part of openreplay. See the README file for the license
+ * terms governing its use.
+ *
+ * Scanline colorspace conversions for Picture: a scalar version of each,
+ * plus SSSE3 and AVX2 versions picked at runtime. The SIMD code does the
+ * same integer math as the scalar code (16-bit lanes where the numbers
+ * fit, 32-bit where they don't, and C's round-toward-zero on signed
+ * divides), so output is identical whichever set runs.
+ *
+ * SSE2 alone has no byte shuffle, which is most of the work for packed
+ * 24-bit pixels, so the 128-bit path needs SSSE3.
+ */
+
+#include "picture_convert.h"
+
+#include <stddef.h>
+
+#undef CLAMP
+#undef SCLAMP
+#define CLAMP(x) ( (x < 256) ? x : 255 )
+#define SCLAMP(x) ( (x > 0) ? CLAMP(x) : 0 )
+
+static void rgb8_to_uyvy8_scalar(const uint8_t *pix_ptr, uint8_t *out_ptr, int w) {
+    int j;
+    uint8_t r, g, b;
+    uint16_t y1, y2, u, v;
+
+    for (j = 0; j < w; j += 2) {
+        r = *pix_ptr++;
+        g = *pix_ptr++;
+        b = *pix_ptr++;
+
+        y1 = 16 + (r * 66 + g * 129 + b * 25) / 256;
+        u = 128 + (b * 112 - g * 74 - r * 37) / 256;
+        v = 128 + (r * 112 - g * 94 - b * 18) / 256;
+
+        r = *pix_ptr++;
+        g = *pix_ptr++;
+        b = *pix_ptr++;
+
+        y2 = 16 + (r * 66 + g * 129 + b * 25) / 256;
+        u += 128 + (b * 112 - g * 74 - r * 37) / 256;
+        v += 128 + (r * 112 - g * 94 - b * 18) / 256;
+
+        u >>= 1;
+        v >>= 1;
+
+        *out_ptr++ = u;
+        *out_ptr++ = y1;
+        *out_ptr++ = v;
+        *out_ptr++ = y2;
+    }
+}
+
+static void bgra8_to_yuva8_scalar(const uint8_t *pix_ptr, uint8_t *out_ptr, int w) {
+    int j;
+    uint8_t r, g, b, a;
+    uint16_t y, u, v;
+
+    for (j = 0; j < w; j++) {
+        b = *pix_ptr++;
+        g = *pix_ptr++;
+        r = *pix_ptr++;
+        a = *pix_ptr++;
+
+        y = 16 + (r * 66 + g * 129 + b * 25) / 256;
+        u = 128 + (b * 112 - g * 74 - r * 37) / 256;
+        v = 128 + (r * 112 - g * 94 - b * 18) / 256;
+
+        *out_ptr++ = y;
+        *out_ptr++ = u;
+        *out_ptr++ = v;
+        *out_ptr++ = a;
+    }
+}
+
+static void uyvy8_to_rgb8_scalar(const uint8_t *in_ptr, uint8_t *out_ptr, int w) {
+    int j;
+    int16_t r, g, b;
+    uint8_t u, y1, v, y2;
+
+    for (j = 0; j < w; j += 2) {
+        u = *in_ptr++;
+        y1 = *in_ptr++;
+        v = *in_ptr++;
+        y2 = *in_ptr++;
+
+        r = (298 * y1 + 409 * v) / 256 - 223;
+        g = (298 * y1 - 100 * u - 208 * v) / 256 + 135;
+        b = (298 * y1 + 516 * u) / 256 - 277;
+
+        *out_ptr++ = SCLAMP(r);
+        *out_ptr++ = SCLAMP(g);
+        *out_ptr++ = SCLAMP(b);
+
+        r = (298 * y2 + 409 * v) / 256 - 223;
+        g = (298 * y2 - 100 * u - 208 * v) / 256 + 135;
+        b = (298 * y2 + 516 * u) / 256 - 277;
+
+        *out_ptr++ = SCLAMP(r);
+        *out_ptr++ = SCLAMP(g);
+        *out_ptr++ = SCLAMP(b);
+    }
+}
+
+static void uyvy8_to_yuv8_scalar(const uint8_t *in_ptr, uint8_t *out_ptr, int w) {
+    int j;
+    uint8_t u, y1, v, y2;
+
+    for (j = 0; j < w; j += 2) {
+        u = *in_ptr++;
+        y1 = *in_ptr++;
+        v = *in_ptr++;
+        y2 = *in_ptr++;
+
+        *out_ptr++ = y1;
+        *out_ptr++ = u;
+        *out_ptr++ = v;
+
+        *out_ptr++ = y2;
+        *out_ptr++ = u;
+        *out_ptr++ = v;
+    }
+}
+
+static void yuv8_to_uyvy8_scalar(const uint8_t *in_ptr, uint8_t *out_ptr, int w) {
+    int j;
+    uint16_t u, v;
+    uint8_t y1, y2;
+
+    for (j = 0; j < w; j += 2) {
+        y1 = *in_ptr++;
+        u = *in_ptr++;
+        v = *in_ptr++;
+        y2 = *in_ptr++;
+        u += *in_ptr++;
+        v += *in_ptr++;
+
+        u /= 2;
+        v /= 2;
+
+        *out_ptr++ = u;
+        *out_ptr++ = y1;
+        *out_ptr++ = v;
+        *out_ptr++ = y2;
+    }
+}
+
+static void blend_premultiplied_scalar(uint8_t *dst, const uint8_t *color,
+        const uint8_t *alpha, int n) {
+    int i;
+    uint_fast16_t a;
+
+    for (i = 0; i < n; i++) {
+        a = alpha[i];
+        a += a >> 7;
+        dst[i] = color[i] + dst[i] - ((dst[i] * a) >> 8);
+    }
+}
+
+static void mix_scalar(const uint8_t *a, const uint8_t *b, uint8_t *out,
+        int n, int weight) {
+    int i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = (a[i] * (256 - weight) + b[i] * weight + 128) >> 8;
+    }
+}
+
+static unsigned int sad_scalar(const uint8_t *a, int a_pitch,
+        const uint8_t *b, int b_pitch, int n, int rows) {
+    unsigned int sum = 0;
+    int i, r;
+
+    for (r = 0; r < rows; r++) {
+        for (i = 0; i < n; i++) {
+            sum += (a[i] > b[i]) ? a[i] - b[i] : b[i] - a[i];
+        }
+        a += a_pitch;
+        b += b_pitch;
+    }
+
+    return sum;
+}
+
+static const struct convert_kernels scalar_kernels = {
+    "scalar",
+    rgb8_to_uyvy8_scalar,
+    uyvy8_to_rgb8_scalar,
+    uyvy8_to_yuv8_scalar,
+    yuv8_to_uyvy8_scalar,
+    bgra8_to_yuva8_scalar,
+    blend_premultiplied_scalar,
+    mix_scalar,
+    sad_scalar
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_KERNELS
+
+#include <immintrin.h>
+
+#define SSSE3 __attribute__((target("ssse3")))
+#define AVX2 __attribute__((target("avx2")))
+
+/* pshufb masks; Z zeroes the output byte */
+#define Z -128
+
+/* 16 packed 3-byte pixels (in three registers) to planes: [channel][register] */
+static const int8_t unpack_24bit[3][3][16] = {
+    { { 0, 3, 6, 9, 12, 15, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z },
+      { Z, Z, Z, Z, Z, Z, 2, 5, 8, 11, 14, Z, Z, Z, Z, Z },
+      { Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, 1, 4, 7, 10, 13 } },
+    { { 1, 4, 7, 10, 13, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z },
+      { Z, Z, Z, Z, Z, 0, 3, 6, 9, 12, 15, Z, Z, Z, Z, Z },
+      { Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, 2, 5, 8, 11, 14 } },
+    { { 2, 5, 8, 11, 14, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z },
+      { Z, Z, Z, Z, Z, 1, 4, 7, 10, 13, Z, Z, Z, Z, Z, Z },
+      { Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, 0, 3, 6, 9, 12, 15 } }
+};
+
+/* and back again: [output register][channel] */
+static const int8_t pack_24bit[3][3][16] = {
+    { { 0, Z, Z, 1, Z, Z, 2, Z, Z, 3, Z, Z, 4, Z, Z, 5 },
+      { Z, 0, Z, Z, 1, Z, Z, 2, Z, Z, 3, Z, Z, 4, Z, Z },
+      { Z, Z, 0, Z, Z, 1, Z, Z, 2, Z, Z, 3, Z, Z, 4, Z } },
+    { { Z, Z, 6, Z, Z, 7, Z, Z, 8, Z, Z, 9, Z, Z, 10, Z },
+      { 5, Z, Z, 6, Z, Z, 7, Z, Z, 8, Z, Z, 9, Z, Z, 10 },
+      { Z, 5, Z, Z, 6, Z, Z, 7, Z, Z, 8, Z, Z, 9, Z, Z } },
+    { { Z, 11, Z, Z, 12, Z, Z, 13, Z, Z, 14, Z, Z, 15, Z, Z },
+      { Z, Z, 11, Z, Z, 12, Z, Z, 13, Z, Z, 14, Z, Z, 15, Z },
+      { 10, Z, Z, 11, Z, Z, 12, Z, Z, 13, Z, Z, 14, Z, Z, 15 } }
+};
+
+/* 16 UYVY pixels (two registers) to YUV: [output register][input register] */
+static const int8_t uyvy_to_yuv[3][2][16] = {
+    { { 1, 0, 2, 3, 0, 2, 5, 4, 6, 7, 4, 6, 9, 8, 10, 11 },
+      { Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z } },
+    { { 8, 10, 13, 12, 14, 15, 12, 14, Z, Z, Z, Z, Z, Z, Z, Z },
+      { Z, Z, Z, Z, Z, Z, Z, Z, 1, 0, 2, 3, 0, 2, 5, 4 } },
+    { { Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z },
+      { 6, 7, 4, 6, 9, 8, 10, 11, 8, 10, 13, 12, 14, 15, 12, 14 } }
+};
+
+/*
+ * 8 UYVY pixels to 16-bit (Y, U) and (Y, V) pairs for pmaddwd:
+ * [pixels 0-3 or 4-7][U or V]
+ */
+static const int8_t uyvy_to_pairs[2][2][16] = {
+    { { 1, Z, 0, Z, 3, Z, 0, Z, 5, Z, 4, Z, 7, Z, 4, Z },
+      { 1, Z, 2, Z, 3, Z, 2, Z, 5, Z, 6, Z, 7, Z, 6, Z } },
+    { { 9, Z, 8, Z, 11, Z, 8, Z, 13, Z, 12, Z, 15, Z, 12, Z },
+      { 9, Z, 10, Z, 11, Z, 10, Z, 13, Z, 14, Z, 15, Z, 14, Z } }
+};
+
+/* 4 BGRA pixels to 4 bytes each of B, G, R, A */
+static const int8_t bgra_to_planes[16] = {
+    0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15
+};
+
+#undef Z
+
+/*
+ * 128-bit (SSSE3) kernels, 16 pixels per iteration.
+ */
+
+static SSSE3 inline __m128i mask_128(const int8_t *mask) {
+    return _mm_loadu_si128((const __m128i *) mask);
+}
+
+/* x / 256 rounding toward zero, as C does it */
+static SSSE3 inline __m128i div256_epi16_128(__m128i x) {
+    __m128i bias = _mm_and_si128(_mm_srai_epi16(x, 15), _mm_set1_epi16(255));
+    return _mm_srai_epi16(_mm_add_epi16(x, bias), 8);
+}
+
+static SSSE3 inline __m128i div256_epi32_128(__m128i x) {
+    __m128i bias = _mm_and_si128(_mm_srai_epi32(x, 31), _mm_set1_epi32(255));
+    return _mm_srai_epi32(_mm_add_epi32(x, bias), 8);
+}
+
+static SSSE3 inline __m128i shuffle3_128(__m128i a, __m128i b, __m128i c,
+        const int8_t masks[3][16]) {
+    return _mm_or_si128(
+        _mm_or_si128(_mm_shuffle_epi8(a, mask_128(masks[0])),
+            _mm_shuffle_epi8(b, mask_128(masks[1]))),
+        _mm_shuffle_epi8(c, mask_128(masks[2]))
+    );
+}
+
+/* Y, U, V for 8 pixels held in 16-bit lanes */
+static SSSE3 inline void rgb_to_yuv_epi16_128(__m128i r, __m128i g, __m128i b,
+        __m128i *y, __m128i *u, __m128i *v) {
+    /* unsigned, and at most 56100, so this fits in 16 bits */
+    *y = _mm_add_epi16(_mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(
+        _mm_mullo_epi16(r, _mm_set1_epi16(66)),
+        _mm_mullo_epi16(g, _mm_set1_epi16(129))),
+        _mm_mullo_epi16(b, _mm_set1_epi16(25))), 8), _mm_set1_epi16(16));
+
+    /* these stay within +/-28560 */
+    *u = _mm_add_epi16(div256_epi16_128(_mm_sub_epi16(_mm_sub_epi16(
+        _mm_mullo_epi16(b, _mm_set1_epi16(112)),
+        _mm_mullo_epi16(g, _mm_set1_epi16(74))),
+        _mm_mullo_epi16(r, _mm_set1_epi16(37)))), _mm_set1_epi16(128));
+
+    *v = _mm_add_epi16(div256_epi16_128(_mm_sub_epi16(_mm_sub_epi16(
+        _mm_mullo_epi16(r, _mm_set1_epi16(112)),
+        _mm_mullo_epi16(g, _mm_set1_epi16(94))),
+        _mm_mullo_epi16(b, _mm_set1_epi16(18)))), _mm_set1_epi16(128));
+}
+
+/* Y, U, V bytes for 16 pixels given R, G, B bytes */
+static SSSE3 inline void rgb_to_yuv_128(__m128i r, __m128i g, __m128i b,
+        __m128i *y, __m128i *u, __m128i *v) {
+    __m128i zero = _mm_setzero_si128( );
+    __m128i y0, u0, v0, y1, u1, v1;
+
+    rgb_to_yuv_epi16_128(_mm_unpacklo_epi8(r, zero), _mm_unpacklo_epi8(g, zero),
+        _mm_unpacklo_epi8(b, zero), &y0, &u0, &v0);
+    rgb_to_yuv_epi16_128(_mm_unpackhi_epi8(r, zero), _mm_unpackhi_epi8(g, zero),
+        _mm_unpackhi_epi8(b, zero), &y1, &u1, &v1);
+
+    *y = _mm_packus_epi16(y0, y1);
+    *u = _mm_packus_epi16(u0, u1);
+    *v = _mm_packus_epi16(v0, v1);
+}
+
+/* average chroma over pixel pairs, then interleave into 32 bytes of UYVY */
+static SSSE3 inline void pack_uyvy_128(__m128i y, __m128i u, __m128i v, uint8_t *out) {
+    __m128i lo_bytes = _mm_set1_epi16(0x00ff);
+    __m128i us = _mm_srli_epi16(_mm_add_epi16(_mm_and_si128(u, lo_bytes),
+        _mm_srli_epi16(u, 8)), 1);
+    __m128i vs = _mm_srli_epi16(_mm_add_epi16(_mm_and_si128(v, lo_bytes),
+        _mm_srli_epi16(v, 8)), 1);
+    __m128i uv = _mm_or_si128(us, _mm_slli_epi16(vs, 8));
+
+    _mm_storeu_si128((__m128i *) out, _mm_unpacklo_epi8(uv, y));
+    _mm_storeu_si128((__m128i *) (out + 16), _mm_unpackhi_epi8(uv, y));
+}
+
+/* R, G, B (saturated to 16 bits) for 4 pixels from (Y, U) and (Y, V) pairs */
+static SSSE3 inline void yuv_pairs_to_rgb_128(__m128i yu, __m128i yv,
+        __m128i *r, __m128i *g, __m128i *b) {
+    *r = _mm_sub_epi32(_mm_srai_epi32(
+        _mm_madd_epi16(yv, _mm_setr_epi16(298, 409, 298, 409, 298, 409, 298, 409)), 8),
+        _mm_set1_epi32(223));
+    *g = _mm_add_epi32(div256_epi32_128(_mm_add_epi32(
+        _mm_madd_epi16(yu, _mm_setr_epi16(298, -100, 298, -100, 298, -100, 298, -100)),
+        _mm_madd_epi16(yv, _mm_setr_epi16(0, -208, 0, -208, 0, -208, 0, -208)))),
+        _mm_set1_epi32(135));
+    *b = _mm_sub_epi32(_mm_srai_epi32(
+        _mm_madd_epi16(yu, _mm_setr_epi16(298, 516, 298, 516, 298, 516, 298, 516)), 8),
+        _mm_set1_epi32(277));
+}
+
+/* R, G, B for 8 UYVY pixels, in 16-bit lanes */
+static SSSE3 inline void uyvy_to_rgb_epi16_128(__m128i in,
+        __m128i *r, __m128i *g, __m128i *b) {
+    __m128i r0, g0, b0, r1, g1, b1;
+
+    yuv_pairs_to_rgb_128(_mm_shuffle_epi8(in, mask_128(uyvy_to_pairs[0][0])),
+        _mm_shuffle_epi8(in, mask_128(uyvy_to_pairs[0][1])), &r0, &g0, &b0);
+    yuv_pairs_to_rgb_128(_mm_shuffle_epi8(in, mask_128(uyvy_to_pairs[1][0])),
+        _mm_shuffle_epi8(in, mask_128(uyvy_to_pairs[1][1])), &r1, &g1, &b1);
+
+    *r = _mm_packs_epi32(r0, r1);
+    *g = _mm_packs_epi32(g0, g1);
+    *b = _mm_packs_epi32(b0, b1);
+}
+
+static SSSE3 void rgb8_to_uyvy8_ssse3(const uint8_t *in, uint8_t *out, int w) {
+    __m128i a, b, c, y, u, v;
+    int j;
+
+    for (j = 0; j + 16 <= w; j += 16) {
+        a = _mm_loadu_si128((const __m128i *) in);
+        b = _mm_loadu_si128((const __m128i *) (in + 16));
+        c = _mm_loadu_si128((const __m128i *) (in + 32));
+
+        rgb_to_yuv_128(shuffle3_128(a, b, c, unpack_24bit[0]),
+            shuffle3_128(a, b, c, unpack_24bit[1]),
+            shuffle3_128(a, b, c, unpack_24bit[2]), &y, &u, &v);
+        pack_uyvy_128(y, u, v, out);
+
+        in += 48;
+        out += 32;
+    }
+
+    rgb8_to_uyvy8_scalar(in, out, w - j);
+}
+
+static SSSE3 void uyvy8_to_rgb8_ssse3(const uint8_t *in, uint8_t *out, int w) {
+    __m128i r0, g0, b0, r1, g1, b1, r, g, b;
+    int j;
+
+    for (j = 0; j + 16 <= w; j += 16) {
+        uyvy_to_rgb_epi16_128(_mm_loadu_si128((const __m128i *) in), &r0, &g0, &b0);
+        uyvy_to_rgb_epi16_128(_mm_loadu_si128((const __m128i *) (in + 16)), &r1, &g1, &b1);
+
+        /* saturating pack does the clamping */
+        r = _mm_packus_epi16(r0, r1);
+        g = _mm_packus_epi16(g0, g1);
+        b = _mm_packus_epi16(b0, b1);
+
+        _mm_storeu_si128((__m128i *) out, shuffle3_128(r, g, b, pack_24bit[0]));
+        _mm_storeu_si128((__m128i *) (out + 16), shuffle3_128(r, g, b, pack_24bit[1]));
+        _mm_storeu_si128((__m128i *) (out + 32), shuffle3_128(r, g, b, pack_24bit[2]));
+
+        in += 32;
+        out += 48;
+    }
+
+    uyvy8_to_rgb8_scalar(in, out, w - j);
+}
+
+static SSSE3 void uyvy8_to_yuv8_ssse3(const uint8_t *in, uint8_t *out, int w) {
+    __m128i a, b;
+    int j, k;
+
+    for (j = 0; j + 16 <= w; j += 16) {
+        a = _mm_loadu_si128((const __m128i *) in);
+        b = _mm_loadu_si128((const __m128i *) (in + 16));
+
+        for (k = 0; k < 3; k++) {
+            _mm_storeu_si128((__m128i *) (out + 16*k), _mm_or_si128(
+                _mm_shuffle_epi8(a, mask_128(uyvy_to_yuv[k][0])),
+                _mm_shuffle_epi8(b, mask_128(uyvy_to_yuv[k][1]))
+            ));
+        }
+
+        in += 32;
+        out += 48;
+    }
+
+    uyvy8_to_yuv8_scalar(in, out, w - j);
+}
+
+static SSSE3 void yuv8_to_uyvy8_ssse3(const uint8_t *in, uint8_t *out, int w) {
+    __m128i a, b, c;
+    int j;
+
+    for (j = 0; j + 16 <= w; j += 16) {
+        a = _mm_loadu_si128((const __m128i *) in);
+        b = _mm_loadu_si128((const __m128i *) (in + 16));
+        c = _mm_loadu_si128((const __m128i *) (in + 32));
+
+        pack_uyvy_128(shuffle3_128(a, b, c, unpack_24bit[0]),
+            shuffle3_128(a, b, c, unpack_24bit[1]),
+            shuffle3_128(a, b, c, unpack_24bit[2]), out);
+
+        in += 48;
+        out += 32;
+    }
+
+    yuv8_to_uyvy8_scalar(in, out, w - j);
+}
+
+static SSSE3 void bgra8_to_yuva8_ssse3(const uint8_t *in, uint8_t *out, int w) {
+    __m128i s0, s1, s2, s3, t0, t1, t2, t3;
+    __m128i y, u, v, a, yu, va;
+    __m128i planes = mask_128(bgra_to_planes);
+    int j;
+
+    for (j = 0; j + 16 <= w; j += 16) {
+        s0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) in), planes);
+        s1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (in + 16)), planes);
+        s2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (in + 32)), planes);
+        s3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (in + 48)), planes);
+
+        /* 4x4 transpose of 32-bit groups leaves one channel per register */
+        t0 = _mm_unpacklo_epi32(s0, s1);
+        t1 = _mm_unpacklo_epi32(s2, s3);
+        t2 = _mm_unpackhi_epi32(s0, s1);
+        t3 = _mm_unpackhi_epi32(s2, s3);
+
+        rgb_to_yuv_128(_mm_unpacklo_epi64(t2, t3), _mm_unpackhi_epi64(t0, t1),
+            _mm_unpacklo_epi64(t0, t1), &y, &u, &v);
+        a = _mm_unpackhi_epi64(t2, t3);
+
+        yu = _mm_unpacklo_epi8(y, u);
+        va = _mm_unpacklo_epi8(v, a);
+        _mm_storeu_si128((__m128i *) out, _mm_unpacklo_epi16(yu, va));
+        _mm_storeu_si128((__m128i *) (out + 16), _mm_unpackhi_epi16(yu, va));
+
+        yu = _mm_unpackhi_epi8(y, u);
+        va = _mm_unpackhi_epi8(v, a);
+        _mm_storeu_si128((__m128i *) (out + 32), _mm_unpacklo_epi16(yu, va));
+        _mm_storeu_si128((__m128i *) (out + 48), _mm_unpackhi_epi16(yu, va));
+
+        in += 64;
+        out += 64;
+    }
+
+    bgra8_to_yuva8_scalar(in, out, w - j);
+}
+
+/* dst * a' / 256 for 8 bytes in 16-bit lanes */
+static SSSE3 inline __m128i scale_by_alpha_128(__m128i d, __m128i a) {
+    a = _mm_add_epi16(a, _mm_srli_epi16(a, 7));
+    return _mm_srli_epi16(_mm_mullo_epi16(d, a), 8);
+}
+
+static SSSE3 void blend_premultiplied_ssse3(uint8_t *dst, const uint8_t *color,
+        const uint8_t *alpha, int n) {
+    __m128i zero = _mm_setzero_si128( );
+    __m128i d, a, t;
+    int j;
+
+    for (j = 0; j + 16 <= n; j += 16) {
+        d = _mm_loadu_si128((const __m128i *) dst);
+        a = _mm_loadu_si128((const __m128i *) alpha);
+
+        t = _mm_packus_epi16(
+            scale_by_alpha_128(_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(a, zero)),
+            scale_by_alpha_128(_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(a, zero))
+        );
+        d = _mm_add_epi8(_mm_loadu_si128((const __m128i *) color), _mm_sub_epi8(d, t));
+        _mm_storeu_si128((__m128i *) dst, d);
+
+        dst += 16;
+        color += 16;
+        alpha += 16;
+    }
+
+    blend_premultiplied_scalar(dst, color, alpha, n - j);
+}
+
+/* a * (256 - weight) + b * weight + 128, then / 256, in 16-bit lanes */
+static SSSE3 inline __m128i mix_epi16_128(__m128i a, __m128i b,
+        __m128i wa, __m128i wb) {
+    __m128i sum = _mm_add_epi16(_mm_mullo_epi16(a, wa), _mm_mullo_epi16(b, wb));
+    return _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(128)), 8);
+}
+
+static SSSE3 void mix_ssse3(const uint8_t *a, const uint8_t *b, uint8_t *out,
+        int n, int weight) {
+    __m128i zero = _mm_setzero_si128( );
+    __m128i wa = _mm_set1_epi16(256 - weight);
+    __m128i wb = _mm_set1_epi16(weight);
+    __m128i x, y;
+    int j;
+
+    for (j = 0; j + 16 <= n; j += 16) {
+        x = _mm_loadu_si128((const __m128i *) a);
+        y = _mm_loadu_si128((const __m128i *) b);
+
+        _mm_storeu_si128((__m128i *) out, _mm_packus_epi16(
+            mix_epi16_128(_mm_unpacklo_epi8(x, zero), _mm_unpacklo_epi8(y, zero), wa, wb),
+            mix_epi16_128(_mm_unpackhi_epi8(x, zero), _mm_unpackhi_epi8(y, zero), wa, wb)
+        ));
+
+        a += 16;
+        b += 16;
+        out += 16;
+    }
+
+    mix_scalar(a, b, out, n - j, weight);
+}
+
+static SSSE3 unsigned int sad_ssse3(const uint8_t *a, int a_pitch,
+        const uint8_t *b, int b_pitch, int n, int rows) {
+    __m128i sum = _mm_setzero_si128( );
+    unsigned int tail = 0;
+    int j, r;
+
+    for (r = 0; r < rows; r++) {
+        for (j = 0; j + 16 <= n; j += 16) {
+            sum = _mm_add_epi64(sum, _mm_sad_epu8(
+                _mm_loadu_si128((const __m128i *) (a + j)),
+                _mm_loadu_si128((const __m128i *) (b + j))));
+        }
+        if (j < n) {
+            tail += sad_scalar(a + j, 0, b + j, 0, n - j, 1);
+        }
+        a += a_pitch;
+        b += b_pitch;
+    }
+
+    return _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8)) + tail;
+}
+
+static const struct convert_kernels ssse3_kernels = {
+    "ssse3",
+    rgb8_to_uyvy8_ssse3,
+    uyvy8_to_rgb8_ssse3,
+    uyvy8_to_yuv8_ssse3,
+    yuv8_to_uyvy8_ssse3,
+    bgra8_to_yuva8_ssse3,
+    blend_premultiplied_ssse3,
+    mix_ssse3,
+    sad_ssse3
+};
+
+/*
+ * 256-bit (AVX2) kernels, 32 pixels per iteration. AVX2 shuffles and
+ * packs work within each 128-bit half, so the low half of every register
+ * carries the first 16 pixels and the high half the next 16, and the
+ * 128-bit algorithm above runs on both at once.
+ *
+ * Each one finishes its line with the SSSE3 version, which is plain SSE
+ * code, so clear the upper halves first: otherwise every call pays for
+ * an AVX-to-SSE state transition, which swamps short lines.
+ */
+
+static AVX2 inline __m256i mask_256(const int8_t *mask) {
+    return _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) mask));
+}
+
+/* lo goes in the low half, hi in the high half */
+static AVX2 inline __m256i load_halves(const uint8_t *lo, const uint8_t *hi) {
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(
+        _mm_loadu_si128((const __m128i *) lo)),
+        _mm_loadu_si128((const __m128i *) hi), 1);
+}
+
+static AVX2 inline void store_halves(uint8_t *lo, uint8_t *hi, __m256i x) {
+    _mm_storeu_si128((__m128i *) lo, _mm256_castsi256_si128(x));
+    _mm_storeu_si128((__m128i *) hi, _mm256_extracti128_si256(x, 1));
+}
+
+static AVX2 inline __m256i div256_epi16_256(__m256i x) {
+    __m256i bias = _mm256_and_si256(_mm256_srai_epi16(x, 15), _mm256_set1_epi16(255));
+    return _mm256_srai_epi16(_mm256_add_epi16(x, bias), 8);
+}
+
+static AVX2 inline __m256i div256_epi32_256(__m256i x) {
+    __m256i bias = _mm256_and_si256(_mm256_srai_epi32(x, 31), _mm256_set1_epi32(255));
+    return _mm256_srai_epi32(_mm256_add_epi32(x, bias), 8);
+}
+
+static AVX2 inline __m256i shuffle3_256(__m256i a, __m256i b, __m256i c,
+        const int8_t masks[3][16]) {
+    return _mm256_or_si256(
+        _mm256_or_si256(_mm256_shuffle_epi8(a, mask_256(masks[0])),
+            _mm256_shuffle_epi8(b, mask_256(masks[1]))),
+        _mm256_shuffle_epi8(c, mask_256(masks[2]))
+    );
+}
+
+static AVX2 inline void rgb_to_yuv_epi16_256(__m256i r, __m256i g, __m256i b,
+        __m256i *y, __m256i *u, __m256i *v) {
+    *y = _mm256_add_epi16(_mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(
+        _mm256_mullo_epi16(r, _mm256_set1_epi16(66)),
+        _mm256_mullo_epi16(g, _mm256_set1_epi16(129))),
+        _mm256_mullo_epi16(b, _mm256_set1_epi16(25))), 8), _mm256_set1_epi16(16));
+
+    *u = _mm256_add_epi16(div256_epi16_256(_mm256_sub_epi16(_mm256_sub_epi16(
+        _mm256_mullo_epi16(b, _mm256_set1_epi16(112)),
+        _mm256_mullo_epi16(g, _mm256_set1_epi16(74))),
+        _mm256_mullo_epi16(r, _mm256_set1_epi16(37)))), _mm256_set1_epi16(128));
+
+    *v = _mm256_add_epi16(div256_epi16_256(_mm256_sub_epi16(_mm256_sub_epi16(
+        _mm256_mullo_epi16(r, _mm256_set1_epi16(112)),
+        _mm256_mullo_epi16(g, _mm256_set1_epi16(94))),
+        _mm256_mullo_epi16(b, _mm256_set1_epi16(18)))), _mm256_set1_epi16(128));
+}
+
+static AVX2 inline void rgb_to_yuv_256(__m256i r, __m256i g, __m256i b,
+        __m256i *y, __m256i *u, __m256i *v) {
+    __m256i zero = _mm256_setzero_si256( );
+    __m256i y0, u0, v0, y1, u1, v1;
+
+    rgb_to_yuv_epi16_256(_mm256_unpacklo_epi8(r, zero), _mm256_unpacklo_epi8(g, zero),
+        _mm256_unpacklo_epi8(b, zero), &y0, &u0, &v0);
+    rgb_to_yuv_epi16_256(_mm256_unpackhi_epi8(r, zero), _mm256_unpackhi_epi8(g, zero),
+        _mm256_unpackhi_epi8(b, zero), &y1, &u1, &v1);
+
+    *y = _mm256_packus_epi16(y0, y1);
+    *u = _mm256_packus_epi16(u0, u1);
+    *v = _mm256_packus_epi16(v0, v1);
+}
+
+/* out gets the UYVY for the low half's 16 pixels, then the high half's */
+static AVX2 inline void pack_uyvy_256(__m256i y, __m256i u, __m256i v, uint8_t *out) {
+    __m256i lo_bytes = _mm256_set1_epi16(0x00ff);
+    __m256i us = _mm256_srli_epi16(_mm256_add_epi16(_mm256_and_si256(u, lo_bytes),
+        _mm256_srli_epi16(u, 8)), 1);
+    __m256i vs = _mm256_srli_epi16(_mm256_add_epi16(_mm256_and_si256(v, lo_bytes),
+        _mm256_srli_epi16(v, 8)), 1);
+    __m256i uv = _mm256_or_si256(us, _mm256_slli_epi16(vs, 8));
+
+    store_halves(out, out + 32, _mm256_unpacklo_epi8(uv, y));
+    store_halves(out + 16, out + 48, _mm256_unpackhi_epi8(uv, y));
+}
+
+static AVX2 inline void yuv_pairs_to_rgb_256(__m256i yu, __m256i yv,
+        __m256i *r, __m256i *g, __m256i *b) {
+    *r = _mm256_sub_epi32(_mm256_srai_epi32(
+        _mm256_madd_epi16(yv, _mm256_setr_epi16(298, 409, 298, 409, 298, 409, 298, 409,
+            298, 409, 298, 409, 298, 409, 298, 409)), 8),
+        _mm256_set1_epi32(223));
+    *g = _mm256_add_epi32(div256_epi32_256(_mm256_add_epi32(
+        _mm256_madd_epi16(yu, _mm256_setr_epi16(298, -100, 298, -100, 298, -100, 298, -100,
+            298, -100, 298, -100, 298, -100, 298, -100)),
+        _mm256_madd_epi16(yv, _mm256_setr_epi16(0, -208, 0, -208, 0, -208, 0, -208,
+            0, -208, 0, -208, 0, -208, 0, -208)))),
+        _mm256_set1_epi32(135));
+    *b = _mm256_sub_epi32(_mm256_srai_epi32(
+        _mm256_madd_epi16(yu, _mm256_setr_epi16(298, 516, 298, 516, 298, 516, 298, 516,
+            298, 516, 298, 516, 298, 516, 298, 516)), 8),
+        _mm256_set1_epi32(277));
+}
+
+static AVX2 inline void uyvy_to_rgb_epi16_256(__m256i in,
+        __m256i *r, __m256i *g, __m256i *b) {
+    __m256i r0, g0, b0, r1, g1, b1;
+
+    yuv_pairs_to_rgb_256(_mm256_shuffle_epi8(in, mask_256(uyvy_to_pairs[0][0])),
+        _mm256_shuffle_epi8(in, mask_256(uyvy_to_pairs[0][1])), &r0, &g0, &b0);
+    yuv_pairs_to_rgb_256(_mm256_shuffle_epi8(in, mask_256(uyvy_to_pairs[1][0])),
+        _mm256_shuffle_epi8(in, mask_256(uyvy_to_pairs[1][1])), &r1, &g1, &b1);
+
+    *r = _mm256_packs_epi32(r0, r1);
+    *g = _mm256_packs_epi32(g0, g1);
+    *b = _mm256_packs_epi32(b0, b1);
+}
+
+static AVX2 void rgb8_to_uyvy8_avx2(const uint8_t *in, uint8_t *out, int w) {
+    __m256i a, b, c, y, u, v;
+    int j;
+
+    for (j = 0; j + 32 <= w; j += 32) {
+        a = load_halves(in, in + 48);
+        b = load_halves(in + 16, in + 64);
+        c = load_halves(in + 32, in + 80);
+
+        rgb_to_yuv_256(shuffle3_256(a, b, c, unpack_24bit[0]),
+            shuffle3_256(a, b, c, unpack_24bit[1]),
+            shuffle3_256(a, b, c, unpack_24bit[2]), &y, &u, &v);
+        pack_uyvy_256(y, u, v, out);
+
+        in += 96;
+        out += 64;
+    }
+
+    _mm256_zeroupper( );
+    rgb8_to_uyvy8_ssse3(in, out, w - j);
+}
+
+static AVX2 void uyvy8_to_rgb8_avx2(const uint8_t *in, uint8_t *out, int w) {
+    __m256i r0, g0, b0, r1, g1, b1, r, g, b;
+    int j;
+
+    for (j = 0; j + 32 <= w; j += 32) {
+        uyvy_to_rgb_epi16_256(load_halves(in, in + 32), &r0, &g0, &b0);
+        uyvy_to_rgb_epi16_256(load_halves(in + 16, in + 48), &r1, &g1, &b1);
+
+        r = _mm256_packus_epi16(r0, r1);
+        g = _mm256_packus_epi16(g0, g1);
+        b = _mm256_packus_epi16(b0, b1);
+
+        store_halves(out, out + 48, shuffle3_256(r, g, b, pack_24bit[0]));
+        store_halves(out + 16, out + 64, shuffle3_256(r, g, b, pack_24bit[1]));
+        store_halves(out + 32, out + 80, shuffle3_256(r, g, b, pack_24bit[2]));
+
+        in += 64;
+        out += 96;
+    }
+
+    _mm256_zeroupper( );
+    uyvy8_to_rgb8_ssse3(in, out, w - j);
+}
+
+static AVX2 void uyvy8_to_yuv8_avx2(const uint8_t *in, uint8_t *out, int w) {
+    __m256i a, b;
+    int j, k;
+
+    for (j = 0; j + 32 <= w; j += 32) {
+        a = load_halves(in, in + 32);
+        b = load_halves(in + 16, in + 48);
+
+        for (k = 0; k < 3; k++) {
+            store_halves(out + 16*k, out + 48 + 16*k, _mm256_or_si256(
+                _mm256_shuffle_epi8(a, mask_256(uyvy_to_yuv[k][0])),
+                _mm256_shuffle_epi8(b, mask_256(uyvy_to_yuv[k][1]))
+            ));
+        }
+
+        in += 64;
+        out += 96;
+    }
+
+    _mm256_zeroupper( );
+    uyvy8_to_yuv8_ssse3(in, out, w - j);
+}
+
+static AVX2 void yuv8_to_uyvy8_avx2(const uint8_t *in, uint8_t *out, int w) {
+    __m256i a, b, c;
+    int j;
+
+    for (j = 0; j + 32 <= w; j += 32) {
+        a = load_halves(in, in + 48);
+        b = load_halves(in + 16, in + 64);
+        c = load_halves(in + 32, in + 80);
+
+        pack_uyvy_256(shuffle3_256(a, b, c, unpack_24bit[0]),
+            shuffle3_256(a, b, c, unpack_24bit[1]),
+            shuffle3_256(a, b, c, unpack_24bit[2]), out);
+
+        in += 96;
+        out += 64;
+    }
+
+    _mm256_zeroupper( );
+    yuv8_to_uyvy8_ssse3(in, out, w - j);
+}
+
+static AVX2 void bgra8_to_yuva8_avx2(const uint8_t *in, uint8_t *out, int w) {
+    __m256i s0, s1, s2, s3, t0, t1, t2, t3;
+    __m256i y, u, v, a, yu, va;
+    __m256i planes = mask_256(bgra_to_planes);
+    int j;
+
+    for (j = 0; j + 32 <= w; j += 32) {
+        s0 = _mm256_shuffle_epi8(load_halves(in, in + 64), planes);
+        s1 = _mm256_shuffle_epi8(load_halves(in + 16, in + 80), planes);
+        s2 = _mm256_shuffle_epi8(load_halves(in + 32, in + 96), planes);
+        s3 = _mm256_shuffle_epi8(load_halves(in + 48, in + 112), planes);
+
+        t0 = _mm256_unpacklo_epi32(s0, s1);
+        t1 = _mm256_unpacklo_epi32(s2, s3);
+        t2 = _mm256_unpackhi_epi32(s0, s1);
+        t3 = _mm256_unpackhi_epi32(s2, s3);
+
+        rgb_to_yuv_256(_mm256_unpacklo_epi64(t2, t3), _mm256_unpackhi_epi64(t0, t1),
+            _mm256_unpacklo_epi64(t0, t1), &y, &u, &v);
+        a = _mm256_unpackhi_epi64(t2, t3);
+
+        yu = _mm256_unpacklo_epi8(y, u);
+        va = _mm256_unpacklo_epi8(v, a);
+        store_halves(out, out + 64, _mm256_unpacklo_epi16(yu, va));
+        store_halves(out + 16, out + 80, _mm256_unpackhi_epi16(yu, va));
+
+        yu = _mm256_unpackhi_epi8(y, u);
+        va = _mm256_unpackhi_epi8(v, a);
+        store_halves(out + 32, out + 96, _mm256_unpacklo_epi16(yu, va));
+        store_halves(out + 48, out + 112, _mm256_unpackhi_epi16(yu, va));
+
+        in += 128;
+        out += 128;
+    }
+
+    _mm256_zeroupper( );
+    bgra8_to_yuva8_ssse3(in, out, w - j);
+}
+
+static AVX2 inline __m256i scale_by_alpha_256(__m256i d, __m256i a) {
+    a = _mm256_add_epi16(a, _mm256_srli_epi16(a, 7));
+    return _mm256_srli_epi16(_mm256_mullo_epi16(d, a), 8);
+}
+
+/* bytewise, so the in-lane unpack and pack put everything back in order */
+static AVX2 void blend_premultiplied_avx2(uint8_t *dst, const uint8_t *color,
+        const uint8_t *alpha, int n) {
+    __m256i zero = _mm256_setzero_si256( );
+    __m256i d, a, t;
+    int j;
+
+    for (j = 0; j + 32 <= n; j += 32) {
+        d = _mm256_loadu_si256((const __m256i *) dst);
+        a = _mm256_loadu_si256((const __m256i *) alpha);
+
+        t = _mm256_packus_epi16(
+            scale_by_alpha_256(_mm256_unpacklo_epi8(d, zero), _mm256_unpacklo_epi8(a, zero)),
+            scale_by_alpha_256(_mm256_unpackhi_epi8(d, zero), _mm256_unpackhi_epi8(a, zero))
+        );
+        d = _mm256_add_epi8(_mm256_loadu_si256((const __m256i *) color), 
+            _mm256_sub_epi8(d, t));
+        _mm256_storeu_si256((__m256i *) dst, d);
+
+        dst += 32;
+        color += 32;
+        alpha += 32;
+    }
+
+    _mm256_zeroupper( );
+    blend_premultiplied_ssse3(dst, color, alpha, n - j);
+}
+
+static AVX2 inline __m256i mix_epi16_256(__m256i a, __m256i b,
+        __m256i wa, __m256i wb) {
+    __m256i sum = _mm256_add_epi16(_mm256_mullo_epi16(a, wa), _mm256_mullo_epi16(b, wb));
+    return _mm256_srli_epi16(_mm256_add_epi16(sum, _mm256_set1_epi16(128)), 8);
+}
+
+static AVX2 void mix_avx2(const uint8_t *a, const uint8_t *b, uint8_t *out,
+        int n, int weight) {
+    __m256i zero = _mm256_setzero_si256( );
+    __m256i wa = _mm256_set1_epi16(256 - weight);
+    __m256i wb = _mm256_set1_epi16(weight);
+    __m256i x, y;
+    int j;
+
+    for (j = 0; j + 32 <= n; j += 32) {
+        x = _mm256_loadu_si256((const __m256i *) a);
+        y = _mm256_loadu_si256((const __m256i *) b);
+
+        _mm256_storeu_si256((__m256i *) out, _mm256_packus_epi16(
+            mix_epi16_256(_mm256_unpacklo_epi8(x, zero), _mm256_unpacklo_epi8(y, zero), wa, wb),
+            mix_epi16_256(_mm256_unpackhi_epi8(x, zero), _mm256_unpackhi_epi8(y, zero), wa, wb)
+        ));
+
+        a += 32;
+        b += 32;
+        out += 32;
+    }
+
+    _mm256_zeroupper( );
+    mix_ssse3(a, b, out, n - j, weight);
+}
+
+static AVX2 unsigned int sad_avx2(const uint8_t *a, int a_pitch,
+        const uint8_t *b, int b_pitch, int n, int rows) {
+    __m256i sum = _mm256_setzero_si256( );
+    __m128i half;
+    unsigned int tail = 0;
+    int j, r;
+
+    for (r = 0; r < rows; r++) {
+        for (j = 0; j + 32 <= n; j += 32) {
+            sum = _mm256_add_epi64(sum, _mm256_sad_epu8(
+                _mm256_loadu_si256((const __m256i *) (a + j)),
+                _mm256_loadu_si256((const __m256i *) (b + j))));
+        }
+        if (j + 16 <= n) {
+            half = _mm_sad_epu8(_mm_loadu_si128((const __m128i *) (a + j)),
+                _mm_loadu_si128((const __m128i *) (b + j)));
+            sum = _mm256_add_epi64(sum, _mm256_inserti128_si256(_mm256_setzero_si256( ), half, 0));
+            j += 16;
+        }
+        if (j < n) {
+            tail += sad_scalar(a + j, 0, b + j, 0, n - j, 1);
+        }
+        a += a_pitch;
+        b += b_pitch;
+    }
+
+    half = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    return _mm_cvtsi128_si32(half) + _mm_cvtsi128_si32(_mm_srli_si128(half, 8)) + tail;
+}
+
+static const struct convert_kernels avx2_kernels = {
+    "avx2",
+    rgb8_to_uyvy8_avx2,
+    uyvy8_to_rgb8_avx2,
+    uyvy8_to_yuv8_avx2,
+    yuv8_to_uyvy8_avx2,
+    bgra8_to_yuva8_avx2,
+    blend_premultiplied_avx2,
+    mix_avx2,
+    sad_avx2
+};
+
+#endif
+
+static const struct convert_kernels **probe_kernels(void) {
+    static const struct convert_kernels *available[4];
+    int n = 0;
+
+    available[n++] = &scalar_kernels;
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init( );
+    if (__builtin_cpu_supports("ssse3")) {
+        available[n++] = &ssse3_kernels;
+        /* AVX2 kernels finish each line with the SSSE3 ones */
+        if (__builtin_cpu_supports("avx2")) {
+            available[n++] = &avx2_kernels;
+        }
+    }
+#endif
+    available[n] = NULL;
+
+    return available;
+}
+
+const struct convert_kernels **convert_kernels_available(void) {
+    static const struct convert_kernels **available = probe_kernels( );
+    return available;
+}
+
+const struct convert_kernels *convert_kernels_best(void) {
+    static const struct convert_kernels *best = NULL;
+    const struct convert_kernels **available;
+
+    if (best == NULL) {
+        /* the last one is the fastest */
+        available = convert_kernels_available( );
+        while (available[1] != NULL) {
+            available++;
+        }
+        best = *available;
+    }
+
+    return best;
+}
@@ -0,0 +1,54 @@
+#ifndef _PICTURE_CONVERT_H
+#define _PICTURE_CONVERT_H
+
+#include <stdint.h>
+
+/*
+ * Per-scanline colorspace conversion (and overlay blending) kernels used
+ * by Picture. w is the width in pixels. Every set gives bit-identical
+ * output to the scalar one; the SIMD sets just handle the bulk of each
+ * line 16 or 32 pixels at a time and leave the ragged end to the scalar
+ * code.
+ */
+typedef void (*convert_line_fn)(const uint8_t *in, uint8_t *out, int w);
+
+/*
+ * Composite n bytes of a premultiplied overlay (see picture.h) onto dst:
+ * dst = color + dst - dst * a' / 256, where a' is alpha scaled to 0-256.
+ */
+typedef void (*blend_line_fn)(uint8_t *dst, const uint8_t *color,
+    const uint8_t *alpha, int n);
+
+/*
+ * Weighted average of n bytes, for frame interpolation:
+ * out = (a * (256 - weight) + b * weight + 128) / 256, weight 0-256.
+ */
+typedef void (*mix_line_fn)(const uint8_t *a, const uint8_t *b, uint8_t *out,
+    int n, int weight);
+
+/*
+ * Sum of absolute differences between two blocks of n bytes by rows
+ * lines, for motion search. The pitches are in bytes.
+ */
+typedef unsigned int (*sad_block_fn)(const uint8_t *a, int a_pitch,
+    const uint8_t *b, int b_pitch, int n, int rows);
+
+struct convert_kernels {
+    const char *name;
+    convert_line_fn rgb8_to_uyvy8;
+    convert_line_fn uyvy8_to_rgb8;
+    convert_line_fn uyvy8_to_yuv8;
+    convert_line_fn yuv8_to_uyvy8;
+    convert_line_fn bgra8_to_yuva8;
+    blend_line_fn blend_premultiplied;
+    mix_line_fn mix;
+    sad_block_fn sad;
+};
+
+/* the fastest set this CPU can run (decided once, on first call) */
+const struct convert_kernels *convert_kernels_best(void);
+
+/* every set this CPU can run, scalar first, NULL terminated */
+const struct convert_kernels **convert_kernels_available(void);
+
+#endif
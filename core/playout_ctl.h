@@ -1,8 +1,13 @@
 #ifndef _PLAYOUT_CTL_H
 #define _PLAYOUT_CTL_H
 
+#include <stddef.h>
+
 #define MAX_CHANNELS 64
 
+/* playout channels (program outputs) one playoutd can run */
+#define MAX_PLAYOUT_CHANNELS 8
+
 /*
  * This file defines the format of the messages used to control
  * the playout daemons.
@@ -30,14 +35,25 @@ struct playout_command {
     float new_speed;
 
     int marks[MAX_CHANNELS];
+
+    int channel;    /* which playout channel this is for */
 };
 
+/*
+ * Commands from before there were playout channels stop short of the
+ * channel field. playoutd still takes those, and sends them to channel 0.
+ */
+#define PLAYOUT_COMMAND_V1_SIZE offsetof(struct playout_command, channel)
+
+/* each channel sends its own */
 struct playout_status {
     int timecode;
     int active_source;
     int valid;
     bool clock_on;
     bool dsk_on;
+
+    int channel;
 };
 
 #endif
@@ -13,6 +13,7 @@
 
 #include <getopt.h>
 #include <ctype.h>
+#include <math.h>
 
 #include "mmap_buffer.h"
 #include "mjpeg_config.h"
@@ -21,37 +22,61 @@
 #include "output_adapter.h"
 
 #include "mjpeg_frame.h"
+#include "video_mode.h"
+#include "clock_overlay.h"
+#include "frame_interp.h"
+#include "frame_cache.h"
 
 #include "thread.h"
+#include "mutex.h"
+#include "condition.h"
 
 #include <vector>
+#include <list>
 
+/* shared by every playout channel */
 MmapBuffer *buffers[MAX_CHANNELS];
-int marks[MAX_CHANNELS];
 int auto_dsk_presets[MAX_CHANNELS];
 
-float play_offset;
+/* what to show between fields in slow motion */
+enum interpolation_mode {
+    INTERP_FIELDS,      /* nearest field, line doubled */
+    INTERP_BLEND,       /* crossfade the two nearest fields */
+    INTERP_MOTION       /* motion compensated between them */
+};
 
-int status_socket_fd;
+enum interpolation_mode interpolation = INTERP_FIELDS;
 
-int playout_source = 0;
-bool did_cut = false;
-bool paused = false;
-bool step = false;
-bool step_backward = false;
-bool run_backward = false;
-float playout_speed;
-bool overlay_clock = false;
+/* decoded frames, for paused, reverse and scrubbing playout (NULL if off) */
+#define DEFAULT_CACHE_MB 512
+FrameCache *frame_cache = NULL;
 
+/* whether a DSK is showing is up to each channel */
 struct DSK {
     Picture *overlay;
     int x, y;
-    bool active;
 };
 
 #define N_DSK_SLOTS 8
 struct DSK dsk_titles[N_DSK_SLOTS];
 
+/* 
+ * Everything one playout channel is doing. Only that channel's thread
+ * touches it.
+ */
+struct playout_state {
+    int marks[MAX_CHANNELS];
+    float play_offset;
+    int playout_source;
+    bool did_cut;
+    bool paused;
+    bool step;
+    bool step_backward;
+    float playout_speed;
+    bool overlay_clock;
+    bool dsk_active[N_DSK_SLOTS];
+};
+
 const char *dsk_files[] = {
     "instantreplay_title.png",
     "reverseangle_title.png",
@@ -66,7 +91,9 @@ const char *dsk_files[] = {
 #define EVT_PLAYOUT_COMMAND_RECEIVED 0x00000001
 class CommandReceiver : public Thread {
     public:
-        CommandReceiver(EventHandler *new_dest) : dest(new_dest) {
+        /* commands for channel n go to dests[n] */
+        CommandReceiver(EventHandler **new_dests, int new_n_dests) 
+                : dests(new_dests), n_dests(new_n_dests) {
             socket_setup( );
         }
 
@@ -98,18 +125,35 @@ class CommandReceiver : public Thread {
                 if (ret < 0) {
                     perror("recvfrom");
                     delete cmd;
-                } else if (ret < sizeof(struct playout_command)) {
+                } else if ((size_t) ret < PLAYOUT_COMMAND_V1_SIZE) {
                     fprintf(stderr, "received short command packet\n");
                     delete cmd;
                 } else {
-                    fprintf(stderr, "Got something\n");
-                    dest->post_event(EVT_PLAYOUT_COMMAND_RECEIVED, cmd);
+                    if ((size_t) ret < sizeof(struct playout_command)) {
+                        /* old client, only knows about the one channel */
+                        cmd->channel = 0;
+                    }
+
+                    if (cmd->channel < 0 || cmd->channel >= n_dests) {
+                        fprintf(stderr, "command for nonexistent channel %d\n",
+                            cmd->channel);
+                        delete cmd;
+                    } else {
+                        fprintf(stderr, "Got something\n");
+                        if (!dests[cmd->channel]->post_event(
+                                EVT_PLAYOUT_COMMAND_RECEIVED, cmd)) {
+                            fprintf(stderr, "channel %d command queue full\n",
+                                cmd->channel);
+                            delete cmd;
+                        }
+                    }
                 }
             }
         }
 
         int socket_fd;
-        EventHandler *dest;
+        EventHandler **dests;
+        int n_dests;
 };
 
 class StatusSocket {
@@ -140,7 +184,7 @@ class StatusSocket {
         struct sockaddr_in addr;
 };
 
-void update_auto_dsk(int new_source) {
+void update_auto_dsk(struct playout_state *st, int new_source) {
     int dsk = auto_dsk_presets[new_source];
     int j;
 
@@ -148,209 +192,674 @@ void update_auto_dsk(int new_source) {
         /* turn on the auto DSK and turn off all others */
         for (j = 0; j < N_DSK_SLOTS; j++) {
             if (j == dsk) {
-                dsk_titles[j].active = true;
+                st->dsk_active[j] = true;
             } else {
-                dsk_titles[j].active = false;
+                st->dsk_active[j] = false;
             }
         }
     }
 }
 
-OutputAdapter *out;
+/* 
+ * Get the start of a replay off the disk while it's still being cued.
+ * Every camera, since the operator may well cut between them.
+ */
+void prefetch_marks(struct playout_state *st) {
+    int direction = (st->playout_speed < 0) ? -1 : 1;
+    int j;
+
+    for (j = 0; j < MAX_CHANNELS && buffers[j] != NULL; j++) {
+        buffers[j]->prefetch(st->marks[j], CUE_PREFETCH_FRAMES, direction);
+    }
+}
 
-void parse_command(struct playout_command *cmd) {
+void parse_command(struct playout_state *st, struct playout_command *cmd) {
     switch(cmd->cmd) {
         case PLAYOUT_CMD_CUE:
-            did_cut = true;
-            paused = true;
-            playout_speed = cmd->new_speed;
-            memcpy(marks, cmd->marks, sizeof(marks));
-            play_offset = 0.0f;
-            playout_source = cmd->source;
-            update_auto_dsk(playout_source);
+            st->did_cut = true;
+            st->paused = true;
+            st->playout_speed = cmd->new_speed;
+            memcpy(st->marks, cmd->marks, sizeof(st->marks));
+            st->play_offset = 0.0f;
+            st->playout_source = cmd->source;
+            update_auto_dsk(st, st->playout_source);
+            prefetch_marks(st);
             break;
 
         case PLAYOUT_CMD_CUE_AND_GO:
-            did_cut = true;
-            paused = false;
-            playout_speed = cmd->new_speed;
-            memcpy(marks, cmd->marks, sizeof(marks));
-            play_offset = 0.0f;
-            playout_source = cmd->source;
-            update_auto_dsk(playout_source);
+            st->did_cut = true;
+            st->paused = false;
+            st->playout_speed = cmd->new_speed;
+            memcpy(st->marks, cmd->marks, sizeof(st->marks));
+            st->play_offset = 0.0f;
+            st->playout_source = cmd->source;
+            update_auto_dsk(st, st->playout_source);
+            prefetch_marks(st);
             break;
 
         case PLAYOUT_CMD_ADJUST_SPEED:
-            playout_speed = cmd->new_speed;
+            st->playout_speed = cmd->new_speed;
             break;
 
         case PLAYOUT_CMD_CUT_REWIND:
-            play_offset = 0.0f;
+            st->play_offset = 0.0f;
             // fall through to the cut...
         case PLAYOUT_CMD_CUT:
-            playout_source = cmd->source;
-            update_auto_dsk(playout_source);
-            did_cut = true;
+            st->playout_source = cmd->source;
+            update_auto_dsk(st, st->playout_source);
+            st->did_cut = true;
             break;
         
         case PLAYOUT_CMD_PAUSE:
-            paused = true;
+            st->paused = true;
             break;
 
         case PLAYOUT_CMD_RESUME:
-            paused = false;
+            st->paused = false;
             break;
 
         case PLAYOUT_CMD_STEP_FORWARD:
-            step = true;
+            st->step = true;
             break;
 
         case PLAYOUT_CMD_STEP_BACKWARD:
-            step_backward = true;
+            st->step_backward = true;
             break;
 
         case PLAYOUT_CMD_CLOCK_TOGGLE:
-            overlay_clock = !overlay_clock;
+            st->overlay_clock = !st->overlay_clock;
             break;
 
         case PLAYOUT_CMD_CLOCK_ON:
-            overlay_clock = true;
+            st->overlay_clock = true;
             break;
 
         case PLAYOUT_CMD_CLOCK_OFF:
-            overlay_clock = false;
+            st->overlay_clock = false;
             break;
 
         case PLAYOUT_CMD_DSK_TOGGLE:
             if (cmd->source < N_DSK_SLOTS) {
-                dsk_titles[cmd->source].active = !dsk_titles[cmd->source].active;
+                st->dsk_active[cmd->source] = !st->dsk_active[cmd->source];
             }
             break;
 
         case PLAYOUT_CMD_DSK_ON:
             if (cmd->source < N_DSK_SLOTS) {
-                dsk_titles[cmd->source].active = true;
+                st->dsk_active[cmd->source] = true;
             }
             break;
 
         case PLAYOUT_CMD_DSK_OFF:
             if (cmd->source < N_DSK_SLOTS) {
-                dsk_titles[cmd->source].active = false;
+                st->dsk_active[cmd->source] = false;
             }
             break;
 
     }
 
-    fprintf(stderr, "source is now... %d\n", playout_source);
+    fprintf(stderr, "channel %d source is now... %d\n", cmd->channel, 
+        st->playout_source);
 }
 
 
-class Renderer {
-    protected:
-        typedef std::vector<struct DSK *> dsk_list_t;
-        dsk_list_t dsks;
+/* how a render job gets its picture out of the JPEG */
+enum render_field {
+    FIELD_FULL,             /* whole frame */
+    FIELD_FIRST_DOUBLED,    /* first field, line doubled */
+    FIELD_SECOND_DOUBLED    /* second field, line doubled */
+};
 
+/*
+ * One output frame, worked out by the main thread from the playout state
+ * at the time it was queued, then decoded and composited by a worker.
+ */
+struct render_job {
+    int source;
+    timecode_t frame_no;
+    enum render_field field;
+    int weight;             /* 1-255: interpolate toward the next field */
+    bool clock;
+    bool dsk_active[N_DSK_SLOTS];
+    float offset;           /* play_offset this frame was taken from */
+
+    bool started, done, cancelled;
+    Picture *result;        /* NULL if the decode failed */
+};
+
+#define DEFAULT_RENDER_THREADS 2
+#define DEFAULT_RENDER_AHEAD 4
+#define MAX_RENDER_THREADS 16
+#define MAX_RENDER_AHEAD 32
+
+class RenderWorker;
+
+/*
+ * Decode-ahead renderer. The main thread queues up to lookahead frames
+ * past the one on air, following the current speed and direction, and a
+ * pool of workers decodes and composites them in parallel. Finished
+ * frames come back out in the order they were queued, so a slow JPEG
+ * only costs us if the whole pool falls behind. Any playout command
+ * throws away everything queued and rewinds to the frame after the one
+ * on air, so cues and cuts still show up on the very next frame.
+ */
+class Renderer {
     public:
-        Renderer( ) {
-            frame = (struct mjpeg_frame *) malloc(MAX_FRAME_SIZE);
-            if (frame == NULL) {
-                throw std::runtime_error("Renderer: failed to allocate storage");
-            }
-            clock_bg = Picture::from_png("hb3_replayclock.png");
+        /* renders for the channel whose state is st */
+        Renderer(struct playout_state *st_, ClockOverlay *clock_) 
+                : st(st_), clock(clock_) {
+            lookahead = DEFAULT_RENDER_AHEAD;
+            shown_offset = 0.0f;
         }
 
-        ~Renderer( ) {
-            free(frame);
+        void set_lookahead(int frames) {
+            lookahead = frames;
         }
 
-        void add_dsk(struct DSK *dsk) {
-            dsks.push_back(dsk);    
+        void start_workers(int n);
+
+        /* queue jobs until we're lookahead frames ahead (channel thread only) */
+        void fill(void) {
+            /* nothing to gain by decoding the same still frame over and over */
+            unsigned int depth = st->paused ? 1 : lookahead;
+
+            MutexLock lock(mut);
+            while (jobs.size( ) < depth) {
+                struct render_job *job = new struct render_job;
+                plan(job);
+                jobs.push_back(job);
+            }
+            job_queued.broadcast( );
         }
 
-        Picture *render_next_frame(void) {
-            size_t frame_size;
-            timecode_t frame_no;
-            uint32_t clock_value;
+        /*
+         * Take the oldest queued frame, waiting for it if need be.
+         * Returns NULL if it could not be decoded.
+         */
+        Picture *next_frame(void) {
+            struct render_job *job;
+            Picture *result;
 
-            Picture *decoded;
-            Picture *clock_image;
-
-            // Advance all streams one frame. Only decode on the one we care about.
-            // (if nothing's open, this fails by design...)
-            frame_size = MAX_FRAME_SIZE;                
-            frame_no = marks[playout_source] + play_offset; // round to nearest whole frame
-
-            if (buffers[playout_source]->get(frame, &frame_size, frame_no)) {
-                try {
-                    if (playout_speed <= 0.8 || paused) {
-                        // decode and scan double a field if we can get it
-                        // (should get better temporal resolution on slow motion playout)
-                        if (play_offset - floorf(play_offset) < 0.5) {
-                            decoded = mjpeg_decoder.decode_first_doubled(frame);
-                        } else {
-                            decoded = mjpeg_decoder.decode_second_doubled(frame);
-                        }
-                    } else {
-                        decoded = mjpeg_decoder.decode_full(frame);
+            MutexLock lock(mut);
+            if (jobs.empty( )) {
+                return NULL;
+            }
+
+            job = jobs.front( );
+            while (!job->done) {
+                job_done.wait(mut);
+            }
+            jobs.pop_front( );
+
+            shown_offset = job->offset;
+            result = job->result;
+            delete job;
+            return result;
+        }
+
+        /*
+         * Drop every queued frame and rewind play_offset to the first of
+         * them, so the next command applies right after what's on air.
+         * Jobs a worker is still busy with get cleaned up by that worker.
+         */
+        void invalidate(void) {
+            MutexLock lock(mut);
+            job_list_t::iterator i;
+
+            if (!jobs.empty( )) {
+                st->play_offset = jobs.front( )->offset;
+            }
+
+            for (i = jobs.begin( ); i != jobs.end( ); i++) {
+                struct render_job *job = *i;
+                if (job->started && !job->done) {
+                    job->cancelled = true;
+                } else {
+                    if (job->result != NULL) {
+                        Picture::free(job->result);
                     }
+                    delete job;
+                }
+            }
+
+            jobs.clear( );
+        }
+
+        /* play_offset of the frame most recently taken by next_frame */
+        float shown_offset;
+
+    protected:
+        typedef std::list<struct render_job *> job_list_t;
+
+        /* take the next frame from the playout state (call with mut held) */
+        void plan(struct render_job *job) {
+            int i;
+
+            job->source = st->playout_source;
+            // round to nearest whole frame
+            job->frame_no = st->marks[st->playout_source] + st->play_offset;
+            job->offset = st->play_offset;
+            job->clock = st->overlay_clock;
+            for (i = 0; i < N_DSK_SLOTS; i++) {
+                job->dsk_active[i] = st->dsk_active[i];
+            }
+
+            job->started = false;
+            job->done = false;
+            job->cancelled = false;
+            job->result = NULL;
+
+            job->weight = 0;
+            if (st->playout_speed <= 0.8 || st->paused) {
+                // decode and scan double a field if we can get it
+                // (should get better temporal resolution on slow motion playout)
+                float fields = (st->play_offset - floorf(st->play_offset)) * 2;
+                if (fields < 1) {
+                    job->field = FIELD_FIRST_DOUBLED;
+                } else {
+                    job->field = FIELD_SECOND_DOUBLED;
+                    fields -= 1;
+                }
 
-                    if (step) {
-                        play_offset++;
-                        step = false;
-                    } else if (step_backward) {
-                        play_offset--;
-                        step_backward = false;
-                    } else if (!paused) {
-                        play_offset += playout_speed;
+                // and make up the in-between when playing
+                if (interpolation != INTERP_FIELDS && !st->paused) {
+                    job->weight = fields * 256 + 0.5f;
+                    if (job->weight > 255) {
+                        job->weight = 255;
                     }
+                }
+            } else {
+                job->field = FIELD_FULL;
+            }
 
-                    if (overlay_clock) {
-                        clock_value = frame->clock;
-                        clock_image = Picture::copy(clock_bg);
-                        clock_image->set_font("Gotham FWN Narrow Bold", 35);
-                        if (clock_value >= 600) {
-                            clock_image->render_text(
-                                20, 4, "%d:%02d\n",
-                                clock_value / 600, (clock_value / 10) % 60
-                            );
-                        } else {
-                            clock_image->render_text(
-                                20, 4, ":%02d.%d\n",
-                                clock_value / 10, clock_value % 10
-                            );
-                        }
+            // don't run on past the end of what's been captured
+            if (buffers[st->playout_source] == NULL 
+                    || job->frame_no >= buffers[st->playout_source]->get_timecode( )) {
+                return;
+            }
 
-                        decoded->draw(clock_image, 25, 25, 0, 0, 0);
+            if (st->step) {
+                st->play_offset++;
+                st->step = false;
+            } else if (st->step_backward) {
+                st->play_offset--;
+                st->step_backward = false;
+            } else if (!st->paused) {
+                st->play_offset += st->playout_speed;
+            }
+        }
+
+        /* worker side: take jobs in queue order until the end of time */
+        void work(MJPEGDecoder *decoder) {
+            struct render_job *job;
+            job_list_t::iterator i;
+            Picture *result;
 
-                        Picture::free(clock_image);
+            for (;;) {
+                {
+                    MutexLock lock(mut);
+                    for (;;) {
+                        for (i = jobs.begin( ); i != jobs.end( ); i++) {
+                            if (!(*i)->started) {
+                                break;
+                            }
+                        }
+                        if (i != jobs.end( )) {
+                            break;
+                        }
+                        job_queued.wait(mut);
                     }
-                    
-                    /* DSK rendering */
-                    dsk_list_t::iterator i;
-                    for (i = dsks.begin( ); i != dsks.end( ); i++) {
-                        struct DSK *dsk = *i;
-                        if (dsk->active && dsk->overlay != NULL) {
-                            decoded->draw(dsk->overlay, dsk->x, dsk->y, 0, 0, 0);
+                    job = *i;
+                    job->started = true;
+                }
+
+                result = render(job, decoder);
+
+                {
+                    MutexLock lock(mut);
+                    if (job->cancelled) {
+                        if (result != NULL) {
+                            Picture::free(result);
                         }
+                        delete job;
+                    } else {
+                        job->result = result;
+                        job->done = true;
+                        job_done.broadcast( );
                     }
-                
+                }
+            }
+        }
+
+        /*
+         * Decode one frame or field of buffer (or get it from the cache).
+         * The picture may be shared with the cache, so don't draw on it.
+         */
+        Picture *decode(MJPEGDecoder *decoder, MmapBuffer *buffer, 
+                timecode_t frame_no, enum render_field field, uint32_t *clock_value) {
+            size_t frame_size;
+            struct mjpeg_frame *frame, header;
+            MmapBuffer::borrow_token token;
+            struct frame_cache_key key;
+            Picture *decoded;
+
+            key.buffer = buffer;
+            key.epoch = buffer->get_epoch( );
+            key.timecode = frame_no;
+            key.scale = 1;
+            key.pix_fmt = UYVY8;
+            switch (field) {
+                case FIELD_FIRST_DOUBLED:
+                    key.field = CACHED_FIRST_FIELD;
+                    break;
+                case FIELD_SECOND_DOUBLED:
+                    key.field = CACHED_SECOND_FIELD;
+                    break;
+                default:
+                    key.field = CACHED_FULL_FRAME;
+                    break;
+            }
+
+            if (frame_cache != NULL) {
+                decoded = frame_cache->get(key, clock_value);
+                if (decoded != NULL) {
                     return decoded;
-                } catch (std::runtime_error e) {
-                    fprintf(stderr, "Cannot decode frame\n");
-                    return NULL;
                 }
-            } else {
+            }
+
+            // decode straight out of the buffer, no copy, to what the
+            // output card wants (so compositing stays in Y'CbCr too)
+            frame = (struct mjpeg_frame *) 
+                buffer->borrow(frame_no, &frame_size, &token);
+
+            if (frame == NULL 
+                    || !mjpeg_frame_copy_header(frame, frame_size, &header)) {
+                return NULL;
+            }
+
+            try {
+                switch (field) {
+                    case FIELD_FIRST_DOUBLED:
+                        decoded = decoder->decode_first_doubled(&header, 
+                            frame->data, UYVY8);
+                        break;
+                    case FIELD_SECOND_DOUBLED:
+                        decoded = decoder->decode_second_doubled(&header, 
+                            frame->data, UYVY8);
+                        break;
+                    default:
+                        decoded = decoder->decode_full(&header, frame->data, 
+                            UYVY8);
+                        break;
+                }
+            } catch (std::runtime_error e) {
+                fprintf(stderr, "Cannot decode frame\n");
+                return NULL;
+            }
+
+            *clock_value = header.clock;
+
+            // if the ingest caught up with us mid-decode, it's garbage
+            if (!buffer->still_valid(&token)) {
+                fprintf(stderr, "frame overwritten during decode\n");
+                Picture::free(decoded);
+                return NULL;
+            }
+
+            if (frame_cache != NULL) {
+                frame_cache->put(key, decoded, *clock_value);
+            }
+
+            return decoded;
+        }
+
+        Picture *render(const struct render_job *job, MJPEGDecoder *decoder) {
+            MmapBuffer *buffer = buffers[job->source];
+            Picture *decoded;
+            uint32_t clock_value;
+            bool overlays;
+            int i;
+
+            if (buffer == NULL) {
+                return NULL;
+            }
+
+            decoded = decode(decoder, buffer, job->frame_no, job->field, &clock_value);
+            if (decoded == NULL) {
                 fprintf(stderr, "off end of available video\n");
                 return NULL;
             }
 
+            if (job->weight > 0) {
+                decoded = interpolate(job, decoder, buffer, decoded);
+            }
+
+            overlays = job->clock;
+            for (i = 0; i < N_DSK_SLOTS; i++) {
+                if (job->dsk_active[i] && dsk_titles[i].overlay != NULL) {
+                    overlays = true;
+                }
+            }
+
+            if (!overlays) {
+                return decoded;
+            }
+
+            /* don't draw on a picture someone else has */
+            if (frame_cache != NULL) {
+                Picture *own = Picture::copy(decoded);
+                Picture::free(decoded);
+                decoded = own;
+            }
+
+            if (job->clock) {
+                /* only re-composed when the clock value changes */
+                clock->draw(decoded, clock_value, 25, 25);
+            }
+            
+            /* DSK rendering */
+            for (i = 0; i < N_DSK_SLOTS; i++) {
+                struct DSK *dsk = &dsk_titles[i];
+                if (job->dsk_active[i] && dsk->overlay != NULL) {
+                    decoded->draw(dsk->overlay, dsk->x, dsk->y, 0, 0, 0);
+                }
+            }
+        
+            return decoded;
+        }
+
+        /* 
+         * Synthesize the picture job->weight of the way from field (the
+         * one the job asked for) to the field after it. Gives back field
+         * itself if the next one isn't there.
+         */
+        Picture *interpolate(const struct render_job *job, MJPEGDecoder *decoder,
+                MmapBuffer *buffer, Picture *field) {
+            Picture *next, *result;
+            uint32_t next_clock;
+
+            if (job->field == FIELD_FIRST_DOUBLED) {
+                /* the other half of the same frame */
+                next = decode(decoder, buffer, job->frame_no, 
+                    FIELD_SECOND_DOUBLED, &next_clock);
+            } else {
+                next = decode(decoder, buffer, job->frame_no + 1, 
+                    FIELD_FIRST_DOUBLED, &next_clock);
+            }
+
+            if (next == NULL) {
+                return field;
+            }
+
+            try {
+                if (interpolation == INTERP_MOTION) {
+                    result = interpolate_motion(field, next, job->weight);
+                } else {
+                    result = interpolate_blend(field, next, job->weight);
+                }
+            } catch (std::runtime_error e) {
+                /* fields of different sizes, say; just show the one we have */
+                Picture::free(next);
+                return field;
+            }
+
+            Picture::free(field);
+            Picture::free(next);
+            return result;
         }
 
+        struct playout_state *st;
+        ClockOverlay *clock;
+
+        Mutex mut;
+        Condition job_queued, job_done;
+        job_list_t jobs;            /* oldest first */
+        unsigned int lookahead;
+
+        std::vector<RenderWorker *> workers;
+
+        friend class RenderWorker;
+};
+
+/* one decode thread, with a decoder all its own */
+class RenderWorker : public Thread {
+    public:
+        RenderWorker(Renderer *r_) : r(r_) { }
+
     protected:
-        struct mjpeg_frame *frame;
-        MJPEGDecoder mjpeg_decoder;
-        Picture *clock_bg;
+        void run(void) {
+            r->work(&decoder);
+        }
 
+        Renderer *r;
+        MJPEGDecoder decoder;
+};
+
+void Renderer::start_workers(int n) {
+    int i;
+    for (i = 0; i < n; i++) {
+        RenderWorker *w = new RenderWorker(this);
+        workers.push_back(w);
+        w->start( );
+    }
+}
+
+/* how often (in output frames) each channel reports on its event queue */
+#define EVENT_STATS_FRAMES 3600
+
+/*
+ * One program output: its own playout state, render pipeline and output
+ * card, driven by its own thread. Commands for it arrive on evtq.
+ */
+class PlayoutChannel : public Thread {
+    public:
+        PlayoutChannel(int index_, const struct video_mode *mode, 
+                ClockOverlay *clock, StatusSocket *statsock_) 
+                : index(index_), r(&st, clock), statsock(statsock_) {
+            int i;
+
+            memset(st.marks, 0, sizeof(st.marks));
+            st.play_offset = 0.0f;
+            st.playout_source = 0;
+            st.did_cut = false;
+            st.paused = false;
+            st.step = false;
+            st.step_backward = false;
+            st.playout_speed = 0.0f;
+            st.overlay_clock = false;
+            for (i = 0; i < N_DSK_SLOTS; i++) {
+                st.dsk_active[i] = false;
+            }
+
+            /* generate blank picture */
+            blank = Picture::alloc(mode->w, mode->h, 2*mode->w, UYVY8);
+            memset(blank->data, 0, 2*mode->w*mode->h);
+
+            /* channel n plays out on card n */
+            out = new DecklinkOutput(&evtq, index, mode);
+        }
+
+        void set_lookahead(int frames) {
+            r.set_lookahead(frames);
+        }
+
+        void start_workers(int n) {
+            r.start_workers(n);
+        }
+
+        EventHandler evtq;
+
+    protected:
+        void run(void) {
+            struct playout_status status;
+            Picture *current_decoded, *last_decoded = blank;
+            uint32_t event;
+            void *argptr;
+            int frames = 0;
+            char name[32];
+
+            snprintf(name, sizeof(name), "channel %d events", index);
+
+            r.fill( );
+
+            // now, the interesting bits...
+            while (1) {
+                event = evtq.wait_event(argptr);
+                switch (event) {
+                    case EVT_PLAYOUT_COMMAND_RECEIVED:
+                        /* whatever was queued up is now out of date */
+                        r.invalidate( );
+                        parse_command(&st, (struct playout_command *) argptr);
+                        r.fill( );
+                        break;
+                    case EVT_OUTPUT_NEED_FRAME:
+                        /* pick up the next frame from the render pipeline */
+                        current_decoded = r.next_frame( );
+                        if (current_decoded != NULL) {
+                            /* get rid of the old frame if we got a new one */
+                            if (last_decoded != blank) {
+                                Picture::free(last_decoded);
+                            }
+
+                            last_decoded = current_decoded;
+                        }
+
+                        /* if the decode failed just show the last frame decoded instead */
+                        out->SetNextFrame(last_decoded);
+                        r.fill( );
+
+                        if (++frames == EVENT_STATS_FRAMES) {
+                            evtq.print_stats(name);
+                            frames = 0;
+                        }
+                        break;
+                }
+
+                // (try to) send status update
+                status.valid = 1;
+                // timecode is always relative to stream 0
+                status.timecode = st.marks[0] + r.shown_offset;
+                status.active_source = st.playout_source;
+                status.clock_on = st.overlay_clock;
+
+                // TODO: fix the DSK reporting
+                status.dsk_on = st.dsk_active[0];
+                status.channel = index;
+
+                /* 
+                 * note this could block the process! 
+                 * Remove it and see if issues go away??
+                 */
+                statsock->send_status(status); 
+            }
+        }
+
+        int index;
+        struct playout_state st;
+        Renderer r;
+        OutputAdapter *out;
+        StatusSocket *statsock;
+        Picture *blank;
 };
 
 void usage(char *name) {
@@ -363,11 +872,21 @@ void usage(char *name) {
     fprintf(stderr, "-d, --dsk <filename>: specify DSK PNG files\n");
     fprintf(stderr, "    This option may be specified multiple times:\n");
     fprintf(stderr, "    DSKs will be numbered starting from zero.\n");
+    fprintf(stderr, "-m, --mode <name>: output video mode (default ntsc)\n");
+    fprintf(stderr, "-n, --channels <n>: independent playout channels (default 1)\n");
+    fprintf(stderr, "    Channel n plays out on DeckLink card n; all of them\n");
+    fprintf(stderr, "    share the buffers, DSKs and frame cache.\n");
+    fprintf(stderr, "-j, --threads <n>: decode threads per channel (default %d)\n",
+        DEFAULT_RENDER_THREADS);
+    fprintf(stderr, "-l, --lookahead <frames>: frames to decode ahead of output\n");
+    fprintf(stderr, "    (default %d)\n", DEFAULT_RENDER_AHEAD);
+    fprintf(stderr, "-i, --interpolate <mode>: slow motion between fields:\n");
+    fprintf(stderr, "    fields (nearest field, the default), blend, or motion\n");
+    fprintf(stderr, "-c, --cache <MB>: decoded frame cache size, 0 for none\n");
+    fprintf(stderr, "    (default %d)\n", DEFAULT_CACHE_MB);
 }
 
 int main(int argc, char *argv[]) {
-    struct playout_command cmd;
-    struct playout_status status;
     int i;
 
     const struct option options[] = {
@@ -382,14 +901,54 @@ int main(int argc, char *argv[]) {
             has_arg: 1,
             flag: NULL,
             val: 'a'
-        }
+        },
+        {
+            name: "mode",
+            has_arg: 1,
+            flag: NULL,
+            val: 'm'
+        },
+        {
+            name: "channels",
+            has_arg: 1,
+            flag: NULL,
+            val: 'n'
+        },
+        {
+            name: "threads",
+            has_arg: 1,
+            flag: NULL,
+            val: 'j'
+        },
+        {
+            name: "lookahead",
+            has_arg: 1,
+            flag: NULL,
+            val: 'l'
+        },
+        {
+            name: "interpolate",
+            has_arg: 1,
+            flag: NULL,
+            val: 'i'
+        },
+        {
+            name: "cache",
+            has_arg: 1,
+            flag: NULL,
+            val: 'c'
+        },
+        { 0, 0, 0, 0 }
     };
 
+    const struct video_mode *mode = default_video_mode( );
     int opt;
     int dsk_number = 0;
     int auto_dsk_number = 0;
-
-    Renderer r;
+    int render_threads = DEFAULT_RENDER_THREADS;
+    int cache_mb = DEFAULT_CACHE_MB;
+    int n_channels = 1;
+    int lookahead = DEFAULT_RENDER_AHEAD;
 
     memset(dsk_titles, 0, sizeof(dsk_titles));
 
@@ -399,16 +958,15 @@ int main(int argc, char *argv[]) {
     }
     
     /* parse options, load DSKs, set up auto-DSK */
-    while ((opt = getopt_long(argc, argv, "d:a:", options, NULL)) != EOF) {
+    while ((opt = getopt_long(argc, argv, "d:a:m:n:j:l:i:c:", options, NULL)) != EOF) {
         switch (opt) {
             case 'd':
                 /* load DSK */
                 if (dsk_number < N_DSK_SLOTS) {
-                    dsk_titles[dsk_number].overlay = Picture::from_png(optarg);
+                    /* premultiplied for the UYVY8 frames we composite onto */
+                    dsk_titles[dsk_number].overlay = Picture::from_png(optarg, UYVY8);
                     dsk_titles[dsk_number].x = 0;
-                    dsk_titles[dsk_number].y = 400;
-                    dsk_titles[dsk_number].active = false;
-                    r.add_dsk(&dsk_titles[dsk_number]);
+                    /* y gets filled in once we know the video mode */
                     dsk_number++;
                 } else {
                     fprintf(stderr, "too many DSKs: can't load %s", optarg);
@@ -426,6 +984,53 @@ int main(int argc, char *argv[]) {
                     fprintf(stderr, "more auto-DSKs than allowed channels");
                 }
                 break;
+            case 'm':
+                mode = find_video_mode(optarg);
+                if (mode == NULL) {
+                    list_video_modes( );
+                    exit(1);
+                }
+                break;
+            case 'n':
+                n_channels = atoi(optarg);
+                if (n_channels < 1 || n_channels > MAX_PLAYOUT_CHANNELS) {
+                    fprintf(stderr, "--channels must be 1 to %d\n", MAX_PLAYOUT_CHANNELS);
+                    exit(1);
+                }
+                break;
+            case 'j':
+                render_threads = atoi(optarg);
+                if (render_threads < 1 || render_threads > MAX_RENDER_THREADS) {
+                    fprintf(stderr, "--threads must be 1 to %d\n", MAX_RENDER_THREADS);
+                    exit(1);
+                }
+                break;
+            case 'l':
+                lookahead = atoi(optarg);
+                if (lookahead < 1 || lookahead > MAX_RENDER_AHEAD) {
+                    fprintf(stderr, "--lookahead must be 1 to %d\n", MAX_RENDER_AHEAD);
+                    exit(1);
+                }
+                break;
+            case 'i':
+                if (strcmp(optarg, "fields") == 0) {
+                    interpolation = INTERP_FIELDS;
+                } else if (strcmp(optarg, "blend") == 0) {
+                    interpolation = INTERP_BLEND;
+                } else if (strcmp(optarg, "motion") == 0) {
+                    interpolation = INTERP_MOTION;
+                } else {
+                    fprintf(stderr, "--interpolate must be fields, blend or motion\n");
+                    exit(1);
+                }
+                break;
+            case 'c':
+                cache_mb = atoi(optarg);
+                if (cache_mb < 0) {
+                    fprintf(stderr, "--cache must not be negative\n");
+                    exit(1);
+                }
+                break;
             default:
                 fprintf(stderr, "invalid argument\n");
                 usage(argv[0]);
@@ -435,65 +1040,51 @@ int main(int argc, char *argv[]) {
 
 
 
-    /* generate blank picture */
-    Picture *blank = Picture::alloc(720, 480, 1440, UYVY8);
-    memset(blank->data, 0, 1440*480);
-
-    Picture *current_decoded, *last_decoded = blank;
-
-    EventHandler evtq;
-    CommandReceiver recv(&evtq);
-    StatusSocket statsock;
-    recv.start( );
-
-    out = new DecklinkOutput(&evtq, 0);
-
+    /* lower-third DSKs sit on the bottom sixth of the frame */
+    for (i = 0; i < dsk_number; i++) {
+        dsk_titles[i].y = mode->h * 5 / 6;
+    }
 
     // initialize buffers
     for (i = 0; optind < argc; ++i, ++optind) {
         buffers[i] = new MmapBuffer(argv[optind], MAX_FRAME_SIZE);
+
+        /* old buffers don't say what they hold; assume the best */
+        const char *format = buffers[i]->get_format( );
+        if (format[0] != 0 && strcmp(format, mode->name) != 0) {
+            fprintf(stderr, "warning: %s holds %s video, output is %s\n",
+                argv[optind], format, mode->name);
+        }
     }
 
-    // now, the interesting bits...
-    uint32_t event;
-    void *argptr;
-    while (1) {
-        event = evtq.wait_event(argptr);
-        switch (event) {
-            case EVT_PLAYOUT_COMMAND_RECEIVED:
-                parse_command( (struct playout_command *) argptr );             
-                break;
-            case EVT_OUTPUT_NEED_FRAME:
-                /* try to decode another frame */
-                current_decoded = r.render_next_frame( );
-                if (current_decoded != NULL) {
-                    /* get rid of the old frame if we got a new one */
-                    if (last_decoded != blank) {
-                        Picture::free(last_decoded);
-                    }
+    if (cache_mb > 0) {
+        frame_cache = new FrameCache(cache_mb);
+    }
 
-                    last_decoded = current_decoded;
-                }
+    /* the clock graphic is the same on every channel */
+    ClockOverlay *clock = new ClockOverlay(Picture::from_png("hb3_replayclock.png"),
+        "Gotham FWN Narrow Bold", 35, 20, 4);
 
-                /* if the decode failed just show the last frame decoded instead */
-                out->SetNextFrame(last_decoded);
-                break;
-        }
+    StatusSocket statsock;
+    PlayoutChannel *channels[MAX_PLAYOUT_CHANNELS];
+    EventHandler *channel_queues[MAX_PLAYOUT_CHANNELS];
+
+    for (i = 0; i < n_channels; i++) {
+        channels[i] = new PlayoutChannel(i, mode, clock, &statsock);
+        channels[i]->set_lookahead(lookahead);
+        channels[i]->start_workers(render_threads);
+        channel_queues[i] = &channels[i]->evtq;
+    }
 
-        // (try to) send status update
-        status.valid = 1;
-        // timecode is always relative to stream 0
-        status.timecode = marks[0] + play_offset;
-        status.active_source = playout_source;
-        status.clock_on = overlay_clock;
+    CommandReceiver recv(channel_queues, n_channels);
+    recv.start( );
 
-        // TODO: fix the DSK reporting
-        status.dsk_on = dsk_titles[0].active;
+    for (i = 0; i < n_channels; i++) {
+        channels[i]->start( );
+    }
 
-        /* 
-         * note this could block the process! 
-         * Remove it and see if issues go away??
-         */
-        statsock.send_status(status); 
+    /* the channels run until the process is killed */
+    for (i = 0; i < n_channels; i++) {
+        channels[i]->join( );
     }
 }
@@ -19,6 +19,8 @@
 #include "mjpeg_config.h"
 #include "playout_ctl.h"
 #include "mjpeg_frame.h"
+#include "frame_cache.h"
+#include "video_mode.h"
 
 #include <vector>
 #include <list>
@@ -29,6 +31,16 @@
 #define PVW_W 720
 #define PVW_H 480
 
+/* 
+ * Area of the screen given over to the multiviewer. The rest of the
+ * screen to the right is for text. Tiles shrink by powers of two until
+ * every camera fits.
+ */
+#define GRID_W 1464
+#define GRID_H 960
+
+int grid_cols;
+
 SDL_Surface *screen, *frame_buf, *font;
 SDL_Surface *vscope_bg;
 
@@ -45,10 +57,12 @@ int clip_no = 0;
 #define INST_PERIOD 1000
 int n_decoded, last_check;
 
-struct mjpeg_frame *frame = NULL;
-
 MJPEGDecoder mjpeg_decoder;
 
+/* recently decoded tiles, so jog/shuttle over them doesn't decode again */
+#define FRAME_CACHE_MB 256
+FrameCache frame_cache(FRAME_CACHE_MB);
+
 int *marks, *replay_ptrs, *replay_ends;
 std::vector<int *> saved_marks;
 
@@ -66,6 +80,9 @@ int playout_pid = -1;
 
 struct playout_status playout_status;
 
+/* the playoutd channel this GUI drives and shows the status of */
+int playout_channel = 0;
+
 // Preview frames per frame
 #define PVW_FPF 2
 
@@ -187,7 +204,7 @@ void render_waveform(SDL_Surface *output, Picture *p) {
     uint8_t *pixel_ptr;
     int i, j;
     int32_t x, y;
-    int16_t y_scale = 480;
+    int16_t y_scale = output->h - 1;
 
 
     for (i = 0; i < p_use->h; i++) {
@@ -195,7 +212,7 @@ void render_waveform(SDL_Surface *output, Picture *p) {
 
         for (j = 0; j < p_use->w; j++) {
             x = j;
-            y = (256 - pixel_ptr[0]) * y_scale / 256;
+            y = (255 - pixel_ptr[0]) * y_scale / 255;
 
             putpixel(output, x, y, 255, 255, 255);
             pixel_ptr += 3;
@@ -207,6 +224,60 @@ void render_waveform(SDL_Surface *output, Picture *p) {
     }
 }
 
+/* 
+ * Smallest DCT scale that gets a frame from this buffer into a tile, going
+ * by the video mode ingest tagged it with. Older buffers aren't tagged,
+ * so assume preview size for those.
+ */
+int scale_for_tile(MmapBuffer *buf) {
+    const struct video_mode *mode = find_video_mode(buf->get_format( ));
+    int w = mode ? mode->w : PVW_W;
+    int h = mode ? mode->h : PVW_H;
+    int denom = 1;
+
+    while (denom < 8 && (w / denom > frame_buf->w || h / denom > frame_buf->h)) {
+        denom *= 2;
+    }
+
+    return denom;
+}
+
+/* 
+ * Work out the tile grid for n cameras and (re)create frame_buf at the
+ * tile size.
+ */
+int layout_tiles(int n) {
+    int rows, scale;
+
+    grid_cols = 1;
+    while (grid_cols * grid_cols < n) {
+        grid_cols++;
+    }
+    rows = (n + grid_cols - 1) / grid_cols;
+
+    for (scale = 1; scale < 8; scale *= 2) {
+        if (grid_cols * (PVW_W / scale + 2*TALLY_MARGIN) <= GRID_W
+                && rows * (PVW_H / scale) <= GRID_H) {
+            break;
+        }
+    }
+
+    if (frame_buf) {
+        SDL_FreeSurface(frame_buf);
+    }
+
+    frame_buf = SDL_CreateRGBSurface(SDL_HWSURFACE, PVW_W / scale, PVW_H / scale, 
+        24, 0xff, 0xff00, 0xff0000, 0);
+    if (!frame_buf) {
+        fprintf(stderr, "Failed to create frame buffer!\n");
+        return -1;
+    }
+
+    fprintf(stderr, "multiview: %d cameras in %dx%d tiles of %dx%d\n",
+        n, grid_cols, rows, frame_buf->w, frame_buf->h);
+    return 0;
+}
+
 void draw_frame(MmapBuffer *buf, int x, int y, int tc, enum analyze analyze, uint32_t *scoreboard_clock = 0) {
     SDL_Rect rect;
     Picture *decoded;
@@ -215,31 +286,55 @@ void draw_frame(MmapBuffer *buf, int x, int y, int tc, enum analyze analyze, uin
     int blit_w;
     
     size_t size;
+    struct mjpeg_frame *frame, header;
+    MmapBuffer::borrow_token token;
+    uint16_t epoch;
 
     rect.x = x;
     rect.y = y;
 
-    // Get the JPEG frame
-    if (frame == NULL) {
-        frame = (struct mjpeg_frame *)malloc(MAX_FRAME_SIZE);
-    }
+    // (before borrowing, so a reset in between can't file the old
+    // recording's frame under the new epoch)
+    epoch = buf->get_epoch( );
 
-    size = MAX_FRAME_SIZE;
+    // Get the JPEG frame (decoded in place, straight out of the buffer)
+    frame = (struct mjpeg_frame *) buf->borrow(tc, &size, &token);
 
-    if (!buf->get((void *)frame, &size, tc)) {
+    if (frame == NULL || !mjpeg_frame_copy_header(frame, size, &header)) {
         // Frame wasn't there. Fill with black.
         fprintf(stderr, "Frame not found!\n");
         SDL_FillRect(frame_buf, 0, 0);
         SDL_BlitSurface(frame_buf, 0, screen, &rect);
     } else {
         if (scoreboard_clock != NULL) {
-            *scoreboard_clock = frame->clock;
+            *scoreboard_clock = header.clock;
         }
         try {
-            if (analyze == PICTURE) {
-                decoded = mjpeg_decoder.decode_full(frame, RGB8);
-            } else {
-                decoded = mjpeg_decoder.decode_full(frame, YUV8);
+            struct frame_cache_key key;
+
+            key.buffer = buf;
+            key.epoch = epoch;
+            key.timecode = tc;
+            key.field = CACHED_FULL_FRAME;
+            /* decode straight to thumbnail size */
+            key.scale = scale_for_tile(buf);
+            key.pix_fmt = (analyze == PICTURE) ? RGB8 : YUV8;
+
+            decoded = frame_cache.get(key);
+            if (decoded == NULL) {
+                mjpeg_decoder.set_scale(key.scale);
+                decoded = mjpeg_decoder.decode_full(&header, frame->data,
+                    key.pix_fmt);
+
+                if (decoded && !buf->still_valid(&token)) {
+                    /* ingest overwrote the frame while we were decoding it */
+                    Picture::free(decoded);
+                    decoded = NULL;
+                }
+
+                if (decoded) {
+                    frame_cache.put(key, decoded, header.clock);
+                }
             }
 
             if (decoded) {
@@ -252,16 +347,21 @@ void draw_frame(MmapBuffer *buf, int x, int y, int tc, enum analyze analyze, uin
                         SDL_LockSurface(frame_buf);
                     }
 
+                    /* letterbox anything that doesn't fill the tile */
+                    if (decoded->w < frame_buf->w || decoded->h < frame_buf->h) {
+                        SDL_FillRect(frame_buf, 0, 0);
+                    }
+
                     pixels = (uint8_t *)frame_buf->pixels;
-                    if (decoded->w > PVW_W) {
-                        blit_w = PVW_W;
+                    if (decoded->w > frame_buf->w) {
+                        blit_w = frame_buf->w;
                     } else {
                         blit_w = decoded->w;
                     }
 
-                    for (i = 0; i < PVW_H && i < decoded->h; ++i) {
+                    for (i = 0; i < frame_buf->h && i < decoded->h; ++i) {
                         memcpy(pixels, decoded->data + decoded->line_pitch * i, blit_w * 3);
-                        pixels += PVW_W * 3;
+                        pixels += frame_buf->pitch;
                     }
 
                     if (SDL_MUSTLOCK(frame_buf)) {
@@ -282,7 +382,19 @@ void draw_frame(MmapBuffer *buf, int x, int y, int tc, enum analyze analyze, uin
                 n_decoded++;
 
                 if (n_decoded == INST_PERIOD) {
+                    struct picture_pool_stats pool;
+                    Picture::pool_stats(&pool);
+
                     fprintf(stderr, "%f fps\n", (float)INST_PERIOD / (float)(time(NULL) - last_check));
+                    fprintf(stderr, "picture pool: %llu hits %llu misses %llu discards\n",
+                        (unsigned long long) pool.hits, (unsigned long long) pool.misses,
+                        (unsigned long long) pool.discards);
+
+                    struct frame_cache_stats cache;
+                    frame_cache.stats(&cache);
+                    fprintf(stderr, "frame cache: %llu hits %llu misses, %u frames %u MB\n",
+                        (unsigned long long) cache.hits, (unsigned long long) cache.misses,
+                        cache.frames, (unsigned int) (cache.bytes >> 20));
                     last_check = time(NULL);
                     n_decoded = 0;
                 }
@@ -297,11 +409,23 @@ void draw_frame(MmapBuffer *buf, int x, int y, int tc, enum analyze analyze, uin
 
 }
 
+/* 
+ * Start reading in what's at the marks, for our previews and for
+ * playoutd (the page cache is shared) once it's cued.
+ */
+void prefetch_marks(void) {
+    int j;
+    for (j = 0; j < n_buffers; ++j) {
+        buffers[j]->prefetch(marks[j], CUE_PREFETCH_FRAMES);
+    }
+}
+
 void mark(void) {
     int j;
     for (j = 0; j < n_buffers; ++j) {
         marks[j] = buffers[j]->get_timecode( ) - preroll;
     }
+    prefetch_marks( );
 }
 
 void mark_playout(void) {
@@ -334,6 +458,7 @@ void recall_mark(int n) {
         return;
     }
     memcpy(marks, saved_marks[n], sizeof(int) * n_buffers);
+    prefetch_marks( );
 }
 
 void write_file_from_mark(int n = -1) {
@@ -536,6 +661,11 @@ void draw_message_log(int x, int y, int h) {
 }
 
 
+void send_playout_command(struct playout_command *cmd) {
+    cmd->channel = playout_channel;
+    sendto(socket_fd, cmd, sizeof(*cmd), 0, (struct sockaddr *)&daemon_addr, sizeof(daemon_addr));
+}
+
 void cue_playout(void) {
     int j;
 
@@ -549,7 +679,7 @@ void cue_playout(void) {
     }
 
     // ready to go... so do it.
-    sendto(socket_fd, &cmd, sizeof(cmd), 0, (struct sockaddr *)&daemon_addr, sizeof(daemon_addr));
+    send_playout_command(&cmd);
 }
 
 void live_cut(int new_source) {
@@ -557,7 +687,7 @@ void live_cut(int new_source) {
     cmd.cmd = PLAYOUT_CMD_CUT;
     cmd.source = new_source;
 
-    sendto(socket_fd, &cmd, sizeof(cmd), 0, (struct sockaddr *)&daemon_addr, sizeof(daemon_addr));
+    send_playout_command(&cmd);
 }
 
 void live_cut_and_rewind(int new_source) {
@@ -571,7 +701,7 @@ void live_cut_and_rewind(int new_source) {
         cmd.marks[j] = marks[j];
     }
 
-    sendto(socket_fd, &cmd, sizeof(cmd), 0, (struct sockaddr *)&daemon_addr, sizeof(daemon_addr));
+    send_playout_command(&cmd);
 }
 
 void adjust_speed(float new_speed) {
@@ -579,7 +709,7 @@ void adjust_speed(float new_speed) {
     cmd.cmd = PLAYOUT_CMD_ADJUST_SPEED;
     cmd.new_speed = new_speed;
 
-    sendto(socket_fd, &cmd, sizeof(cmd), 0, (struct sockaddr *)&daemon_addr, sizeof(daemon_addr));
+    send_playout_command(&cmd);
     
 }
 
@@ -587,7 +717,7 @@ void do_playout_cmd(int cmd_id) {
     struct playout_command cmd;
     cmd.cmd = cmd_id;
 
-    sendto(socket_fd, &cmd, sizeof(cmd), 0, (struct sockaddr *)&daemon_addr, sizeof(daemon_addr));
+    send_playout_command(&cmd);
 }
 
 
@@ -596,7 +726,7 @@ void toggle_dsk(int dsk_number) {
     cmd.cmd = PLAYOUT_CMD_DSK_TOGGLE;
     cmd.source = dsk_number;
 
-    sendto(socket_fd, &cmd, sizeof(cmd), 0, (struct sockaddr *)&daemon_addr, sizeof(daemon_addr));
+    send_playout_command(&cmd);
 }
 
 
@@ -636,7 +766,11 @@ void update_playout_status(void) {
 
     while (pfd.revents & POLLIN) {
         // ready to go!
-        recvfrom(socket_fd, &playout_status, sizeof(playout_status), 0, 0, 0);
+        struct playout_status st;
+        if (recvfrom(socket_fd, &st, sizeof(st), 0, 0, 0) == sizeof(st)
+                && st.channel == playout_channel) {
+            playout_status = st;
+        }
         pfd.revents = 0;
         result = poll(&pfd, 1, 1);
     }
@@ -654,6 +788,69 @@ void seek_mark_forward(void) {
     }
 }
 
+/*
+ * Move the marks to tc on the first camera, and the others to whatever
+ * they captured at the same moment (or by the same number of frames if
+ * they have no seek index).
+ */
+void seek_marks_to(timecode_t tc) {
+    timecode_t displacement = tc - marks[0];
+    timecode_t other;
+    uint64_t wall_usec;
+    bool have_wall;
+
+    have_wall = buffers[0]->get_stamp(tc, &wall_usec, NULL);
+
+    for (int j = 0; j < n_buffers; ++j) {
+        other = -1;
+        if (j > 0 && have_wall) {
+            other = buffers[j]->find_wall_time(wall_usec);
+        }
+        marks[j] = (other != -1) ? other : marks[j] + displacement;
+    }
+    prefetch_marks( );
+}
+
+/* input is minutes and seconds left in the period: 342 is 3:42 */
+void seek_clock(int mmss) {
+    uint32_t clock = ((mmss / 100) * 60 + mmss % 100) * 10;
+    timecode_t tc = buffers[0]->find_clock(clock);
+
+    if (tc == -1) {
+        log_message("clock %d:%02d not in buffer", mmss / 100, mmss % 100);
+        return;
+    }
+
+    seek_marks_to(tc);
+}
+
+/* input is a wall clock time today (or yesterday, if still to come) */
+void seek_wall_time(int hhmmss) {
+    time_t now = time(NULL);
+    time_t when;
+    struct tm tm;
+    timecode_t tc;
+
+    localtime_r(&now, &tm);
+    tm.tm_hour = hhmmss / 10000;
+    tm.tm_min = (hhmmss / 100) % 100;
+    tm.tm_sec = hhmmss % 100;
+    tm.tm_isdst = -1;
+    when = mktime(&tm);
+    if (when > now) {
+        when -= 24 * 60 * 60;
+    }
+
+    tc = buffers[0]->find_wall_time((uint64_t) when * 1000000);
+    if (tc == -1) {
+        log_message("time %02d:%02d:%02d not in buffer",
+            hhmmss / 10000, (hhmmss / 100) % 100, hhmmss % 100);
+        return;
+    }
+
+    seek_marks_to(tc);
+}
+
 void preroll_up(int amount) {
     preroll += amount;
 }
@@ -737,6 +934,7 @@ int camera_get(void) {
 
 void display_mode_seek_start(void) {
     display_mode = SEEK_START;
+    prefetch_marks( );
 }
 
 void display_mode_preview(void) {
@@ -879,9 +1077,7 @@ int main(int argc, char *argv[])
             goto dead;
         }
 
-        frame_buf = SDL_CreateRGBSurface(SDL_HWSURFACE, PVW_W, PVW_H, 24, 0xff, 0xff00, 0xff0000, 0);
-        if (!frame_buf) {
-            fprintf(stderr, "Failed to create frame buffer!\n");
+        if (layout_tiles(n_buffers) != 0) {
             goto dead;
         }
 
@@ -894,12 +1090,8 @@ int main(int argc, char *argv[])
             x = TALLY_MARGIN;
             y = TALLY_MARGIN;
             text_start_x = 0;
-            for (j = 0; j < n_buffers && j < 4; j++) {
-                if (j == 0 && camera_get( ) >= 4) {
-                    display_cam = camera_get( );
-                } else {
-                    display_cam = j;
-                }
+            for (j = 0; j < n_buffers; j++) {
+                display_cam = j;
 
                 /* Draw tally indicators */
                 if (display_cam == playout_status.active_source 
@@ -968,9 +1160,9 @@ int main(int argc, char *argv[])
                 line_of_text(&xt, &yt, "CAM %d", display_cam + 1);
 
                 x += frame_buf->w + 2*TALLY_MARGIN;
-                if (x + frame_buf->w > screen->w) {
+                if ((j + 1) % grid_cols == 0) {
                     text_start_x = x;
-                    x = 0;
+                    x = TALLY_MARGIN;
                     y += frame_buf->h + 2*TALLY_MARGIN;
                 }
             }
@@ -1272,6 +1464,14 @@ int main(int argc, char *argv[])
                             toggle_dsk(consume_numeric_input( ));
                             break;
 
+                        case SDLK_g: /* Game clock */
+                            seek_clock(consume_numeric_input( ));
+                            break;
+
+                        case SDLK_h: /* Hours, minutes, seconds */
+                            seek_wall_time(consume_numeric_input( ));
+                            break;
+
                         case SDLK_ESCAPE:
             			    flag = 1;
                             break;
@@ -6,6 +6,7 @@
 
 EncodeStats::EncodeStats(float video_fps) {
     autoprint_frames = 0;
+    hot_bytes = resident_bytes = locked_bytes = 0;
     this->video_fps = video_fps;
     memset(&cumulative_stats, 0, sizeof(struct stats));
     memset(&current_stats, 0, sizeof(struct stats));
@@ -14,50 +15,118 @@ EncodeStats::EncodeStats(float video_fps) {
 }
 
 void EncodeStats::autoprint(uint32_t n_frames) {
+    MutexLock lock(mut);
     autoprint_frames = n_frames;
 }
 
 void EncodeStats::no_autoprint(void) {
+    MutexLock lock(mut);
     autoprint_frames = 0;
 }
 
 void EncodeStats::print(void) {
+    MutexLock lock(mut);
     _print(&current_stats);
 }
 
 void EncodeStats::reset(void) {
-    memset(&current_stats, 0, sizeof(current_stats));
-    gettimeofday(&current_stats.start_time, 0);
+    MutexLock lock(mut);
+    _reset( );
 }
 
 void EncodeStats::print_and_reset(void) {
-    print( );
-    reset( );
+    MutexLock lock(mut);
+    _print(&current_stats);
+    _reset( );
+}
+
+void EncodeStats::_reset(void) {
+    memset(&current_stats, 0, sizeof(current_stats));
+    gettimeofday(&current_stats.start_time, 0);
 }
 
 void EncodeStats::print_cumulative(void) {
+    MutexLock lock(mut);
     _print(&cumulative_stats);
 }
 
 void EncodeStats::input_bytes(uint32_t n_bytes) {
+    MutexLock lock(mut);
     current_stats.bytes_in += n_bytes;
     cumulative_stats.bytes_in += n_bytes;
 }
 
 void EncodeStats::output_bytes(uint32_t n_bytes) {
+    MutexLock lock(mut);
     current_stats.bytes_out += n_bytes;
     cumulative_stats.bytes_out += n_bytes;
 }
 
 void EncodeStats::finish_frames(uint32_t n_frames) {
+    MutexLock lock(mut);
     current_stats.frames += n_frames;
     cumulative_stats.frames += n_frames;
     if (current_stats.frames > autoprint_frames
             && autoprint_frames > 0) {
-        print_and_reset( );
+        _print(&current_stats);
+        _reset( );
+    }
+}
+
+void EncodeStats::drop_frames(uint32_t n_frames) {
+    MutexLock lock(mut);
+    current_stats.dropped += n_frames;
+    cumulative_stats.dropped += n_frames;
+}
+
+void EncodeStats::band_time(int band, uint32_t usec) {
+    struct stats *stat[2] = { &current_stats, &cumulative_stats };
+    int i;
+
+    MutexLock lock(mut);
+
+    if (band >= MAX_STATS_BANDS) {
+        band = MAX_STATS_BANDS - 1;
+    }
+
+    for (i = 0; i < 2; i++) {
+        stat[i]->band_usec[band] += usec;
+        stat[i]->band_count[band]++;
+        if (usec > stat[i]->band_max_usec[band]) {
+            stat[i]->band_max_usec[band] = usec;
+        }
     }
 }
 
+void EncodeStats::frame_quality(int quality, bool reencoded) {
+    struct stats *stat[2] = { &current_stats, &cumulative_stats };
+    int i;
+
+    MutexLock lock(mut);
+
+    for (i = 0; i < 2; i++) {
+        if (stat[i]->quality_count == 0 || quality < stat[i]->quality_min) {
+            stat[i]->quality_min = quality;
+        }
+        if (stat[i]->quality_count == 0 || quality > stat[i]->quality_max) {
+            stat[i]->quality_max = quality;
+        }
+        stat[i]->quality_sum += quality;
+        stat[i]->quality_count++;
+        if (reencoded) {
+            stat[i]->reencoded++;
+        }
+    }
+}
+
+void EncodeStats::buffer_residency(uint64_t hot_bytes_, 
+        uint64_t resident_bytes_, uint64_t locked_bytes_) {
+    MutexLock lock(mut);
+    hot_bytes = hot_bytes_;
+    resident_bytes = resident_bytes_;
+    locked_bytes = locked_bytes_;
+}
+
 void EncodeStats::_print(struct stats *stat) {
     struct timeval tv;
     int64_t delta_t;
@@ -82,4 +151,39 @@ void EncodeStats::_print(struct stats *stat) {
         cumulative_stats.frames, /* always use cumulative frame count */
         fps, in_kbps, out_kbps
     );
+
+    if (stat->dropped > 0) {
+        fprintf(stderr, "dropped %d frames\n", stat->dropped);
+    }
+
+    if (stat->quality_count > 0) {
+        fprintf(stderr, "quality (avg/min/max): %.1f/%d/%d",
+            (float)stat->quality_sum / (float)stat->quality_count,
+            stat->quality_min, stat->quality_max
+        );
+        if (stat->reencoded > 0) {
+            fprintf(stderr, ", %d frames re-encoded to fit", stat->reencoded);
+        }
+        fprintf(stderr, "\n");
+    }
+
+    if (hot_bytes > 0) {
+        fprintf(stderr, "hot tail: %.1f MB, %.1f%% resident, %.1f MB locked\n",
+            (float)hot_bytes / 1048576.0f,
+            (float)resident_bytes * 100.0f / (float)hot_bytes,
+            (float)locked_bytes / 1048576.0f
+        );
+    }
+
+    /* average/worst encode time for each band, in ms */
+    if (stat->band_count[0] > 0) {
+        fprintf(stderr, "bands (avg/max ms):");
+        for (int i = 0; i < MAX_STATS_BANDS && stat->band_count[i] > 0; i++) {
+            fprintf(stderr, " %.1f/%.1f",
+                (float)stat->band_usec[i] / (float)stat->band_count[i] / 1000.0f,
+                (float)stat->band_max_usec[i] / 1000.0f
+            );
+        }
+        fprintf(stderr, "\n");
+    }
 }
@@ -4,6 +4,11 @@
 #include <stdint.h>
 #include <sys/time.h>
 
+#include "mutex.h"
+
+/* bands past this many get lumped in with the last one */
+#define MAX_STATS_BANDS 16
+
 class EncodeStats {
     public:
         EncodeStats(float video_fps);
@@ -17,18 +22,46 @@ class EncodeStats {
         void input_bytes(uint32_t n_bytes);
         void output_bytes(uint32_t n_bytes);
         void finish_frames(uint32_t n_frames);
+        /* frames captured but thrown away, because encoding fell behind */
+        void drop_frames(uint32_t n_frames);
+
+        /* time taken to encode one band of a (slice-parallel) frame */
+        void band_time(int band, uint32_t usec);
+
+        /* JPEG quality a frame was encoded at, and whether it took a retry */
+        void frame_quality(int quality, bool reencoded);
+
+        /* how much of the buffer's hot tail is in memory (a snapshot) */
+        void buffer_residency(uint64_t hot_bytes, uint64_t resident_bytes,
+            uint64_t locked_bytes);
     protected:
         struct stats {
             struct timeval start_time;
             uint32_t frames;
+            uint32_t dropped;
             uint32_t bytes_in;
             uint32_t bytes_out;
+
+            uint64_t band_usec[MAX_STATS_BANDS];
+            uint32_t band_max_usec[MAX_STATS_BANDS];
+            uint32_t band_count[MAX_STATS_BANDS];
+
+            uint64_t quality_sum;
+            uint32_t quality_count;
+            int quality_min, quality_max;
+            uint32_t reencoded;
         } cumulative_stats, current_stats;
         uint32_t autoprint_frames;
 
+        uint64_t hot_bytes, resident_bytes, locked_bytes;
+
         void _print(struct stats *stat);
+        void _reset(void);
 
         float video_fps;
+
+        /* (encode threads report band times while the writer counts frames) */
+        Mutex mut;
 };
 
 #endif
@@ -1,30 +1,41 @@
 #include "mjpeg_config.h"
 #include "mjpeg_frame.h"
 #include "mmap_buffer.h"
+#include "ingest_pipeline.h"
 #include "picture.h"
 #include "stats.h"
 #include "mmap_state.h"
+#include "video_mode.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 
 int main(int argc, char **argv) {
-    MJPEGEncoder enc;
     EncodeStats stats(29.97);
+    struct ingest_options opts;
 
-    if (argc < 2) {
-        fprintf(stderr, "usage: %s buffer\n", argv[0]);
+    if (!parse_ingest_options(argc, argv, &opts) || optind != argc - 1) {
+        fprintf(stderr, "usage: %s " INGEST_USAGE " buffer\n", argv[0]);
+        return 1;
     }
 
+    const struct video_mode *mode = opts.mode;
+
     // print out some statistics after every 60 frames we finish
     stats.autoprint(60);
 
-    MmapBuffer buf(argv[1], MAX_FRAME_SIZE, true);
+    MmapBuffer *buf = open_ingest_buffer(argv[optind], &opts);
     MmapState clock_ipc("clock_ipc");
 
-    /* DV = 720x480, capture card = 720x486 */
-    int frame_w = 720, frame_h = 480;
+    IngestPipeline pipeline(buf, mode, &clock_ipc);
+    pipeline.set_options(&opts);
+    pipeline.set_stats(&stats);
+    pipeline.start( );
+
+    /* input is raw UYVY at exactly the mode's geometry */
+    int frame_w = mode->w, frame_h = mode->h;
 
     Picture *input = Picture::alloc(frame_w, frame_h, 2*frame_w, UYVY8);
     
@@ -45,21 +56,15 @@ int main(int argc, char **argv) {
                 }
             } else if (n_read == 0) {
                 fprintf(stderr, "EOF?");
+                pipeline.finish( );
                 exit(0);
             } else {
-                stats.input_bytes(n_read);
                 read_so_far += n_read;
             }
         } else {
-            // encode and store the data
-            mjpeg_frame *frm = enc.encode_full(input, true);
-
-            // scoreboard clock input
-            clock_ipc.get(&frm->clock, sizeof(frm->clock));
-
-            buf.put(frm, sizeof(struct mjpeg_frame) + frm->f1size);
-            stats.output_bytes(frm->f1size);
-            stats.finish_frames(1);
+            // hand it off to be encoded and stored, and read the next one
+            pipeline.submit(input);
+            input = Picture::alloc(frame_w, frame_h, 2*frame_w, UYVY8);
             read_so_far = 0;
         }
     }
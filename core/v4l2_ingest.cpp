@@ -13,13 +13,14 @@
 #include "mjpeg_frame.h"
 #include "mmap_buffer.h"
 #include "mmap_state.h"
+#include "ingest_pipeline.h"
 #include "picture.h"
 #include "stats.h"
+#include "video_mode.h"
 
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
-#include <getopt.h>
 #include <string.h>
 #include <assert.h>
 
@@ -59,9 +60,25 @@ void make_odd_dominant(Picture *first, Picture *second)
 }
 
 void usage(char *name) {
-    fprintf(stderr, "usage: %s [-i input] /dev/videoX buffer", name);
+    fprintf(stderr, "usage: %s [-i input] " INGEST_USAGE " /dev/videoX buffer\n", name);
 }
 
+/* -i, the one option that's ours alone */
+bool parse_input_option(int opt, const char *arg, void *data) {
+    int *input = (int *) data;
+
+    if (opt != 'i') {
+        return false;
+    }
+
+    /* what to do if optarg is non-numeric? */
+    *input = atoi(arg);
+    return true;
+}
+
+struct ingest_options opts;
+const struct video_mode *mode;
+
 struct v4l2_open_device {
     int fd;
     int n_buffers;
@@ -80,7 +97,6 @@ void free_open_device(v4l2_open_device *dev) {
 
 v4l2_open_device *open_v4l2(int argc, char * const *argv) {
     int input = 0;
-    int opt;
     int fd;
 
     v4l2_open_device *ret = NULL;
@@ -100,21 +116,17 @@ v4l2_open_device *open_v4l2(int argc, char * const *argv) {
             flag: NULL,
             val: 'i'
         },
+        { 0, 0, 0, 0 }
     };
 
-    
-    while ((opt = getopt_long(argc, argv, "i:", options, NULL)) != EOF) {
-        switch (opt) {
-            case 'i':
-                /* what to do if optarg is non-numeric? */
-                input = atoi(optarg);
-                break;
-            default:
-                usage(argv[0]);
-                return NULL;
-        }
+    if (!parse_ingest_options(argc, argv, &opts, "i:", options, 
+            parse_input_option, &input)) {
+        usage(argv[0]);
+        return NULL;
     }
 
+    mode = opts.mode;
+
     if (optind != argc - 2) {
         usage(argv[0]);
         return NULL;
@@ -155,22 +167,24 @@ v4l2_open_device *open_v4l2(int argc, char * const *argv) {
         return NULL;
     }    
 
-    /* set up NTSC (hard code for now) */
-    v4l2_std_id standard = V4L2_STD_NTSC_M;
-    if (ioctl(fd, VIDIOC_S_STD, &standard) == -1) {
-        perror("set video standard");
-        close(fd);
-        return NULL;
+    /* analog cards need to be told the standard; HD ones don't have one */
+    if (strcmp(mode->name, "ntsc") == 0) {
+        v4l2_std_id standard = V4L2_STD_NTSC_M;
+        if (ioctl(fd, VIDIOC_S_STD, &standard) == -1) {
+            perror("set video standard");
+            close(fd);
+            return NULL;
+        }
     }
 
     /* fiddle with VIDIOC_CROPCAP? */
 
     /* attempt to set video format */
     fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    fmt.fmt.pix.width = 720;
-    fmt.fmt.pix.height = 480;
+    fmt.fmt.pix.width = mode->w;
+    fmt.fmt.pix.height = mode->h;
     fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_UYVY;
-    fmt.fmt.pix.field = V4L2_FIELD_INTERLACED;
+    fmt.fmt.pix.field = mode->interlaced ? V4L2_FIELD_INTERLACED : V4L2_FIELD_NONE;
 
     if (ioctl(fd, VIDIOC_S_FMT, &fmt) == -1) {
         perror("set up capture format");
@@ -239,7 +253,6 @@ v4l2_open_device *open_v4l2(int argc, char * const *argv) {
 }
 
 int main(int argc, char **argv) {
-    MJPEGEncoder enc;
     EncodeStats stats(29.97);
 
     struct v4l2_open_device *dev = open_v4l2(argc, argv);
@@ -256,11 +269,13 @@ int main(int argc, char **argv) {
     // print out some statistics after every 60 frames we finish
     stats.autoprint(60);
 
-    MmapBuffer buf(argv[argc - 1], MAX_FRAME_SIZE, true);
+    MmapBuffer *buf = open_ingest_buffer(argv[argc - 1], &opts);
     MmapState clock_ipc("clock_ipc");
 
-    /* DV = 720x480, capture card = 720x486 */
-    int frame_w = 720, frame_h = 480;
+    IngestPipeline pipeline(buf, mode, &clock_ipc);
+    pipeline.set_options(&opts);
+    pipeline.set_stats(&stats);
+    pipeline.start( );
 
     Picture *p_current;
     Picture *p_last = NULL;
@@ -292,19 +307,16 @@ int main(int argc, char **argv) {
         p_current = dev->buffers[current_buf];
 
         if (p_last != NULL) {
-            make_odd_dominant(p_last, p_current);
-            // encode and store the data
-            mjpeg_frame *frm = enc.encode_full(p_last, true);
-
-            // (get scoreboard clock info)
-            clock_ipc.get(&frm->clock, sizeof(frm->clock));
-
-            frm->odd_dominant = true;
-            frm->interlaced = false;
-
-            buf.put(frm, sizeof(struct mjpeg_frame) + frm->f1size);
-            stats.output_bytes(frm->f1size);
-            stats.finish_frames(1);
+            /* 
+             * The card hands us NTSC even-dominant; only shuffle fields
+             * around when the mode wants something else.
+             */
+            if (mode->odd_dominant) {
+                make_odd_dominant(p_last, p_current);
+            }
+            // copy it out so the driver can have the buffer straight back,
+            // and leave encoding and storing it to the pipeline
+            pipeline.submit(Picture::copy(p_last));
 
             /* pass buffer back to v4l2 driver */
             if (ioctl(dev->fd, VIDIOC_QBUF, &v4l_lastbuf) == -1) {
@@ -0,0 +1,46 @@
+/*
+ * video_mode.cpp
+ *
+ * This file is part of openreplay. See the README file for the license
+ * terms governing its use.
+ */
+
+#include "video_mode.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static const struct video_mode modes[] = {
+    { "ntsc", 720, 480, 1001, 30000, true, true, 'ntsc' },
+    { "1080i5994", 1920, 1080, 1001, 30000, true, false, 'Hi59' },
+    { "720p5994", 1280, 720, 1001, 60000, false, false, 'hp59' },
+    { NULL, 0, 0, 0, 0, false, false, 0 }
+};
+
+const struct video_mode *find_video_mode(const char *name) {
+    const struct video_mode *mode;
+
+    for (mode = modes; mode->name != NULL; mode++) {
+        if (strcmp(mode->name, name) == 0) {
+            return mode;
+        }
+    }
+
+    return NULL;
+}
+
+const struct video_mode *default_video_mode(void) {
+    return &modes[0];
+}
+
+void list_video_modes(void) {
+    const struct video_mode *mode;
+
+    fprintf(stderr, "available video modes:\n");
+    for (mode = modes; mode->name != NULL; mode++) {
+        fprintf(stderr, "    %s: %dx%d%c %.2f\n", mode->name, mode->w, mode->h,
+            mode->interlaced ? 'i' : 'p', 
+            (float)mode->time_base / (float)mode->frame_duration 
+                * (mode->interlaced ? 2 : 1));
+    }
+}
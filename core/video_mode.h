@@ -0,0 +1,29 @@
+#ifndef _VIDEO_MODE_H
+#define _VIDEO_MODE_H
+
+#include <stdint.h>
+
+/*
+ * Video formats we know how to capture, store and play out.
+ * Frames are always stored as 8-bit 4:2:2 at this geometry.
+ */
+struct video_mode {
+    const char *name;
+    uint16_t w, h;
+
+    /* frame rate = time_base / frame_duration (e.g. 30000 / 1001) */
+    int frame_duration;
+    int time_base;
+
+    bool interlaced;
+    bool odd_dominant; /* NTSC is bottom field first, 1080i is top first */
+
+    /* BMDDisplayMode, spelled out so this doesn't need the Decklink SDK */
+    uint32_t decklink_mode;
+};
+
+const struct video_mode *find_video_mode(const char *name);
+const struct video_mode *default_video_mode(void);
+void list_video_modes(void);
+
+#endif